@@ -3,852 +3,8653 @@
 #include <string>
 #include <cctype>
 #include <map>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
-
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <type_traits>
+#include <string_view>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <memory>
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-enum TokenType {
+// A diagnostic that stops the compilation of one file. Thrown by the lexer,
+// parser and code generators, and reported by the driver, so one bad input
+// does not take down the others in a batch.
+struct CompileError : runtime_error {
+    explicit CompileError(const string &message) : runtime_error(message) {}
+};
+
+enum TokenType : uint8_t {
     T_FLOAT, T_DOUBLE, T_BOOL, T_CHAR, T_STRING, T_JABTAK, T_FOR,
     T_INT, T_ID, T_NUM, T_AGAR, T_WARNA, T_WAPSI,
     T_ASSIGN, T_PLUS, T_MINUS, T_MUL, T_DIV, 
     T_LPAREN, T_RPAREN, T_LBRACE, T_RBRACE,  
     T_SEMICOLON,  T_LT, T_LE , T_GT , T_GE , T_EQ, T_NEQ, T_AND, T_OR,
     T_EOF, T_COUT, T_LSHIFT, T_STRING_LITERAL,
-    T_VOID,
+    T_VOID, T_TRUE, T_FALSE,
 };
 
+// Tokens are packed records that point back into the source buffer; the text
+// of a token is src.substr(offset, length). For string literals the span is
+// the raw text between the quotes, escapes are decoded when the parser needs it.
 struct Token {
     TokenType type;
-    string value;
-    int line;       
+    uint32_t offset;
+    uint32_t length;
+    uint32_t line;
+};
+
+// Reserved words. Adding a keyword only needs a new row here; the perfect hash
+// below is recomputed at compile time.
+struct Keyword {
+    string_view text;
+    TokenType type;
+};
+
+constexpr Keyword keywords[] = {
+    {"int", T_INT}, {"float", T_FLOAT}, {"double", T_DOUBLE}, {"bool", T_BOOL},
+    {"char", T_CHAR}, {"string", T_STRING}, {"agar", T_AGAR}, {"warna", T_WARNA},
+    {"wapsi", T_WAPSI}, {"jabtak", T_JABTAK}, {"for", T_FOR}, {"cout", T_COUT},
+    {"void", T_VOID}, {"true", T_TRUE}, {"false", T_FALSE},
+};
+
+constexpr size_t KEYWORD_COUNT = sizeof(keywords) / sizeof(keywords[0]);
+constexpr int KEYWORD_HASH_BITS = 6;
+constexpr size_t KEYWORD_SLOTS = size_t(1) << KEYWORD_HASH_BITS;
+
+// Seeded hash over the length and the first, second and last characters.
+constexpr uint32_t keywordHash(uint32_t seed, string_view word) {
+    uint32_t h = seed ^ ((uint32_t)word.size() * 0x9E3779B1u);
+    h = (h ^ (unsigned char)word[0]) * 0x85EBCA6Bu;
+    h = (h ^ (unsigned char)word[word.size() > 1 ? 1 : 0]) * 0xC2B2AE35u;
+    h = (h ^ (unsigned char)word[word.size() - 1]) * 0x27D4EB2Fu;
+    return h >> (32 - KEYWORD_HASH_BITS);
+}
+
+struct KeywordTable {
+    uint32_t seed = 0;
+    int8_t slots[KEYWORD_SLOTS] = {};       // index into keywords, -1 if empty
+};
+
+// Searches for a seed that maps every keyword to its own slot.
+constexpr KeywordTable buildKeywordTable() {
+    for (uint32_t seed = 1; seed < 4096; seed++) {
+        KeywordTable table;
+        table.seed = seed;
+        for (size_t i = 0; i < KEYWORD_SLOTS; i++) table.slots[i] = -1;
+        bool collision = false;
+        for (size_t k = 0; k < KEYWORD_COUNT && !collision; k++) {
+            uint32_t slot = keywordHash(seed, keywords[k].text);
+            if (table.slots[slot] != -1) collision = true;
+            else table.slots[slot] = (int8_t)k;
+        }
+        if (!collision) return table;
+    }
+    return KeywordTable();
+}
+
+constexpr KeywordTable keywordTable = buildKeywordTable();
+static_assert(keywordTable.seed != 0, "No perfect hash seed for the keyword set, raise KEYWORD_HASH_BITS");
+
+// One probe and at most one comparison per identifier.
+inline TokenType lookupKeyword(string_view word) {
+    int k = keywordTable.slots[keywordHash(keywordTable.seed, word)];
+    if (k >= 0 && keywords[k].text == word) return keywords[k].type;
+    return T_ID;
+}
+
+// Read-only view of a whole source file. The file is memory-mapped so the
+// lexer works on the page cache directly instead of a heap copy. Pipes,
+// terminals and anything else that cannot be mapped are read into a buffer.
+class SourceFile {
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    ~SourceFile() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data) munmap((void *)data, size);
+        if (fd >= 0) ::close(fd);
+#endif
+    }
+
+    bool open(const string &path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &fileSize)) return readAll();
+        size = (size_t)fileSize.QuadPart;
+        if (size == 0) return true;         // Nothing to map, text() is empty
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        return data != nullptr || readAll();
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        if (!S_ISREG(st.st_mode)) return readAll();     // A pipe's size says nothing
+        size = (size_t)st.st_size;
+        if (size == 0) return true;         // Nothing to map, text() is empty
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) return readAll();
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = (const char *)p;
+        return true;
+#endif
+    }
+
+    string_view text() const {
+        return data ? string_view(data, size) : string_view(buffer);
+    }
+
+private:
+    const char *data = nullptr;     // The mapping, if there is one
+    size_t size = 0;
+    string buffer;                  // The contents otherwise
+
+    // Reads the file from the current position to its end into buffer.
+    bool readAll() {
+        char chunk[1 << 16];
+        for (;;) {
+#ifdef _WIN32
+            DWORD n = 0;
+            if (!ReadFile(file, chunk, sizeof(chunk), &n, nullptr)) return GetLastError() == ERROR_BROKEN_PIPE;
+#else
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return false;
+#endif
+            if (n == 0) return true;
+            buffer.append(chunk, (size_t)n);
+        }
+    }
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+// Bulk character scanners used by the lexer. Each one returns the first
+// position at or after p that ends the run it skips (or the terminator it
+// looks for), or end. The ones that can cross lines add the '\n's they pass
+// over to lines. A vector implementation is picked once at startup; the
+// scalar one is the reference and is used when nothing better is available.
+struct ScanKernels {
+    const char *name;
+    const char *(*skipSpace)(const char *p, const char *end, uint32_t &lines);
+    const char *(*skipWord)(const char *p, const char *end);            // [A-Za-z0-9]
+    const char *(*skipNumber)(const char *p, const char *end);          // [0-9.]
+    const char *(*findLineEnd)(const char *p, const char *end);         // '\n'
+    const char *(*findCommentEnd)(const char *p, const char *end, uint32_t &lines);  // "*/"
+    const char *(*findQuoteOrEscape)(const char *p, const char *end);   // '"' or '\\'
+};
+
+namespace scalar_scan {
+    inline bool isSpace(unsigned char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+    inline bool isWord(unsigned char c) { return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'); }
+    inline bool isNumber(unsigned char c) { return (c >= '0' && c <= '9') || c == '.'; }
+
+    const char *skipSpace(const char *p, const char *end, uint32_t &lines) {
+        for (; p < end && isSpace((unsigned char)*p); p++) {
+            if (*p == '\n') lines++;
+        }
+        return p;
+    }
+    const char *skipWord(const char *p, const char *end) {
+        while (p < end && isWord((unsigned char)*p)) p++;
+        return p;
+    }
+    const char *skipNumber(const char *p, const char *end) {
+        while (p < end && isNumber((unsigned char)*p)) p++;
+        return p;
+    }
+    const char *findLineEnd(const char *p, const char *end) {
+        while (p < end && *p != '\n') p++;
+        return p;
+    }
+    const char *findCommentEnd(const char *p, const char *end, uint32_t &lines) {
+        for (; p < end && !(*p == '*' && p + 1 < end && p[1] == '/'); p++) {
+            if (*p == '\n') lines++;
+        }
+        return p;
+    }
+    const char *findQuoteOrEscape(const char *p, const char *end) {
+        while (p < end && *p != '"' && *p != '\\') p++;
+        return p;
+    }
+}
+
+const ScanKernels scalarScanKernels = {
+    "scalar", scalar_scan::skipSpace, scalar_scan::skipWord, scalar_scan::skipNumber,
+    scalar_scan::findLineEnd, scalar_scan::findCommentEnd, scalar_scan::findQuoteOrEscape,
+};
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_SCAN_KERNELS 1
+
+// The SSE2 and AVX2 kernels share one body, written against a few wrappers.
+// Every kernel classifies a whole block into a bit mask, handles full blocks
+// only and leaves the tail (and any mapping boundary) to the scalar code.
+#define SCAN_KERNELS(NS, TARGET, VEC, WIDTH, LOAD, SET1, CMPEQ, AND, OR, MAXU, MINU, MOVEMASK)           \
+namespace NS {                                                                                          \
+    typedef uint32_t Mask;                                                                              \
+    TARGET static inline VEC load(const char *p) { return LOAD((const VEC *)p); }                       \
+    TARGET static inline VEC inRange(VEC x, char lo, char hi) {                                         \
+        return AND(CMPEQ(MAXU(x, SET1(lo)), x), CMPEQ(MINU(x, SET1(hi)), x));                           \
+    }                                                                                                   \
+    TARGET static inline Mask mask(VEC x) { return (Mask)MOVEMASK(x); }                                 \
+    TARGET static inline Mask spaceMask(VEC x) { return mask(OR(CMPEQ(x, SET1(' ')), inRange(x, '\t', '\r'))); } \
+    TARGET static inline Mask digitMask(VEC x) { return mask(inRange(x, '0', '9')); }                   \
+    TARGET static inline Mask wordMask(VEC x) {                                                         \
+        return mask(OR(inRange(x, '0', '9'), inRange(OR(x, SET1(0x20)), 'a', 'z')));                    \
+    }                                                                                                   \
+    TARGET static inline Mask eqMask(VEC x, char c) { return mask(CMPEQ(x, SET1(c))); }                 \
+    static inline uint32_t below(Mask m, int n) { return n >= 32 ? m : (m & ((1u << n) - 1)); }         \
+    static const Mask FULL = WIDTH == 32 ? 0xFFFFFFFFu : 0xFFFFu;                                       \
+                                                                                                        \
+    TARGET const char *skipSpace(const char *p, const char *end, uint32_t &lines) {                     \
+        while (end - p >= WIDTH) {                                                                      \
+            VEC x = load(p);                                                                            \
+            Mask stop = ~spaceMask(x) & FULL;                                                           \
+            Mask nl = eqMask(x, '\n');                                                                  \
+            if (stop) {                                                                                 \
+                int n = __builtin_ctz(stop);                                                            \
+                lines += __builtin_popcount(below(nl, n));                                              \
+                return p + n;                                                                           \
+            }                                                                                           \
+            lines += __builtin_popcount(nl);                                                            \
+            p += WIDTH;                                                                                 \
+        }                                                                                               \
+        return scalar_scan::skipSpace(p, end, lines);                                                   \
+    }                                                                                                   \
+    TARGET const char *skipWord(const char *p, const char *end) {                                       \
+        while (end - p >= WIDTH) {                                                                      \
+            Mask stop = ~wordMask(load(p)) & FULL;                                                      \
+            if (stop) return p + __builtin_ctz(stop);                                                   \
+            p += WIDTH;                                                                                 \
+        }                                                                                               \
+        return scalar_scan::skipWord(p, end);                                                           \
+    }                                                                                                   \
+    TARGET const char *skipNumber(const char *p, const char *end) {                                     \
+        while (end - p >= WIDTH) {                                                                      \
+            VEC x = load(p);                                                                            \
+            Mask stop = ~(digitMask(x) | eqMask(x, '.')) & FULL;                                        \
+            if (stop) return p + __builtin_ctz(stop);                                                   \
+            p += WIDTH;                                                                                 \
+        }                                                                                               \
+        return scalar_scan::skipNumber(p, end);                                                         \
+    }                                                                                                   \
+    TARGET const char *findLineEnd(const char *p, const char *end) {                                    \
+        while (end - p >= WIDTH) {                                                                      \
+            Mask hit = eqMask(load(p), '\n');                                                           \
+            if (hit) return p + __builtin_ctz(hit);                                                     \
+            p += WIDTH;                                                                                 \
+        }                                                                                               \
+        return scalar_scan::findLineEnd(p, end);                                                        \
+    }                                                                                                   \
+    TARGET const char *findCommentEnd(const char *p, const char *end, uint32_t &lines) {                \
+        while (end - p > WIDTH) {       /* reads p[WIDTH] through the shifted load */                   \
+            VEC x = load(p);                                                                            \
+            Mask hit = eqMask(x, '*') & eqMask(load(p + 1), '/');                                       \
+            Mask nl = eqMask(x, '\n');                                                                  \
+            if (hit) {                                                                                  \
+                int n = __builtin_ctz(hit);                                                             \
+                lines += __builtin_popcount(below(nl, n));                                              \
+                return p + n;                                                                           \
+            }                                                                                           \
+            lines += __builtin_popcount(nl);                                                            \
+            p += WIDTH;                                                                                 \
+        }                                                                                               \
+        return scalar_scan::findCommentEnd(p, end, lines);                                              \
+    }                                                                                                   \
+    TARGET const char *findQuoteOrEscape(const char *p, const char *end) {                              \
+        while (end - p >= WIDTH) {                                                                      \
+            VEC x = load(p);                                                                            \
+            Mask hit = eqMask(x, '"') | eqMask(x, '\\');                                                \
+            if (hit) return p + __builtin_ctz(hit);                                                     \
+            p += WIDTH;                                                                                 \
+        }                                                                                               \
+        return scalar_scan::findQuoteOrEscape(p, end);                                                  \
+    }                                                                                                   \
+}
+
+SCAN_KERNELS(sse2_scan, __attribute__((target("sse2"))), __m128i, 16, _mm_loadu_si128, _mm_set1_epi8,
+             _mm_cmpeq_epi8, _mm_and_si128, _mm_or_si128, _mm_max_epu8, _mm_min_epu8, _mm_movemask_epi8)
+SCAN_KERNELS(avx2_scan, __attribute__((target("avx2"))), __m256i, 32, _mm256_loadu_si256, _mm256_set1_epi8,
+             _mm256_cmpeq_epi8, _mm256_and_si256, _mm256_or_si256, _mm256_max_epu8, _mm256_min_epu8, _mm256_movemask_epi8)
+#undef SCAN_KERNELS
+
+const ScanKernels sse2ScanKernels = {
+    "sse2", sse2_scan::skipSpace, sse2_scan::skipWord, sse2_scan::skipNumber,
+    sse2_scan::findLineEnd, sse2_scan::findCommentEnd, sse2_scan::findQuoteOrEscape,
+};
+const ScanKernels avx2ScanKernels = {
+    "avx2", avx2_scan::skipSpace, avx2_scan::skipWord, avx2_scan::skipNumber,
+    avx2_scan::findLineEnd, avx2_scan::findCommentEnd, avx2_scan::findQuoteOrEscape,
 };
+#endif
+
+// Best kernel set for this CPU, or the named one ("scalar", "sse2", "avx2")
+// when it is supported. Returns nullptr for an unknown or unsupported name.
+const ScanKernels *selectScanKernels(const string &name = "") {
+#ifdef HAVE_X86_SCAN_KERNELS
+    __builtin_cpu_init();
+    bool hasAvx2 = __builtin_cpu_supports("avx2");
+    bool hasSse2 = __builtin_cpu_supports("sse2");
+    if (name.empty()) return hasAvx2 ? &avx2ScanKernels : hasSse2 ? &sse2ScanKernels : &scalarScanKernels;
+    if (name == "avx2") return hasAvx2 ? &avx2ScanKernels : nullptr;
+    if (name == "sse2") return hasSse2 ? &sse2ScanKernels : nullptr;
+#endif
+    if (name.empty() || name == "scalar") return &scalarScanKernels;
+    return nullptr;
+}
 
 
 class Lexer {
 private:
-    string src;
+    string_view src;
     size_t pos;
-    int line;
+    uint32_t line;
+    const ScanKernels *scan;
 
 public:
-    Lexer(const string &src) {
+    Lexer(string_view src, const ScanKernels *scan = selectScanKernels()) {
         this->src = src;
         this->pos = 0;
         this->line = 1;     //Initializing Line Number with 1
+        this->scan = scan;
+        if (src.size() > UINT32_MAX) {
+            throw CompileError("Source file too large (limit is 4 GB)");
+        }
     }
 
-    vector<Token> tokenize() {
-        vector<Token> tokens;
+    // Lexes and returns the next token; keeps returning T_EOF at the end.
+    Token next() {
         while (pos < src.size()) {
             char current = src[pos];
 
-            if (isspace(current)) {
-                if (current == '\n') line++;
-                pos++;
+            if (isspace((unsigned char)current)) {
+                pos = scan->skipSpace(at(pos), end(), line) - at(0);
                 continue;
             }
             // Skip single-line comments
-            if (current == '/' && src[pos + 1] == '/') {
-                while (pos < src.size() && src[pos] != '\n') pos++;
+            if (current == '/' && peek(1) == '/') {
+                pos = scan->findLineEnd(at(pos), end()) - at(0);
                 continue;
             }
 
             // Skip multi-line comments
-            if (current == '/' && src[pos + 1] == '*') {
-                pos += 2;
-                while (pos < src.size() && !(src[pos] == '*' && src[pos + 1] == '/')) {
-                    if (src[pos] == '\n') line++; 
-                    pos++;
-                }
-                pos += 2; 
+            if (current == '/' && peek(1) == '*') {
+                pos = scan->findCommentEnd(at(pos + 2), end(), line) - at(0);
+                pos = min(pos + 2, src.size());
                 continue;
             }
             // Handle string literals
             if (current == '"') {
-                string strLiteral = "";
                 pos++; // Skip the opening quote
-                while (pos < src.size() && src[pos] != '"') {
-                    if (src[pos] == '\\' && pos + 1 < src.size()) { 
-                        // Handle escape sequences
+                size_t start = pos;
+                // Jump from one quote or backslash to the next
+                while ((pos = scan->findQuoteOrEscape(at(pos), end()) - at(0)) < src.size() && src[pos] != '"') {
+                    if (pos + 1 < src.size()) { 
+                        // Validate escape sequences, the parser decodes them
                         switch (src[pos + 1]) {
-                            case 'n': strLiteral += '\n'; break;
-                            case 't': strLiteral += '\t'; break;
-                            case '\\': strLiteral += '\\'; break;
-                            case '"': strLiteral += '\"'; break;
+                            case 'n': case 't': case '\\': case '"': break;
                             default:
-                                cout << "Invalid escape sequence at line " << line << endl;
-                                exit(1);
+                                throw CompileError("Invalid escape sequence at line " + to_string(line));
                         }
                         pos += 2;
                     } else {
-                        strLiteral += src[pos++];
+                        pos++;
                     }
                 }
                 if (pos >= src.size() || src[pos] != '"') {
-                    cout << "Unterminated string literal at line " << line << endl;
-                    exit(1);
+                    throw CompileError("Unterminated string literal at line " + to_string(line));
                 }
                 pos++; // Skip the closing quote
-                tokens.push_back(Token{T_STRING_LITERAL, strLiteral, line});
-                continue;
+                return make(T_STRING_LITERAL, start, pos - 1 - start);
             }
-            if (isdigit(current)) {
-                tokens.push_back(Token{T_NUM, consumeNumber(), line});
-                continue;
+            if (isdigit((unsigned char)current)) {
+                size_t start = pos;
+                consumeNumber();
+                return make(T_NUM, start, pos - start);
             }
-            if (isalpha(current)) {
-                string word = consumeWord();
-                if (word == "int") tokens.push_back(Token{T_INT, word, line});
-                else if (word == "float") tokens.push_back(Token{T_FLOAT, word, line});
-                else if (word == "double") tokens.push_back(Token{T_DOUBLE, word, line});
-                else if (word == "bool") tokens.push_back(Token{T_BOOL, word, line});
-                else if (word == "char") tokens.push_back(Token{T_CHAR, word, line});
-                else if (word == "string") tokens.push_back(Token{T_STRING, word, line});
-                else if (word == "agar") tokens.push_back(Token{T_AGAR, word, line});
-                else if (word == "warna") tokens.push_back(Token{T_WARNA, word, line});
-                else if (word == "wapsi") tokens.push_back(Token{T_WAPSI, word, line});
-                else if (word == "jabtak") tokens.push_back(Token{T_JABTAK, word, line});
-                else if (word == "for") tokens.push_back(Token{T_FOR, word, line});
-                else if (word == "cout") tokens.push_back(Token{T_COUT, word, line});
-                else if (word == "void") tokens.push_back(Token{T_VOID, word, line});
-                else tokens.push_back(Token{T_ID, word, line});
-                continue;
+            if (isalpha((unsigned char)current)) {
+                size_t start = pos;
+                string_view word = consumeWord();
+                return make(lookupKeyword(word), start, word.size());
             }
 
+            size_t start = pos;
+            TokenType type;
             switch (current) {
                 case '=':
-                    if (src[pos + 1] == '=') {
-                        tokens.push_back(Token{T_EQ, "==", line});
-                        pos++;
-                    } else {
-                        tokens.push_back(Token{T_ASSIGN, "=", line});
-                    }
+                    type = peek(1) == '=' ? T_EQ : T_ASSIGN;
                     break;
                 case '&':
-                    if (src[pos + 1] == '&') {
-                        tokens.push_back(Token{T_AND, "&&", line});
-                        pos++;
-                    }
+                    if (peek(1) != '&') { pos++; continue; }
+                    type = T_AND;
                     break;
                 case '|':
-                    if (src[pos + 1] == '|') {
-                        tokens.push_back(Token{T_OR, "||", line});
-                        pos++;
-                    }
+                    if (peek(1) != '|') { pos++; continue; }
+                    type = T_OR;
                     break;
                 case '!':
-                    if (src[pos + 1] == '=') {
-                        tokens.push_back(Token{T_NEQ, "!=", line});
-                        pos++;
-                    }
+                    if (peek(1) != '=') { pos++; continue; }
+                    type = T_NEQ;
                     break;
-                case '+': tokens.push_back(Token{T_PLUS, "+", line}); break;
-                case '-': tokens.push_back(Token{T_MINUS, "-", line}); break;
-                case '*': tokens.push_back(Token{T_MUL, "*", line}); break;
-                case '/': tokens.push_back(Token{T_DIV, "/", line}); break;
-                case '(': tokens.push_back(Token{T_LPAREN, "(", line}); break;
-                case ')': tokens.push_back(Token{T_RPAREN, ")", line}); break;
-                case '{': tokens.push_back(Token{T_LBRACE, "{", line}); break;
-                case '}': tokens.push_back(Token{T_RBRACE, "}", line}); break;
-                case ';': tokens.push_back(Token{T_SEMICOLON, ";", line}); break;
+                case '+': type = T_PLUS; break;
+                case '-': type = T_MINUS; break;
+                case '*': type = T_MUL; break;
+                case '/': type = T_DIV; break;
+                case '(': type = T_LPAREN; break;
+                case ')': type = T_RPAREN; break;
+                case '{': type = T_LBRACE; break;
+                case '}': type = T_RBRACE; break;
+                case ';': type = T_SEMICOLON; break;
                 case '>':
-                    if (src[pos + 1] == '=') {
-                        tokens.push_back(Token{T_GE, ">=", line});
-                        pos++; // Increment position to skip the '='
-                    } else {
-                        tokens.push_back(Token{T_GT, ">", line});
-                    }
+                    type = peek(1) == '=' ? T_GE : T_GT;
                     break;
                 case '<':
-                    if (src[pos + 1] == '=') {
-                        tokens.push_back(Token{T_LE, "<=", line});
-                        pos++; // Increment position to skip the '='
-                    } else if (src[pos + 1] == '<') {
-                        tokens.push_back(Token{T_LSHIFT, "<<", line});
-                        pos++; // Increment position to skip the '<'
-                    } else {
-                        tokens.push_back(Token{T_LT, "<", line});
-                    } 
+                    if (peek(1) == '=') type = T_LE;
+                    else if (peek(1) == '<') type = T_LSHIFT;
+                    else type = T_LT;
                     break;
                 default: 
-                    cout << "Unexpected character: " << current << " at line " << line << endl; 
-                    exit(1);
+                    throw CompileError("Unexpected character: " + string(1, current) + " at line " + to_string(line));
             }
-            pos++;
+            // Two-character operators all end in '=', '&', '|' or '<'
+            pos += (type == T_EQ || type == T_AND || type == T_OR || type == T_NEQ ||
+                    type == T_GE || type == T_LE || type == T_LSHIFT) ? 2 : 1;
+            return make(type, start, pos - start);
         }
-        tokens.push_back(Token{T_EOF, "", line});
-        return tokens;
+        return make(T_EOF, src.size(), 0);
     }
 
-    string consumeNumber() {
+    void consumeNumber() {
         size_t start = pos;
-        bool isPointValue = false;
-        int dotCount = 0;
-
-        while (pos < src.size() && (isdigit(src[pos]) || src[pos] == '.')) {
-            if (src[pos] == '.') {
-                dotCount++;
-                if (dotCount > 1) {
-                    cout << "Syntax error: Invalid number value at line " << line << endl;
-                    exit(1);
-                }
-                isPointValue = true; 
-            }
-            pos++;
-        }
-
-        string number = src.substr(start, pos - start);
-        if (isPointValue) {
-            return number;  
-        } else {
-            return number; 
+        pos = scan->skipNumber(at(pos), end()) - at(0);
+        if (count(at(start), at(pos), '.') > 1) {
+            throw CompileError("Syntax error: Invalid number value at line " + to_string(line));
         }
     }
 
 
-    string consumeWord() {
+    string_view consumeWord() {
         size_t start = pos;
-        while (pos < src.size() && isalnum(src[pos])) pos++;
+        pos = scan->skipWord(at(pos), end()) - at(0);
         return src.substr(start, pos - start);
     }
-};
-
-class SymbolTable {
-public:
 
-    void declareVariable(const string &name, const string &type) {
-        if (symbolTable.find(name) != symbolTable.end()) {
-            throw runtime_error("Semantic error: Variable '" + name + "' is already declared.");
-        }
-        symbolTable[name] = type;
-    }
+private:
+    const char *at(size_t offset) const { return src.data() + offset; }
+    const char *end() const { return src.data() + src.size(); }
 
-    string getVariableType(const string &name) {
-        if (symbolTable.find(name) == symbolTable.end()) {
-            throw runtime_error("Semantic error: Variable '" + name + "' is not declared.");
-        }
-        return symbolTable[name];
+    // The mapped buffer has no terminating NUL, so look-ahead is bounds checked.
+    char peek(size_t offset) const {
+        return pos + offset < src.size() ? src[pos + offset] : '\0';
     }
 
-    bool isDeclared(const string &name) const {
-        return symbolTable.find(name) != symbolTable.end();
+    Token make(TokenType type, size_t start, size_t length) const {
+        return Token{type, (uint32_t)start, (uint32_t)length, line};
     }
-
-private:
-    map<string, string> symbolTable;
 };
 
-class IntermediateCodeGnerator {
+// Pull-based token source for the parser. Tokens are lexed on demand into a
+// small ring buffer, so memory stays flat however large the input is and
+// parsing starts as soon as the first token is available.
+class TokenStream {
 public:
-    vector<string> instructions;
-    int tempCount = 0;
-    int lblCount = 1;
+    static const size_t LOOKAHEAD = 4;      // Power of two; parseStatement peeks two tokens ahead
 
-    string newTemp() {
-        return "t" + to_string(tempCount++);
+    TokenStream(Lexer &lexer) : lexer(lexer) {
+        for (size_t i = 0; i < LOOKAHEAD; i++) buffer[i] = lexer.next();
     }
-    string newLabel(){
-        return "L" + to_string(lblCount++);
+
+    const Token &peek(size_t ahead = 0) const {
+        return buffer[(head + ahead) & (LOOKAHEAD - 1)];
     }
 
-    void addInstruction(const string &instr) {
-        instructions.push_back(instr);
+    // Returns the current token and moves past it.
+    Token next() {
+        Token current = buffer[head];
+        buffer[head] = lexer.next();
+        head = (head + 1) & (LOOKAHEAD - 1);
+        consumed++;
+        return current;
     }
 
-    void printInstructions() {
-        for (const auto &instr : instructions) {
-            cout << instr << endl;
+    void advance() { next(); }
+
+    size_t tokensConsumed() const { return consumed; }
+
+private:
+    Lexer &lexer;
+    Token buffer[LOOKAHEAD];
+    size_t head = 0;
+    size_t consumed = 0;
+};
+
+// Decodes the escape sequences of a string literal token.
+string unescapeStringLiteral(string_view raw) {
+    string text;
+    text.reserve(raw.size());
+    for (size_t i = 0; i < raw.size(); i++) {
+        if (raw[i] == '\\' && i + 1 < raw.size()) {
+            switch (raw[++i]) {
+                case 'n': text += '\n'; break;
+                case 't': text += '\t'; break;
+                default: text += raw[i]; break;     // \\ and \"
+            }
+        } else {
+            text += raw[i];
         }
     }
+    return text;
+}
 
+enum VarType : uint8_t {
+    TYPE_INT, TYPE_FLOAT, TYPE_DOUBLE, TYPE_BOOL, TYPE_CHAR, TYPE_STRING,
 };
 
-class AssemblyCodeGenerator {
+const char *typeName(VarType type) {
+    switch (type) {
+        case TYPE_INT: return "int";
+        case TYPE_FLOAT: return "float";
+        case TYPE_DOUBLE: return "double";
+        case TYPE_BOOL: return "bool";
+        case TYPE_CHAR: return "char";
+        default: return "string";
+    }
+}
+
+// Maps identifier text to dense integer ids with a flat open-addressing
+// (linear probing) table. The views it hands out stay valid for its lifetime.
+class StringInterner {
 public:
-    vector<string> assemblyInstructions;
+    StringInterner() : slots(1024, -1) {}
 
-    void generateFromTAC(const vector<string>& tacInstructions) {
-        for (const string& tac : tacInstructions) {
-            processTACInstruction(tac);
+    int intern(string_view text) {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash<string_view>()(text) & mask; ; i = (i + 1) & mask) {
+            if (slots[i] < 0) {
+                int id = (int)names.size();
+                storage.emplace_back(text);
+                names.push_back(storage.back());
+                slots[i] = id;
+                if (names.size() * 2 > slots.size()) grow();
+                return id;
+            }
+            if (names[slots[i]] == text) return slots[i];
         }
     }
 
-    void processTACInstruction(const string& tac) {
-        istringstream iss(tac);
-        vector<string> parts;
-        string part;
+    string_view name(int id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+private:
+    vector<int> slots;              // -1 when empty, power-of-two size, at most half full
+    vector<string_view> names;      // id -> text
+    deque<string> storage;          // Owns the text; deque keeps references stable
 
-        // Split the TAC instruction into parts
-        while (iss >> part) {
-            parts.push_back(part);
+    void grow() {
+        vector<int> bigger(slots.size() * 2, -1);
+        size_t mask = bigger.size() - 1;
+        for (int id = 0; id < (int)names.size(); id++) {
+            size_t i = hash<string_view>()(names[id]) & mask;
+            while (bigger[i] >= 0) i = (i + 1) & mask;
+            bigger[i] = id;
         }
+        slots.swap(bigger);
+    }
+};
 
-        if (parts.size() == 3 && parts[1] == "=") {
-            // Assignment (e.g., d = 2.7)
-            if (isNumber(parts[2])) {
-                assemblyInstructions.push_back("MOV " + parts[0] + ", " + parts[2]);
-            } else {
-                assemblyInstructions.push_back("MOV " + parts[0] + ", [" + parts[2] + "]");
-            }
-        } else if (parts.size() == 5 && parts[3] == "+") {
-            // Addition (e.g., t0 = a + 10)
-            assemblyInstructions.push_back("MOV AX, [" + parts[2] + "]");
-            assemblyInstructions.push_back("ADD AX, " + parts[4]);
-            assemblyInstructions.push_back("MOV [" + parts[0] + "], AX");
-        } else if (parts.size() == 5 && parts[3] == "-") {
-            // Subtraction (e.g., t1 = x - y)
-            assemblyInstructions.push_back("MOV AX, " + parts[2]);
-            assemblyInstructions.push_back("SUB AX, " + parts[4]);
-            assemblyInstructions.push_back("MOV " + parts[0] + ", AX");
-        } else if (parts.size() == 5 && parts[3] == "*") {
-            // Multiplication (e.g., t0 = y * 3)
-            assemblyInstructions.push_back("MOV AX, " + parts[2]);  // Load the first operand
-            assemblyInstructions.push_back("IMUL AX, " + parts[4]); // Multiply by the second operand
-            assemblyInstructions.push_back("MOV " + parts[0] + ", AX");  // Store the result in the destination
-        } else if (parts.size() == 5 && parts[3] == "/") {
-            // Division (e.g., t1 = x / y)
-            assemblyInstructions.push_back("MOV AX, " + parts[2]);
-            assemblyInstructions.push_back("MOV DX, 0"); // Clear DX before division
-            assemblyInstructions.push_back("IDIV " + parts[4]);
-            assemblyInstructions.push_back("MOV " + parts[0] + ", AX");
-        } else if (parts.size() == 5 && parts[3] == "!=") {
-            // Not equal (e.g., t3 = a != 10)
-            assemblyInstructions.push_back("MOV AX, [" + parts[2] + "]");
-            assemblyInstructions.push_back("CMP AX, " + parts[4]);
-            assemblyInstructions.push_back("SETE [" + parts[0] + "]");
-        } else if (parts.size() == 5 && parts[3] == "<") {
-            // Less than (e.g., t5 = i < 10)
-            assemblyInstructions.push_back("MOV AX, [" + parts[2] + "]");
-            assemblyInstructions.push_back("CMP AX, " + parts[4]);
-            assemblyInstructions.push_back("SETL [" + parts[0] + "]");
-        } else if (parts.size() == 5 && parts[3] == "==") {
-            // Equal (e.g., t1 = c == 10)
-            assemblyInstructions.push_back("MOV AX, [" + parts[2] + "]");
-            assemblyInstructions.push_back("CMP AX, " + parts[4]);
-            assemblyInstructions.push_back("SETE [" + parts[0] + "]");
-        } else if (parts.size() == 4 && parts[0] == "agar") {
-            // Conditional jump (e.g., agar t1 goto L1)
-            assemblyInstructions.push_back("MOV AL, [" + parts[1] + "]");
-            assemblyInstructions.push_back("CMP AL, 1");
-            assemblyInstructions.push_back("JE " + parts[3]);
-        } else if (parts.size() == 2 && parts[0] == "goto") {
-            // Unconditional jump (e.g., goto L3)
-            assemblyInstructions.push_back("JMP " + parts[1]);
-        } else if (parts.size() == 2 && parts[1].back() == ':') {
-            // Label (e.g., L1:)
-            assemblyInstructions.push_back(parts[0] + ":");
-        } else if (parts.size() == 2 && parts[0] == "print") {
-            // Print statement (e.g., print "done")
-            assemblyInstructions.push_back("PUSH " + parts[1]);
-            assemblyInstructions.push_back("CALL PRINT");
-        } else if (parts.size() == 2 && parts[0] == "wapsi") {
-            // Return (e.g., wapsi b)
-            assemblyInstructions.push_back("MOV AX, [" + parts[1] + "]");
-            assemblyInstructions.push_back("RET");
-        } else if (parts.size() == 1 && parts[0][0] == 'L') {
-            // Return (e.g., wapsi b)
-            assemblyInstructions.push_back(parts[0]);
-        } 
-        else if (parts.size() == 1 && parts[0].find("_func") != string::npos) {
-            // Function label
-            assemblyInstructions.push_back(parts[0] + ":");
-            assemblyInstructions.push_back("PUSH BP");
-            assemblyInstructions.push_back("MOV BP, SP");
-        } else if (parts[0] == "RET") {
-            // Return instruction
-            assemblyInstructions.push_back("MOV SP, BP");
-            assemblyInstructions.push_back("POP BP");
-            assemblyInstructions.push_back("RET");
-        } else if (parts[0] == "CALL") {
-            // Function call
-            assemblyInstructions.push_back("CALL " + parts[1]);
-        } else {
-            cout << "Unsupported TAC: " << tac << endl;
-            exit(1);
-        }
-    }
-
-    bool isNumber(const string& str) {
-        return !str.empty() && all_of(str.begin(), str.end(), [](unsigned char c) { return isdigit(c) || c == '.'; });
+// Block-scoped symbol table. Every declaration becomes a symbol with a dense
+// id; binding[nameId] points at the innermost visible one and each symbol
+// remembers the binding it shadows, so leaving a scope just walks back over
+// the declarations made in it. Symbols themselves are kept for the later
+// passes, and a name declared more than once gets a distinct storage name.
+class SymbolTable {
+public:
+    struct Symbol {
+        int nameId;
+        VarType type;
+        int depth;
+        int shadowed;               // Previously visible symbol with this name, or -1
+        string storageName;         // Name used in TAC and assembly, unique per symbol
+    };
+
+    SymbolTable() {
+        enterScope();   // Global scope
     }
 
-    void printAssemblyCode() {
-        for (const string& instr : assemblyInstructions) {
-            cout << instr << endl;
+    void enterScope() {
+        scopeMarks.push_back(scopeLog.size());
+    }
+
+    void exitScope() {
+        size_t mark = scopeMarks.back();
+        scopeMarks.pop_back();
+        while (scopeLog.size() > mark) {
+            const Symbol &symbol = symbols[scopeLog.back()];
+            binding[symbol.nameId] = symbol.shadowed;
+            scopeLog.pop_back();
         }
     }
 
-    void saveToFile(const string& filename) {
-        ofstream outFile(filename);
-        if (!outFile.is_open()) {
-            cout << "Error opening file for writing: " << filename << endl;
-            return;
+    int declareVariable(string_view name, VarType type) {
+        int nameId = interner.intern(name);
+        if (nameId >= (int)binding.size()) {
+            binding.resize(nameId + 1, -1);
+            declarations.resize(nameId + 1, 0);
         }
-        for (const string& instr : assemblyInstructions) {
-            outFile << instr << endl;
+        int current = binding[nameId];
+        int depth = (int)scopeMarks.size();
+        if (current >= 0 && symbols[current].depth == depth) {
+            throw CompileError("Semantic error: Variable '" + string(name) + "' is already declared.");
         }
-        outFile.close();
-    }
-};
+        int count = ++declarations[nameId];
+        string storageName(name);
+        if (count > 1) storageName += "_" + to_string(count);
 
-class Parser {
-public:
-    Parser(const vector<Token> &tokens, SymbolTable &symTable, IntermediateCodeGnerator &icg)
-        : tokens(tokens), pos(0), symTable(symTable), icg(icg) {}
+        int id = (int)symbols.size();
+        symbols.push_back(Symbol{nameId, type, depth, current, storageName});
+        binding[nameId] = id;
+        scopeLog.push_back(id);
+        return id;
+    }
 
-    void parseProgram() {
-        while (tokens[pos].type != T_EOF) {
-            parseStatement();
+    // Id of the innermost visible symbol called name.
+    int resolve(string_view name) {
+        int nameId = interner.intern(name);
+        if (nameId >= (int)binding.size() || binding[nameId] < 0) {
+            throw CompileError("Semantic error: Variable '" + string(name) + "' is not declared.");
         }
-        cout << "Parsing completed successfully! No Syntax Error" << endl;
+        return binding[nameId];
     }
 
-private:
-    vector<Token> tokens;
-    size_t pos;
-    SymbolTable &symTable;
-    IntermediateCodeGnerator &icg;
+    VarType getVariableType(string_view name) {
+        return symbols[resolve(name)].type;
+    }
 
-    void parseStatement() {
-        if (tokens[pos].type == T_VOID) {
-            parseFunctionDeclaration();
-        } else if (tokens[pos].type == T_ID && tokens[pos + 1].type == T_LPAREN) {
-            string functionName = expectAndReturnValue(T_ID);
-            parseFunctionCall(functionName);
-        }
-        else if (tokens[pos].type == T_INT || tokens[pos].type == T_FLOAT || tokens[pos].type == T_DOUBLE || 
-            tokens[pos].type == T_BOOL || tokens[pos].type == T_CHAR || tokens[pos].type == T_STRING) {
-            // Lookahead to check if it's a function or variable
-            if (tokens[pos + 1].type == T_ID && tokens[pos + 2].type == T_LPAREN) {
-                // Function declaration or definition
-                parseFunctionDeclaration();
-            } else {
-                // Variable declaration
-                parseDeclaration();
-            }
-        } else if (tokens[pos].type == T_ID) {
-            parseAssignment();
-        } else if (tokens[pos].type == T_AGAR) {
-            parseIfStatement();
-        } else if (tokens[pos].type == T_JABTAK) {
-            parseWhileStatement();
-        } else if (tokens[pos].type == T_FOR) {
-            parseForStatement();
-        } else if (tokens[pos].type == T_WAPSI) {
-            parseReturnStatement();
-        } else if (tokens[pos].type == T_LBRACE) {
-            parseBlock();
-        } else if (tokens[pos].type == T_COUT) {
-            parseCoutStatement();
-        } else {
-            cout << "Syntax error: unexpected token " << tokens[pos].value 
-                << " at line " << tokens[pos].line << endl;
-            exit(1);
-        }
+    bool isDeclared(string_view name) {
+        int nameId = interner.intern(name);
+        return nameId < (int)binding.size() && binding[nameId] >= 0;
     }
 
-    void parseFunctionDeclaration() {
-        TokenType returnType = tokens[pos].type; // Capture the return type
-        if (returnType != T_VOID && returnType != T_INT) {
-            throw std::runtime_error("Unsupported return type for function");
-        }
-        pos++; // Move past the return type
+    bool isGlobalScope() const { return scopeMarks.size() == 1; }
 
-        string functionName = expectAndReturnValue(T_ID); // Function name
-        expect(T_LPAREN); // Expect '('
-        expect(T_RPAREN); // Expect ')'
+    const Symbol &symbol(int id) const { return symbols[id]; }
+    size_t symbolCount() const { return symbols.size(); }
 
-        string functionLabel = functionName + "_func";
-        icg.addInstruction(functionLabel + ":"); // Add function label in TAC
+private:
+    StringInterner interner;
+    vector<Symbol> symbols;
+    vector<int> binding;            // nameId -> visible symbol or -1
+    vector<int> declarations;       // nameId -> number of symbols declared with that name
+    vector<int> scopeLog;           // Symbols declared in the open scopes, innermost last
+    vector<size_t> scopeMarks;      // scopeLog size when each open scope was entered
+};
 
-        expect(T_LBRACE); // Expect '{'
-        while (tokens[pos].type != T_RBRACE && tokens[pos].type != T_EOF) {
-            parseStatement(); // Parse statements inside the function
-        }
-        expect(T_RBRACE);
+// Three-address code is kept as typed quadruples. Operands are small (kind, id)
+// pairs; names, literals and strings live in the tables of the generator so the
+// backend never has to re-tokenize an instruction.
+enum TacOp : uint8_t {
+    TAC_ASSIGN,                                     // dst = a
+    TAC_ADD, TAC_SUB, TAC_MUL, TAC_DIV,             // dst = a op b
+    TAC_LT, TAC_LE, TAC_GT, TAC_GE, TAC_EQ, TAC_NEQ, TAC_AND, TAC_OR,
+    TAC_LABEL,                                      // a:
+    TAC_FUNC,                                       // a:  (function entry)
+    TAC_GOTO,                                       // goto a
+    TAC_AGAR,                                       // agar a goto b
+    TAC_AGAR_LT, TAC_AGAR_LE, TAC_AGAR_GT,          // agar a rel b goto dst  (compare and branch,
+    TAC_AGAR_GE, TAC_AGAR_EQ, TAC_AGAR_NEQ,         //   same order as TAC_LT..TAC_NEQ)
+    TAC_CALL,                                       // CALL a
+    TAC_RET,                                        // RET
+    TAC_PRINT,                                      // print a
+    TAC_WAPSI,                                      // wapsi [a]
+};
 
-        // Ensure int functions have a return statement
-        if (returnType == T_INT) {
-            icg.addInstruction("RET"); // Add a default return for safety
-        } else {
-            icg.addInstruction("RET");
-        }
-    }
+enum OperandKind : uint8_t {
+    OP_NONE, OP_TEMP, OP_VAR, OP_IMM, OP_LABEL, OP_FUNC, OP_STR,
+};
 
+struct Operand {
+    OperandKind kind = OP_NONE;
+    int id = 0;
 
-    void parseFunctionCall(const string& functionName) {
-        expect(T_LPAREN);       // Expect '('
-        expect(T_RPAREN);       // Expect ')'
+    bool operator==(const Operand &other) const { return kind == other.kind && id == other.id; }
+    bool operator!=(const Operand &other) const { return !(*this == other); }
+};
 
-        icg.addInstruction("CALL " + functionName + "_func");
-        expect(T_SEMICOLON);    // Expect ';'
+struct Quad {
+    TacOp op;
+    Operand dst, a, b;
+};
+
+inline bool isRelation(TacOp op) { return op >= TAC_LT && op <= TAC_NEQ; }
+inline bool isCompareBranch(TacOp op) { return op >= TAC_AGAR_LT && op <= TAC_AGAR_NEQ; }
+inline TacOp branchOn(TacOp relation) { return TacOp(TAC_AGAR_LT + (relation - TAC_LT)); }
+inline TacOp relationOf(TacOp branch) { return TacOp(TAC_LT + (branch - TAC_AGAR_LT)); }
+
+// Relation that holds exactly when the given one does not, for integers.
+// With a NaN operand every relation but != is false, so < and >= are not
+// each other's opposite for doubles; only == and != are.
+inline TacOp invertRelation(TacOp relation) {
+    switch (relation) {
+        case TAC_LT: return TAC_GE;
+        case TAC_LE: return TAC_GT;
+        case TAC_GT: return TAC_LE;
+        case TAC_GE: return TAC_LT;
+        case TAC_EQ: return TAC_NEQ;
+        default: return TAC_EQ;
     }
+}
 
+// Label a goto or branch may jump to, OP_NONE for other instructions.
+inline Operand jumpTarget(const Quad &q) {
+    if (q.op == TAC_GOTO) return q.a;
+    if (q.op == TAC_AGAR) return q.b;
+    if (isCompareBranch(q.op)) return q.dst;
+    return Operand();
+}
 
+// Runs a fixed set of independent tasks on a few threads. The tasks are
+// dealt round-robin to one deque per worker; a worker takes from the back of
+// its own deque and, once that is empty, steals from the front of the
+// others', so a handful of slow tasks does not leave the other threads idle.
+// The calling thread is one of the workers. Tasks must not throw; each is
+// told which worker runs it, for scratch space kept per worker.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threads) : threads(max(1u, threads)) {}
 
-    void parseCoutStatement() {
-        expect(T_COUT); // Expect the 'cout' token
+    unsigned threadCount() const { return threads; }
 
-        while (tokens[pos].type == T_LSHIFT) {
-            expect(T_LSHIFT); // Expect the '<<' operator
+    // Workers run() uses for count tasks, numbered from 0
+    unsigned workersFor(size_t count) const { return (unsigned)min<size_t>(threads, max<size_t>(count, 1)); }
 
-            if (tokens[pos].type == T_STRING_LITERAL) { // String literal
-                string strLiteral = tokens[pos].value;
-                pos++;
-                icg.addInstruction("print \"" + strLiteral + "\""); // Add print instruction for string
-            } else if (tokens[pos].type == T_ID) { // Variable name
-                string varName = tokens[pos].value;
-                symTable.getVariableType(varName); // Check if variable is declared
-                pos++;
-                icg.addInstruction("print " + varName); // Add print instruction for variable
-            } else {
-                throw std::runtime_error("Syntax error: Expected string literal or variable name after '<<'");
-            }
-        }
+    // Calls task(i, worker) for every i below count, returns when all are done
+    template <typename Task>
+    void run(size_t count, const Task &task) {
+        unsigned workers = workersFor(count);
+        vector<Queue> queues(workers);
+        for (size_t i = 0; i < count; i++) queues[i % workers].tasks.push_back(i);
+        auto work = [&](unsigned self) {
+            size_t index;
+            while (take(queues, self, index)) task(index, self);
+        };
+        vector<thread> helpers;
+        for (unsigned w = 1; w < workers; w++) helpers.emplace_back(work, w);
+        work(0);
+        for (thread &helper : helpers) helper.join();
+    }
 
-        expect(T_SEMICOLON); // Expect the semicolon at the end of the statement
+    static unsigned hardwareThreads() {
+        unsigned n = thread::hardware_concurrency();
+        return n ? n : 1;
     }
 
-    void parseDeclaration() {
-        TokenType varType = tokens[pos].type; 
-        expect(varType);
-        string varName = expectAndReturnValue(T_ID);
-        string typeString;
-        switch (varType) {
-            case T_INT:
-                typeString = "int";
-                break;
-            case T_FLOAT:
-                typeString = "float";
-                break;
-            case T_DOUBLE:
-                typeString = "double";
-                break;
-            case T_BOOL:
-                typeString = "bool";
-                break;
-            case T_CHAR:
-                typeString = "char";
-                break;
-            case T_STRING:
-                typeString = "string";
-                break;
-            default:
-                throw std::runtime_error("Unsupported type in declaration");
+private:
+    struct Queue {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    unsigned threads;
+
+    // No task adds others, so once every deque is empty the worker is done
+    static bool take(vector<Queue> &queues, unsigned self, size_t &index) {
+        {
+            lock_guard<mutex> guard(queues[self].lock);
+            if (!queues[self].tasks.empty()) {
+                index = queues[self].tasks.back();
+                queues[self].tasks.pop_back();
+                return true;
+            }
         }
-        symTable.declareVariable(varName, typeString);
-        expect(T_SEMICOLON);
+        for (size_t k = 1; k < queues.size(); k++) {
+            Queue &victim = queues[(self + k) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                index = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
     }
+};
+
+class IntermediateCodeGnerator {
+public:
+    vector<Quad> instructions;
+    int tempCount = 0;
+    int lblCount = 1;
 
+    vector<string> names;       // variables and function labels (OP_VAR, OP_FUNC)
+    vector<string> literals;    // numeric literals as written (OP_IMM)
+    vector<string> strings;     // string literals (OP_STR)
 
-    void parseAssignment() {
-        string varName = expectAndReturnValue(T_ID);
-        symTable.getVariableType(varName);  
-        expect(T_ASSIGN);
-        string expr = parseExpression();
-        icg.addInstruction(varName + " = " + expr); 
-        expect(T_SEMICOLON);
+    Operand newTemp() {
+        return Operand{OP_TEMP, tempCount++};
     }
-    void parseForAssignment() {
-        string varName = expectAndReturnValue(T_ID);
-        symTable.getVariableType(varName);  
-        expect(T_ASSIGN);
-        string expr = parseExpression();
-        icg.addInstruction(varName + " = " + expr); 
+    Operand newLabel(){
+        return Operand{OP_LABEL, lblCount++};
     }
-    void parseBlock() {
-        expect(T_LBRACE);
-        while (tokens[pos].type != T_RBRACE && tokens[pos].type != T_EOF) {
-            parseStatement();
+
+    Operand var(const string &name) { return Operand{OP_VAR, intern(name, names, nameIds)}; }
+    Operand var(const string &name, VarType type, bool global) {
+        Operand o = var(name);
+        if (o.id >= (int)varTypes.size()) {
+            varTypes.resize(names.size(), TYPE_INT);
+            globalVars.resize(names.size(), true);
         }
-        expect(T_RBRACE);
+        varTypes[o.id] = type;
+        globalVars[o.id] = global;
+        return o;
     }
+    VarType varType(const Operand &o) const { return o.id < (int)varTypes.size() ? varTypes[o.id] : TYPE_INT; }
+    // Globals may be touched by any call; locals only by the code of their own
+    // scope, unless they are shared (see markSharedLocals), which makes them count as globals.
+    bool isGlobal(const Operand &o) const { return o.id >= (int)globalVars.size() || globalVars[o.id]; }
+    void shareLocal(const Operand &o) { globalVars[o.id] = true; }
 
-    void parseIfStatement() {
-        expect(T_AGAR);    
-        expect(T_LPAREN); 
-        string cond = parseExpression();
-        expect(T_RPAREN);
-
-        string trueLabel = icg.newLabel();  // Generate new label for the true block
-        string falseLabel = icg.newLabel(); // Generate new label for the false block
-        string endLabel = icg.newLabel();   // Generate label for the end of the if-else
-
-        icg.addInstruction("agar " + cond + " goto " + trueLabel); 
-        icg.addInstruction("goto " + falseLabel); 
-
-        icg.addInstruction(trueLabel + ":");   // True block
-        if (tokens[pos].type == T_LBRACE) {
-            parseBlock();
-        } else {
-            parseStatement();
+    // Whether the function whose label is at quad begin calls anything,
+    // counting print, which calls into the runtime. Leaf functions need no frame.
+    bool makesCalls(size_t begin) const {
+        for (size_t i = begin + 1; i < instructions.size() && instructions[i].op != TAC_FUNC; i++) {
+            if (instructions[i].op == TAC_CALL || instructions[i].op == TAC_PRINT) return true;
         }
+        return false;
+    }
 
-        if (tokens[pos].type == T_WARNA) { // Else block
-            icg.addInstruction("goto " + endLabel);
-            icg.addInstruction(falseLabel + ":");
-            expect(T_WARNA);
-            if (tokens[pos].type == T_LBRACE) {
-                parseBlock();
-            } else {
-                parseStatement();
+    // Type of the value each temp holds, which TAC does not record: a copy
+    // has the type of its source, arithmetic is double if either side is
+    // (float and double both compute in double), relations and logical
+    // operators give bools. A temp assigned in several places gets the
+    // widest of their types. Unset temps read as int.
+    vector<VarType> tempTypes() const {
+        const int UNSET = -1;
+        auto rank = [](int type) { return type == TYPE_BOOL ? 1 : type == TYPE_DOUBLE ? 3 : type == UNSET ? 0 : 2; };
+        vector<int> types(tempCount, UNSET);
+        auto typeOf = [&](const Operand &o) -> int {
+            switch (o.kind) {
+                case OP_TEMP: return types[o.id];
+                case OP_VAR: return varType(o) == TYPE_FLOAT ? TYPE_DOUBLE : varType(o);
+                case OP_IMM: return literals[o.id].find_first_of(".eE") != string::npos ? TYPE_DOUBLE : TYPE_INT;
+                default: return TYPE_INT;
             }
-            icg.addInstruction(endLabel + ":");
-        } else {
-            icg.addInstruction(falseLabel + ":");
+        };
+        // Types only widen, so this settles after a few sweeps
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (const Quad &q : instructions) {
+                if (q.dst.kind != OP_TEMP) continue;
+                int type;
+                if (q.op == TAC_ASSIGN) type = typeOf(q.a);
+                else if (q.op >= TAC_LT && q.op <= TAC_OR) type = TYPE_BOOL;
+                else if (q.op >= TAC_ADD && q.op <= TAC_DIV) {
+                    type = typeOf(q.a) == TYPE_DOUBLE || typeOf(q.b) == TYPE_DOUBLE ? TYPE_DOUBLE : TYPE_INT;
+                } else continue;
+                int &current = types[q.dst.id];
+                if (rank(type) > rank(current)) {
+                    current = type;
+                    changed = true;
+                }
+            }
+        }
+        vector<VarType> result(tempCount, TYPE_INT);
+        for (int t = 0; t < tempCount; t++) {
+            if (types[t] != UNSET) result[t] = VarType(types[t]);
         }
+        return result;
     }
 
+    // A float or double variable or literal the code uses, or "" when it
+    // only computes with integers and bools.
+    string floatingPointOperand() const {
+        for (const Quad &q : instructions) {
+            for (const Operand *o : {&q.dst, &q.a, &q.b}) {
+                if (o->kind == OP_VAR && (varType(*o) == TYPE_FLOAT || varType(*o) == TYPE_DOUBLE)) return names[o->id];
+                if (o->kind == OP_IMM && literals[o->id].find_first_of(".eE") != string::npos) return literals[o->id];
+            }
+        }
+        return "";
+    }
 
-    void parseWhileStatement() {
-        expect(T_JABTAK);
-        expect(T_LPAREN);
-        string cond = parseExpression();
-        expect(T_RPAREN);
+    Operand func(const string &label) { return Operand{OP_FUNC, intern(label, names, nameIds)}; }
+    Operand imm(const string &literal) { return Operand{OP_IMM, intern(literal, literals, literalIds)}; }
+    Operand str(const string &text) { return Operand{OP_STR, intern(text, strings, stringIds)}; }
 
-        string startLabel = icg.newLabel();   // Label for the start of the loop
-        string trueLabel = icg.newLabel();    // Label for the true block
-        string endLabel = icg.newLabel();     // Label for exiting the loop
+    void addInstruction(TacOp op, Operand dst = Operand(), Operand a = Operand(), Operand b = Operand()) {
+        instructions.push_back(Quad{op, dst, a, b});
+    }
 
-        icg.addInstruction(startLabel + ":");
-        icg.addInstruction("agar " + cond + " goto " + trueLabel); 
-        icg.addInstruction("goto " + endLabel);
+    // Memory name of a temp or variable in the TAC dump and both assembly
+    // listings: tN for temps and v_name for variables, so no variable can
+    // pass for a temp or a label LN. The peephole pass relies on that to
+    // tell temps apart.
+    string memoryName(const Operand &o) const {
+        return o.kind == OP_TEMP ? "t" + to_string(o.id) : "v_" + names[o.id];
+    }
 
-        icg.addInstruction(trueLabel + ":");
-        if (tokens[pos].type == T_LBRACE) {
-            parseBlock();
-        } else {
-            parseStatement();
+    string operandToString(const Operand &o) const {
+        switch (o.kind) {
+            case OP_TEMP:
+            case OP_VAR: return memoryName(o);
+            case OP_LABEL: return "L" + to_string(o.id);
+            case OP_FUNC: return names[o.id];
+            case OP_IMM: return literals[o.id];
+            case OP_STR: return "\"" + strings[o.id] + "\"";
+            default: return "";
         }
-        icg.addInstruction("goto " + startLabel);
-        icg.addInstruction(endLabel + ":");
     }
 
+    // Text form of a quad, used only for --emit-tac.
+    string toString(const Quad &q) const {
+        switch (q.op) {
+            case TAC_ASSIGN: return operandToString(q.dst) + " = " + operandToString(q.a);
+            case TAC_LABEL:
+            case TAC_FUNC: return operandToString(q.a) + ":";
+            case TAC_GOTO: return "goto " + operandToString(q.a);
+            case TAC_AGAR: return "agar " + operandToString(q.a) + " goto " + operandToString(q.b);
+            case TAC_AGAR_LT:
+            case TAC_AGAR_LE:
+            case TAC_AGAR_GT:
+            case TAC_AGAR_GE:
+            case TAC_AGAR_EQ:
+            case TAC_AGAR_NEQ:
+                return "agar " + operandToString(q.a) + " " + opToString(relationOf(q.op)) + " " +
+                       operandToString(q.b) + " goto " + operandToString(q.dst);
+            case TAC_CALL: return "CALL " + operandToString(q.a);
+            case TAC_RET: return "RET";
+            case TAC_PRINT: return "print " + operandToString(q.a);
+            case TAC_WAPSI: return q.a.kind == OP_NONE ? "wapsi" : "wapsi " + operandToString(q.a);
+            default:
+                return operandToString(q.dst) + " = " + operandToString(q.a) + " " + opToString(q.op) + " " + operandToString(q.b);
+        }
+    }
 
-    void parseForStatement() {
-        expect(T_FOR);               
-        expect(T_LPAREN);            
+    static const char *opToString(TacOp op) {
+        switch (op) {
+            case TAC_ADD: return "+";
+            case TAC_SUB: return "-";
+            case TAC_MUL: return "*";
+            case TAC_DIV: return "/";
+            case TAC_LT: return "<";
+            case TAC_LE: return "<=";
+            case TAC_GT: return ">";
+            case TAC_GE: return ">=";
+            case TAC_EQ: return "==";
+            case TAC_NEQ: return "!=";
+            case TAC_AND: return "&&";
+            case TAC_OR: return "||";
+            default: return "?";
+        }
+    }
 
-        // Initialization
-        parseAssignment();           // Handles the initialization (e.g., `i = 0;`)
+    void printInstructions() {
+        for (const auto &instr : instructions) {
+            cout << toString(instr) << endl;
+        }
+    }
 
-        
-        string conditionLabel = icg.newLabel(); // Label for condition check
-        string bodyLabel = icg.newLabel();      // Label for the loop body
-        string incrementLabel = icg.newLabel(); // Label for increment step
-        string endLabel = icg.newLabel();       // Label for loop exit
+private:
+    unordered_map<string, int> nameIds, literalIds, stringIds;
+    vector<VarType> varTypes;   // Declared type of each OP_VAR name
+    vector<bool> globalVars;    // Whether each OP_VAR name is declared at file scope or shared
 
-        // Generate the condition check label
-        icg.addInstruction(conditionLabel + ":");
-        
-        // Parse and evaluate the condition
-        string cond = parseExpression();        // Handles condition (e.g., `i < 10`)
-        expect(T_SEMICOLON);
-        icg.addInstruction("agar " + cond + " goto " + bodyLabel);
-        icg.addInstruction("goto " + endLabel); // Exit if condition is false
+    static int intern(const string &text, vector<string> &table, unordered_map<string, int> &ids) {
+        auto it = ids.find(text);
+        if (it != ids.end()) return it->second;
+        int id = (int)table.size();
+        table.push_back(text);
+        ids.emplace(text, id);
+        return id;
+    }
+};
 
-        
-        // Increment/Update step
-        icg.addInstruction(incrementLabel + ":");
-        parseForAssignment();                       // Handles increment (e.g., `i = i + 1`)
-        expect(T_RPAREN);
-        icg.addInstruction("goto " + conditionLabel);  // Jump back to the condition check
+// One function of a program, or its top-level code, lifted into an
+// IntermediateCodeGnerator of its own, so that it can be optimized apart
+// from the others and at the same time. Operands are renumbered densely in
+// order of appearance, which keeps every table a pass indexes by temp, label
+// or name the size of the function. Temps and labels never cross functions,
+// and locals keep their declared type and scope. mergeInto() appends the
+// result to a program, numbering its new temps and labels after the ones
+// already there, so merging the slices in source order gives the same
+// program whichever order they were optimized in.
+class FunctionSlice {
+public:
+    IntermediateCodeGnerator icg;
 
-        // Loop body
-        icg.addInstruction(bodyLabel + ":");
-        if (tokens[pos].type == T_LBRACE) {
-            parseBlock();                       // Parse block if `{}` is used
-        } else {
-            parseStatement();                   // Parse single statement
+    void lift(const IntermediateCodeGnerator &program, size_t begin, size_t end) {
+        unordered_map<uint64_t, Operand> local;
+        auto liftOperand = [&](const Operand &o) {
+            if (o.kind == OP_NONE) return o;
+            auto it = local.find((uint64_t)o.kind << 32 | (uint32_t)o.id);
+            if (it != local.end()) return it->second;
+            Operand lifted;
+            switch (o.kind) {
+                case OP_TEMP: lifted = icg.newTemp(); break;
+                case OP_LABEL: lifted = icg.newLabel(); break;
+                case OP_VAR: lifted = icg.var(program.names[o.id], program.varType(o), program.isGlobal(o)); break;
+                case OP_FUNC: lifted = icg.func(program.names[o.id]); break;
+                case OP_IMM: lifted = icg.imm(program.literals[o.id]); break;
+                default: lifted = icg.str(program.strings[o.id]); break;
+            }
+            local.emplace((uint64_t)o.kind << 32 | (uint32_t)o.id, lifted);
+            return lifted;
+        };
+        icg.instructions.reserve(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            const Quad &q = program.instructions[i];
+            icg.instructions.push_back(Quad{q.op, liftOperand(q.dst), liftOperand(q.a), liftOperand(q.b)});
         }
-        icg.addInstruction("goto " + incrementLabel); // Jump back to the incremental label
-
-        // End of the loop
-        icg.addInstruction(endLabel + ":");
     }
 
+    void mergeInto(IntermediateCodeGnerator &program) {
+        temps.assign(icg.tempCount, Operand());
+        labels.assign(icg.lblCount, Operand());
+        vector<Operand> names(icg.names.size()), literals(icg.literals.size()), strings(icg.strings.size());
+        auto lower = [&](const Operand &o) {
+            switch (o.kind) {
+                case OP_TEMP: return temps[o.id].kind != OP_NONE ? temps[o.id] : temps[o.id] = program.newTemp();
+                case OP_LABEL: return labels[o.id].kind != OP_NONE ? labels[o.id] : labels[o.id] = program.newLabel();
+                case OP_VAR:
+                    if (names[o.id].kind == OP_NONE) names[o.id] = program.var(icg.names[o.id], icg.varType(o), icg.isGlobal(o));
+                    return names[o.id];
+                case OP_FUNC:
+                    if (names[o.id].kind == OP_NONE) names[o.id] = program.func(icg.names[o.id]);
+                    return names[o.id];
+                case OP_IMM:
+                    if (literals[o.id].kind == OP_NONE) literals[o.id] = program.imm(icg.literals[o.id]);
+                    return literals[o.id];
+                case OP_STR:
+                    if (strings[o.id].kind == OP_NONE) strings[o.id] = program.str(icg.strings[o.id]);
+                    return strings[o.id];
+                default: return o;
+            }
+        };
+        for (const Quad &q : icg.instructions) {
+            program.instructions.push_back(Quad{q.op, lower(q.dst), lower(q.a), lower(q.b)});
+        }
+    }
+
+    // The program's label for one of the slice's, once it has been merged
+    Operand programLabel(const Operand &label) const {
+        return label.kind == OP_LABEL && label.id < (int)labels.size() ? labels[label.id] : Operand();
+    }
+
+private:
+    vector<Operand> temps, labels;      // Slice id -> program operand, filled by mergeInto
+};
+
+// Fixed-size set of small integers, one bit each.
+class BitSet {
+public:
+    BitSet() = default;
+    explicit BitSet(size_t bits) : words((bits + 63) / 64, 0) {}
+
+    void set(size_t i) { words[i / 64] |= 1ULL << (i % 64); }
+    bool test(size_t i) const { return words[i / 64] >> (i % 64) & 1; }
+    void clear() { fill(words.begin(), words.end(), 0); }
+
+    // Adds bits [from, to).
+    void setRange(size_t from, size_t to) {
+        for (; from < to && from % 64; from++) set(from);
+        for (; from + 64 <= to; from += 64) words[from / 64] = ~0ULL;
+        for (; from < to; from++) set(from);
+    }
+
+    void unionWith(const BitSet &other) {
+        for (size_t w = 0; w < words.size(); w++) words[w] |= other.words[w];
+    }
+
+    // this = gen | (in & ~kill); true if that changed anything.
+    bool assignTransfer(const BitSet &gen, const BitSet &in, const BitSet &kill) {
+        uint64_t changed = 0;
+        for (size_t w = 0; w < words.size(); w++) {
+            uint64_t next = gen.words[w] | (in.words[w] & ~kill.words[w]);
+            changed |= next ^ words[w];
+            words[w] = next;
+        }
+        return changed != 0;
+    }
+
+    template <typename F> void forEach(F f) const {
+        for (size_t w = 0; w < words.size(); w++) {
+            for (uint64_t bits = words[w]; bits; bits &= bits - 1) f(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+
+private:
+    vector<uint64_t> words;
+};
+
+// Dense numbering of the temps and variables one function mentions. The slot
+// arrays cover the whole program and are reused from function to function, so
+// starting over costs nothing.
+class ValueIndex {
+public:
+    explicit ValueIndex(const IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    void clear() {
+        stamp++;
+        operands.clear();
+    }
+
+    // Number of o, assigning the next one if it is new; -1 for non-values.
+    int add(const Operand &o) {
+        vector<Slot> *slots = slotsOf(o);
+        if (!slots) return -1;
+        if (o.id >= (int)slots->size()) slots->resize(max<size_t>(o.id + 1, 2 * slots->size()));
+        Slot &slot = (*slots)[o.id];
+        if (slot.stamp != stamp) {
+            slot.stamp = stamp;
+            slot.id = (int)operands.size();
+            operands.push_back(o);
+        }
+        return slot.id;
+    }
+
+    // Number of o, or -1 if it has none in this function.
+    int find(const Operand &o) const {
+        const vector<Slot> *slots = const_cast<ValueIndex *>(this)->slotsOf(o);
+        if (!slots || o.id >= (int)slots->size()) return -1;
+        const Slot &slot = (*slots)[o.id];
+        return slot.stamp == stamp ? slot.id : -1;
+    }
+
+    const Operand &operand(int value) const { return operands[value]; }
+    size_t size() const { return operands.size(); }
+    bool isGlobal(int value) const { return operands[value].kind == OP_VAR && icg.isGlobal(operands[value]); }
+
+private:
+    struct Slot {
+        unsigned stamp = 0;
+        int id = -1;
+    };
+
+    const IntermediateCodeGnerator &icg;
+    vector<Slot> tempSlots, varSlots;
+    vector<Operand> operands;
+    unsigned stamp = 1;
+
+    vector<Slot> *slotsOf(const Operand &o) {
+        if (o.kind == OP_TEMP) return &tempSlots;
+        if (o.kind == OP_VAR) return &varSlots;
+        return nullptr;
+    }
+};
+
+// Basic blocks of one function, or of the top-level code before the first
+// one. A block starts at a label or after a goto, agar, CALL, RET or wapsi;
+// blocks[0] is the entry.
+class ControlFlowGraph {
+public:
+    struct Block {
+        size_t begin, end;          // Quads [begin, end)
+        vector<int> succs, preds;
+    };
+    vector<Block> blocks;
+
+    ControlFlowGraph(const vector<Quad> &code, size_t begin, size_t end) {
+        unordered_map<int, int> labelBlock;
+        for (size_t i = begin; i < end; i++) {
+            if (i == begin || code[i].op == TAC_LABEL || endsBlock(code[i - 1])) {
+                if (!blocks.empty()) blocks.back().end = i;
+                blocks.push_back(Block{i, end, {}, {}});
+            }
+            if (code[i].op == TAC_LABEL) labelBlock[code[i].a.id] = (int)blocks.size() - 1;
+        }
+        for (size_t b = 0; b < blocks.size(); b++) {
+            const Quad &last = code[blocks[b].end - 1];
+            Operand target = jumpTarget(last);
+            if (target.kind == OP_LABEL) {
+                auto it = labelBlock.find(target.id);
+                if (it != labelBlock.end()) addEdge((int)b, it->second);
+            }
+            if (fallsThrough(last) && b + 1 < blocks.size()) addEdge((int)b, (int)b + 1);
+        }
+        computeOrder();
+    }
+
+    static bool fallsThrough(const Quad &q) { return q.op != TAC_GOTO && q.op != TAC_RET && q.op != TAC_WAPSI; }
+
+    static bool endsBlock(const Quad &q) {
+        return jumpTarget(q).kind == OP_LABEL || q.op == TAC_CALL || q.op == TAC_RET || q.op == TAC_WAPSI;
+    }
+
+    // [begin, end) of the top-level code and of each function, in order.
+    static vector<pair<size_t, size_t>> functionRanges(const vector<Quad> &code) {
+        vector<pair<size_t, size_t>> ranges;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (i == 0 || code[i].op == TAC_FUNC) {
+                if (!ranges.empty()) ranges.back().second = i;
+                ranges.push_back(make_pair(i, code.size()));
+            }
+        }
+        return ranges;
+    }
+
+    // Reachable blocks in reverse postorder, then the unreachable ones.
+    const vector<int> &order() const { return rpo; }
+    size_t reachableCount() const { return reachable; }
+
+    // Block holding quad, which must lie in the graph.
+    int blockOf(size_t quad) const {
+        auto it = upper_bound(blocks.begin(), blocks.end(), quad,
+                              [](size_t q, const Block &block) { return q < block.begin; });
+        return int(it - blocks.begin()) - 1;
+    }
+
+    size_t edgeCount() const {
+        size_t edges = 0;
+        for (const Block &block : blocks) edges += block.succs.size();
+        return edges;
+    }
+
+private:
+    vector<int> rpo;
+    size_t reachable = 0;
+
+    void addEdge(int from, int to) {
+        if (find(blocks[from].succs.begin(), blocks[from].succs.end(), to) != blocks[from].succs.end()) return;
+        blocks[from].succs.push_back(to);
+        blocks[to].preds.push_back(from);
+    }
+
+    // Iterative depth-first search; functions can have tens of thousands of blocks.
+    void computeOrder() {
+        vector<bool> seen(blocks.size(), false);
+        vector<pair<int, size_t>> stack;    // (block, next successor to visit)
+        if (!blocks.empty()) {
+            stack.push_back(make_pair(0, 0));
+            seen[0] = true;
+        }
+        while (!stack.empty()) {
+            pair<int, size_t> &top = stack.back();
+            const vector<int> &succs = blocks[top.first].succs;
+            if (top.second < succs.size()) {
+                int s = succs[top.second++];
+                if (!seen[s]) {
+                    seen[s] = true;
+                    stack.push_back(make_pair(s, 0));
+                }
+            } else {
+                rpo.push_back(top.first);
+                stack.pop_back();
+            }
+        }
+        reverse(rpo.begin(), rpo.end());
+        reachable = rpo.size();
+        for (size_t b = 0; b < blocks.size(); b++) {
+            if (!seen[b]) rpo.push_back((int)b);
+        }
+    }
+};
+
+// Dominator tree of the reachable blocks, from Cooper, Harvey and Kennedy's
+// iterative algorithm over reverse postorder.
+class DominatorTree {
+public:
+    vector<int> idom;                   // Immediate dominator; -1 for the entry and unreachable blocks
+    vector<vector<int>> children;       // In reverse postorder
+
+    explicit DominatorTree(const ControlFlowGraph &cfg) : idom(cfg.blocks.size(), -1), children(cfg.blocks.size()),
+                                                          cfg(cfg), number(cfg.blocks.size(), -1) {
+        const vector<int> &order = cfg.order();
+        size_t reachable = cfg.reachableCount();
+        for (size_t k = 0; k < reachable; k++) number[order[k]] = (int)k;
+        if (reachable == 0) return;
+        idom[0] = 0;
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t k = 1; k < reachable; k++) {
+                int b = order[k], next = -1;
+                for (int p : cfg.blocks[b].preds) {
+                    if (idom[p] < 0) continue;      // Unreachable, or not reached yet in this sweep
+                    next = next < 0 ? p : intersect(p, next);
+                }
+                if (next != idom[b]) {
+                    idom[b] = next;
+                    changed = true;
+                }
+            }
+        }
+        idom[0] = -1;
+        for (size_t k = 1; k < reachable; k++) children[idom[order[k]]].push_back(order[k]);
+        numberTree();
+    }
+
+    bool reachable(int b) const { return number[b] >= 0; }
+
+    // Whether a dominates b; both must be reachable, and a block dominates itself.
+    bool dominates(int a, int b) const { return enter[a] <= enter[b] && leave[b] <= leave[a]; }
+
+    // Dominance frontier of every block: the blocks where its dominance ends.
+    vector<vector<int>> frontiers() const {
+        vector<vector<int>> df(cfg.blocks.size());
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            const vector<int> &preds = cfg.blocks[b].preds;
+            if (preds.size() < 2 || !reachable((int)b)) continue;
+            for (int p : preds) {
+                for (int runner = p; runner != idom[b] && reachable(runner); runner = idom[runner]) {
+                    if (df[runner].empty() || df[runner].back() != (int)b) df[runner].push_back((int)b);
+                    if (runner == 0) break;
+                }
+            }
+        }
+        return df;
+    }
+
+private:
+    const ControlFlowGraph &cfg;
+    vector<int> number;                 // Position in reverse postorder
+    vector<int> enter, leave;           // Preorder and postorder position in the tree
+
+    void numberTree() {
+        enter.assign(cfg.blocks.size(), -1);
+        leave.assign(cfg.blocks.size(), -1);
+        if (cfg.reachableCount() == 0) return;
+        int pre = 0, post = 0;
+        vector<pair<int, size_t>> stack{make_pair(0, 0)};     // (block, next child to visit)
+        enter[0] = pre++;
+        while (!stack.empty()) {
+            pair<int, size_t> &top = stack.back();
+            if (top.second < children[top.first].size()) {
+                int child = children[top.first][top.second++];
+                enter[child] = pre++;
+                stack.push_back(make_pair(child, 0));
+            } else {
+                leave[top.first] = post++;
+                stack.pop_back();
+            }
+        }
+    }
+
+    int intersect(int a, int b) const {
+        while (a != b) {
+            while (number[a] > number[b]) a = idom[a];
+            while (number[b] > number[a]) b = idom[b];
+        }
+        return a;
+    }
+};
+
+// Natural loops of one function. A back edge is an edge to a block that
+// dominates its source; its loop is the header plus every block that reaches
+// the source without passing the header, and back edges to one header make
+// one loop. Loops come innermost first.
+class LoopNest {
+public:
+    struct Loop {
+        int header;
+        vector<int> blocks;         // Header first
+        vector<int> latches;        // Sources of the back edges
+        int depth = 0;              // 1 for an outermost loop
+    };
+    vector<Loop> loops;
+
+    LoopNest(const ControlFlowGraph &cfg, const DominatorTree &dom) {
+        size_t blockCount = cfg.blocks.size();
+        vector<vector<int>> latches(blockCount);
+        for (size_t k = 0; k < cfg.reachableCount(); k++) {
+            int b = cfg.order()[k];
+            for (int s : cfg.blocks[b].succs) {
+                if (dom.dominates(s, b)) latches[s].push_back(b);
+            }
+        }
+        vector<int> mark(blockCount, -1), depth(blockCount, 0);
+        for (size_t h = 0; h < blockCount; h++) {
+            if (latches[h].empty()) continue;
+            Loop loop;
+            loop.header = (int)h;
+            loop.latches = latches[h];
+            loop.blocks.push_back((int)h);
+            mark[h] = (int)h;
+            vector<int> work;
+            for (int latch : latches[h]) {
+                if (mark[latch] != (int)h) {
+                    mark[latch] = (int)h;
+                    loop.blocks.push_back(latch);
+                    work.push_back(latch);
+                }
+            }
+            while (!work.empty()) {
+                int b = work.back();
+                work.pop_back();
+                for (int p : cfg.blocks[b].preds) {
+                    if (mark[p] == (int)h || !dom.reachable(p)) continue;
+                    mark[p] = (int)h;
+                    loop.blocks.push_back(p);
+                    work.push_back(p);
+                }
+            }
+            for (int b : loop.blocks) depth[b]++;
+            loops.push_back(loop);
+        }
+        for (Loop &loop : loops) loop.depth = depth[loop.header];
+        // A loop nested in another has fewer blocks
+        stable_sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) { return a.blocks.size() < b.blocks.size(); });
+    }
+
+    // Whether the only way into the loop from outside is by falling through
+    // from the block laid out just before the header, as the lowering
+    // rotates loops. Quads placed just before the header's label then run
+    // once on the way in and serve as a preheader.
+    static bool hasPreheader(const vector<Quad> &code, const ControlFlowGraph &cfg, const Loop &loop) {
+        int h = loop.header, outside = -1;
+        for (int p : cfg.blocks[h].preds) {
+            // Inside the loop, only the latches lead back to the header
+            if (find(loop.latches.begin(), loop.latches.end(), p) != loop.latches.end()) continue;
+            if (outside >= 0) return false;
+            outside = p;
+        }
+        if (outside != h - 1) return false;
+        const Quad &last = code[cfg.blocks[outside].end - 1];
+        const Quad &top = code[cfg.blocks[h].begin];
+        return ControlFlowGraph::fallsThrough(last) && (top.op != TAC_LABEL || jumpTarget(last) != top.a);
+    }
+};
+
+// A gen/kill bitvector problem: each block maps the set flowing into it to
+// gen | (in & ~kill), and sets meet by union where paths join. Backward
+// problems flow from the end of a block to its start.
+struct DataflowProblem {
+    bool forward = true;
+    size_t bits = 0;
+    vector<BitSet> gen, kill;       // Per block
+    BitSet boundary;                // Flows into the entry (forward) or out of exits (backward)
+};
+
+struct DataflowResult {
+    vector<BitSet> atStart, atEnd;  // Per block
+};
+
+// Worklist solver. Blocks start in reverse postorder for forward problems and
+// in postorder for backward ones, and a block is revisited only when a
+// neighbour upstream changed, so acyclic code settles in one pass and loops
+// in a few.
+inline DataflowResult solveDataflow(const ControlFlowGraph &cfg, const DataflowProblem &problem) {
+    size_t n = cfg.blocks.size();
+    DataflowResult result;
+    result.atStart.assign(n, BitSet(problem.bits));
+    result.atEnd.assign(n, BitSet(problem.bits));
+    vector<BitSet> &in = problem.forward ? result.atStart : result.atEnd;
+    vector<BitSet> &out = problem.forward ? result.atEnd : result.atStart;
+
+    vector<int> work(cfg.order());
+    if (!problem.forward) reverse(work.begin(), work.end());
+    vector<bool> queued(n, true);
+    for (size_t head = 0; head < work.size(); head++) {
+        int b = work[head];
+        queued[b] = false;
+        const ControlFlowGraph::Block &block = cfg.blocks[b];
+        const vector<int> &upstream = problem.forward ? block.preds : block.succs;
+        const vector<int> &downstream = problem.forward ? block.succs : block.preds;
+        in[b].clear();
+        for (int u : upstream) in[b].unionWith(out[u]);
+        if (problem.forward ? b == 0 : block.succs.empty()) in[b].unionWith(problem.boundary);
+        if (!out[b].assignTransfer(problem.gen[b], in[b], problem.kill[b])) continue;
+        for (int d : downstream) {
+            if (!queued[d]) {
+                queued[d] = true;
+                work.push_back(d);
+            }
+        }
+    }
+    return result;
+}
+
+// Temps and variables read by q. A call may read any global and so may
+// whoever regains control at RET or wapsi; those count as reads of every
+// global in globals.
+template <typename F>
+inline void forEachUse(const Quad &q, const ValueIndex &values, const vector<int> &globals, F f) {
+    for (const Operand *o : {&q.a, &q.b}) {
+        int v = values.find(*o);
+        if (v >= 0) f(v);
+    }
+    if (q.op == TAC_CALL || q.op == TAC_RET || q.op == TAC_WAPSI) {
+        for (int g : globals) f(g);
+    }
+}
+
+// Per block, the values read before being written in it (upward exposed)
+// and the values it writes. Only upward-exposed values can be live or carry
+// a definition across a block boundary, so the dataflow clients give bits to
+// those alone and block-local temps cost nothing.
+struct BlockSummary {
+    vector<int> globals;                    // Global variables the function mentions
+    vector<vector<int>> exposed, defined;   // Per block, without repeats
+    vector<bool> crossing;                  // Per value: upward exposed somewhere
+
+    BlockSummary(const vector<Quad> &code, const ControlFlowGraph &cfg, ValueIndex &values) {
+        for (size_t i = cfg.blocks.front().begin; i < cfg.blocks.back().end; i++) {
+            values.add(code[i].a);
+            values.add(code[i].b);
+            values.add(code[i].dst);
+        }
+        for (size_t v = 0; v < values.size(); v++) {
+            if (values.isGlobal((int)v)) globals.push_back((int)v);
+        }
+        crossing.assign(values.size(), false);
+        exposed.resize(cfg.blocks.size());
+        defined.resize(cfg.blocks.size());
+        vector<int> seenIn(values.size(), -1), definedIn(values.size(), -1);
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+                forEachUse(code[i], values, globals, [&](int v) {
+                    if (definedIn[v] == (int)b || seenIn[v] == (int)b) return;
+                    seenIn[v] = (int)b;
+                    exposed[b].push_back(v);
+                    crossing[v] = true;
+                });
+                int d = values.find(code[i].dst);
+                if (d >= 0 && definedIn[d] != (int)b) {
+                    definedIn[d] = (int)b;
+                    defined[b].push_back(d);
+                }
+            }
+        }
+    }
+};
+
+// Live variables: a value is live at a point if some path from there reads
+// it before writing it. Values are numbered by the ValueIndex given.
+class Liveness {
+public:
+    Liveness(const vector<Quad> &code, const ControlFlowGraph &cfg, ValueIndex &values)
+        : summary(code, cfg, values), bitOf(values.size(), -1) {
+        for (size_t v = 0; v < values.size(); v++) {
+            if (!summary.crossing[v]) continue;
+            bitOf[v] = (int)valueOfBit.size();
+            valueOfBit.push_back((int)v);
+        }
+        DataflowProblem problem;
+        problem.forward = false;
+        problem.bits = valueOfBit.size();
+        problem.boundary = BitSet(problem.bits);
+        problem.gen.assign(cfg.blocks.size(), BitSet(problem.bits));
+        problem.kill.assign(cfg.blocks.size(), BitSet(problem.bits));
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            for (int v : summary.exposed[b]) problem.gen[b].set(bitOf[v]);
+            for (int v : summary.defined[b]) {
+                if (bitOf[v] >= 0) problem.kill[b].set(bitOf[v]);
+            }
+        }
+        result = solveDataflow(cfg, problem);
+    }
+
+    const vector<int> &globals() const { return summary.globals; }
+
+    bool liveAtStart(int block, int value) const { return bitOf[value] >= 0 && result.atStart[block].test(bitOf[value]); }
+    bool liveAtEnd(int block, int value) const { return bitOf[value] >= 0 && result.atEnd[block].test(bitOf[value]); }
+
+    template <typename F> void forEachLiveAtStart(int block, F f) const {
+        result.atStart[block].forEach([&](size_t bit) { f(valueOfBit[bit]); });
+    }
+    template <typename F> void forEachLiveAtEnd(int block, F f) const {
+        result.atEnd[block].forEach([&](size_t bit) { f(valueOfBit[bit]); });
+    }
+
+private:
+    BlockSummary summary;
+    vector<int> bitOf, valueOfBit;
+    DataflowResult result;
+};
+
+// The same sets as Liveness, found one value at a time by walking back from
+// the blocks that read it. That costs the total length of the live ranges
+// rather than blocks times values, which is far less when there are many
+// short-lived values, as right after leaving SSA form.
+class SparseLiveness {
+public:
+    SparseLiveness(const vector<Quad> &code, const ControlFlowGraph &cfg, ValueIndex &values)
+        : atStart(cfg.blocks.size()), atEnd(cfg.blocks.size()) {
+        BlockSummary summary(code, cfg, values);
+        size_t blockCount = cfg.blocks.size();
+        vector<vector<int>> readBy(values.size()), writtenBy(values.size());
+        for (size_t b = 0; b < blockCount; b++) {
+            for (int v : summary.exposed[b]) readBy[v].push_back((int)b);
+            for (int v : summary.defined[b]) writtenBy[v].push_back((int)b);
+        }
+        // Stamped with the value being traced, so nothing is cleared between values
+        vector<int> writes(blockCount, -1), liveIn(blockCount, -1), liveOut(blockCount, -1);
+        vector<int> work;
+        for (size_t v = 0; v < values.size(); v++) {
+            for (int b : writtenBy[v]) writes[b] = (int)v;
+            for (int b : readBy[v]) {
+                liveIn[b] = (int)v;
+                atStart[b].push_back((int)v);
+                work.push_back(b);
+            }
+            while (!work.empty()) {
+                int b = work.back();
+                work.pop_back();
+                for (int p : cfg.blocks[b].preds) {
+                    if (liveOut[p] == (int)v) continue;
+                    liveOut[p] = (int)v;
+                    atEnd[p].push_back((int)v);
+                    if (writes[p] != (int)v && liveIn[p] != (int)v) {
+                        liveIn[p] = (int)v;
+                        atStart[p].push_back((int)v);
+                        work.push_back(p);
+                    }
+                }
+            }
+        }
+    }
+
+    // Lists are in value order, having been filled one value at a time.
+    bool liveAtStart(int block, int value) const {
+        return binary_search(atStart[block].begin(), atStart[block].end(), value);
+    }
+    template <typename F> void forEachLiveAtEnd(int block, F f) const {
+        for (int v : atEnd[block]) f(v);
+    }
+
+private:
+    vector<vector<int>> atStart, atEnd;     // Per block, live values
+};
+
+// Reaching definitions: the assignments whose value a temp or variable may
+// still hold at a point. Each value also has a pseudo-definition ENTRY that
+// stands for whatever it held when the function was entered or, for a
+// global, whatever a call left in it.
+class ReachingDefinitions {
+public:
+    static const size_t ENTRY = SIZE_MAX;
+
+    ReachingDefinitions(const vector<Quad> &code, const ControlFlowGraph &cfg, ValueIndex &values)
+        : code(code), cfg(cfg), values(values), summary(code, cfg, values), firstBit(values.size() + 1, 0) {
+        // Only the last definition of a value in a block can reach past it, so
+        // only those get bits; reachingAt finds the others by walking the block.
+        vector<vector<pair<int, size_t>>> leaving(cfg.blocks.size());     // Per block, (value, last definition)
+        vector<size_t> lastDef(values.size(), 0);
+        vector<int> definedIn(values.size(), -1);
+        vector<int> count(values.size(), 0);
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            vector<int> touched;
+            auto define = [&](int v, size_t quad) {
+                if (definedIn[v] != (int)b) {
+                    definedIn[v] = (int)b;
+                    touched.push_back(v);
+                }
+                lastDef[v] = quad;
+            };
+            for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+                int d = values.find(code[i].dst);
+                if (d >= 0 && summary.crossing[d]) define(d, i);
+                if (code[i].op == TAC_CALL) {
+                    for (int g : summary.globals) {
+                        if (summary.crossing[g]) define(g, ENTRY);
+                    }
+                }
+            }
+            for (int v : touched) {
+                leaving[b].push_back(make_pair(v, lastDef[v]));
+                if (lastDef[v] != ENTRY) count[v]++;
+            }
+        }
+
+        // Definitions of one value get consecutive bits, its ENTRY first, so
+        // that killing them all is a range.
+        for (size_t v = 0; v < values.size(); v++) {
+            firstBit[v + 1] = firstBit[v] + (summary.crossing[v] ? count[v] + 1 : 0);
+        }
+        size_t bits = firstBit[values.size()];
+        definitionOfBit.assign(bits, ENTRY);
+        vector<int> next(values.size());
+        for (size_t v = 0; v < values.size(); v++) next[v] = firstBit[v] + 1;
+
+        DataflowProblem problem;
+        problem.bits = bits;
+        problem.boundary = BitSet(bits);
+        for (size_t v = 0; v < values.size(); v++) {
+            if (summary.crossing[v]) problem.boundary.set(firstBit[v]);
+        }
+        problem.gen.assign(cfg.blocks.size(), BitSet(bits));
+        problem.kill.assign(cfg.blocks.size(), BitSet(bits));
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            for (const pair<int, size_t> &def : leaving[b]) {
+                int v = def.first, bit = firstBit[v];
+                if (def.second != ENTRY) {
+                    bit = next[v]++;
+                    definitionOfBit[bit] = def.second;
+                }
+                problem.kill[b].setRange(firstBit[v], firstBit[v + 1]);
+                problem.gen[b].set(bit);
+            }
+        }
+        result = solveDataflow(cfg, problem);
+    }
+
+    // Calls f(quad) for every definition of value that reaches the start of
+    // block, with ENTRY for the pseudo-definition.
+    template <typename F> void forEachReaching(int block, int value, F f) const {
+        for (int bit = firstBit[value]; bit < firstBit[value + 1]; bit++) {
+            if (result.atStart[block].test(bit)) f(definitionOfBit[bit]);
+        }
+    }
+
+    // Definitions of o that may reach the use at quad.
+    vector<size_t> reachingAt(size_t quad, const Operand &o) const {
+        vector<size_t> defs;
+        int v = values.find(o);
+        if (v < 0) return defs;
+        int b = cfg.blockOf(quad);
+        for (size_t i = quad; i-- > cfg.blocks[b].begin;) {
+            if (code[i].dst == o) return vector<size_t>{i};
+            if (code[i].op == TAC_CALL && values.isGlobal(v)) return vector<size_t>{ENTRY};
+        }
+        if (!summary.crossing[v]) return vector<size_t>{ENTRY};     // Read nowhere before being written
+        forEachReaching(b, v, [&](size_t def) { defs.push_back(def); });
+        return defs;
+    }
+
+    // Number of definitions reaching the start of block.
+    size_t countAtStart(int block) const {
+        size_t n = 0;
+        result.atStart[block].forEach([&](size_t) { n++; });
+        return n;
+    }
+
+private:
+    const vector<Quad> &code;
+    const ControlFlowGraph &cfg;
+    const ValueIndex &values;
+    BlockSummary summary;
+    vector<int> firstBit;           // Per value, first bit of its definitions; firstBit[v + 1] ends them
+    vector<size_t> definitionOfBit;
+    DataflowResult result;
+};
+
+const size_t ReachingDefinitions::ENTRY;
+
+// Blocks, edges, liveness and reaching definitions of every function, used
+// only for --emit-cfg.
+inline void printControlFlow(const IntermediateCodeGnerator &icg) {
+    const vector<Quad> &code = icg.instructions;
+    ValueIndex values(icg);
+    for (const pair<size_t, size_t> &range : ControlFlowGraph::functionRanges(code)) {
+        values.clear();
+        ControlFlowGraph cfg(code, range.first, range.second);
+        Liveness liveness(code, cfg, values);
+        ReachingDefinitions reaching(code, cfg, values);
+        const Quad &first = code[range.first];
+        cout << (first.op == TAC_FUNC ? icg.operandToString(first.a) : "(top level)") << ": " << cfg.blocks.size()
+             << " blocks, " << cfg.edgeCount() << " edges" << endl;
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            const ControlFlowGraph::Block &block = cfg.blocks[b];
+            cout << "  B" << b << " quads " << block.begin << "-" << block.end - 1 << " ->";
+            for (int s : block.succs) cout << " B" << s;
+            auto printSet = [&](const char *name, bool atStart) {
+                cout << "  " << name << " {";
+                const char *sep = "";
+                auto print = [&](int v) {
+                    cout << sep << icg.operandToString(values.operand(v));
+                    sep = " ";
+                };
+                if (atStart) liveness.forEachLiveAtStart((int)b, print);
+                else liveness.forEachLiveAtEnd((int)b, print);
+                cout << "}";
+            };
+            printSet("live in", true);
+            printSet("live out", false);
+            cout << "  " << reaching.countAtStart((int)b) << " definitions reach" << endl;
+        }
+    }
+}
+
+// Locals live in fixed storage, so they keep their value from one call of
+// their function to the next, and a call that reaches the function again
+// changes them under the caller. The passes that keep a local in a register
+// or a temp treat it as private to the running call, which only holds if no
+// path reads it before writing it and the function cannot reach itself
+// through calls. Every other local is shared: it counts as a global from
+// here on, so it stays in memory and calls are assumed to read and write it.
+inline void markSharedLocals(IntermediateCodeGnerator &icg) {
+    const vector<Quad> &code = icg.instructions;
+    vector<pair<size_t, size_t>> ranges = ControlFlowGraph::functionRanges(code);
+    size_t count = ranges.size();
+    unordered_map<int, int> functionOf;     // By the name id of the label
+    for (size_t f = 0; f < count; f++) {
+        if (code[ranges[f].first].op == TAC_FUNC) functionOf[code[ranges[f].first].a.id] = (int)f;
+    }
+    vector<vector<int>> callees(count);
+    for (size_t f = 0; f < count; f++) {
+        for (size_t i = ranges[f].first; i < ranges[f].second; i++) {
+            if (code[i].op != TAC_CALL) continue;
+            auto it = functionOf.find(code[i].a.id);
+            if (it != functionOf.end()) callees[f].push_back(it->second);
+        }
+    }
+
+    // Tarjan's algorithm with an explicit stack, since call chains can be as
+    // long as the program. A function can reach itself if it calls itself or
+    // shares its component with another.
+    vector<bool> recursive(count, false), onStack(count, false);
+    vector<int> order(count, -1), low(count, 0), stack;
+    vector<pair<int, size_t>> path;         // (function, next callee to follow)
+    int index = 0;
+    auto enter = [&](int f) {
+        order[f] = low[f] = index++;
+        stack.push_back(f);
+        onStack[f] = true;
+        path.push_back(make_pair(f, 0));
+    };
+    for (size_t root = 0; root < count; root++) {
+        if (order[root] >= 0) continue;
+        enter((int)root);
+        while (!path.empty()) {
+            int f = path.back().first;
+            if (path.back().second < callees[f].size()) {
+                int callee = callees[f][path.back().second++];
+                if (callee == f) recursive[f] = true;
+                if (order[callee] < 0) enter(callee);
+                else if (onStack[callee]) low[f] = min(low[f], order[callee]);
+                continue;
+            }
+            path.pop_back();
+            if (!path.empty()) low[path.back().first] = min(low[path.back().first], low[f]);
+            if (low[f] != order[f]) continue;
+            size_t first = stack.size();
+            while (stack[--first] != f) {}
+            for (size_t k = first; k < stack.size(); k++) {
+                onStack[stack[k]] = false;
+                if (stack.size() - first > 1) recursive[stack[k]] = true;
+            }
+            stack.resize(first);
+        }
+    }
+
+    ValueIndex values(icg);
+    for (size_t f = 0; f < count; f++) {
+        if (code[ranges[f].first].op != TAC_FUNC) continue;
+        values.clear();
+        ControlFlowGraph cfg(code, ranges[f].first, ranges[f].second);
+        Liveness liveness(code, cfg, values);
+        auto share = [&](int v) {
+            if (values.operand(v).kind == OP_VAR && !values.isGlobal(v)) icg.shareLocal(values.operand(v));
+        };
+        if (recursive[f]) {
+            for (size_t v = 0; v < values.size(); v++) share((int)v);
+        } else {
+            liveness.forEachLiveAtStart(0, share);
+        }
+    }
+}
+
+// Linear-scan register allocation. Every function, and the top-level code
+// before the first one, is allocated on its own. Live intervals of its temps
+// and local variables come from block-level liveness, so a value carried
+// around a loop covers the whole loop. Intervals get BX, SI, DI and CX in
+// order of their start; when all four are taken, the interval that ends last
+// stays in memory (is spilled). Globals and shared locals always live in
+// memory since a callee may read or write them. A function saves the registers it uses, so
+// intervals may span calls. Functions are allocated in parallel, and their
+// results applied in order afterwards.
+class RegisterAllocator {
+public:
+    static const int NUM_REGISTERS = 4;
+    static const int REG_CX = 3;
+
+    struct Region {
+        string name;
+        size_t begin, end;          // Quads [begin, end)
+        int values = 0;             // Temps and locals that competed for registers
+        int spilled = 0;
+        vector<int> usedRegisters;  // Saved in the prologue, in this order
+    };
+    vector<Region> regions;
+    unsigned threads = 1;           // Functions allocated at once
+
+    RegisterAllocator(const IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    static const char *registerName(int reg) {
+        static const char *const names[NUM_REGISTERS] = {"BX", "SI", "DI", "CX"};
+        return names[reg];
+    }
+
+    void run() {
+        tempReg.assign(icg.tempCount, -1);
+        varReg.assign(icg.names.size(), -1);
+        occupied.assign(NUM_REGISTERS, vector<pair<int, int>>());
+
+        for (const pair<size_t, size_t> &range : ControlFlowGraph::functionRanges(icg.instructions)) {
+            Region region;
+            const Quad &first = icg.instructions[range.first];
+            region.name = first.op == TAC_FUNC ? icg.operandToString(first.a) : "(top level)";
+            region.begin = range.first;
+            region.end = range.second;
+            regions.push_back(region);
+        }
+        vector<Placement> placements(regions.size());
+        WorkStealingPool pool(threads);
+        vector<ValueIndex> values(pool.workersFor(regions.size()), ValueIndex(icg));
+        pool.run(regions.size(), [&](size_t r, unsigned worker) {
+            allocate(regions[r], values[worker], placements[r]);
+        });
+        for (const Placement &placement : placements) {
+            for (const pair<Operand, int> &assigned : placement.registers) {
+                (assigned.first.kind == OP_TEMP ? tempReg : varReg)[assigned.first.id] = assigned.second;
+            }
+            for (int reg = 0; reg < NUM_REGISTERS; reg++) {
+                occupied[reg].insert(occupied[reg].end(), placement.busy[reg].begin(), placement.busy[reg].end());
+            }
+        }
+    }
+
+    // Register holding o, or -1 if it lives in memory.
+    int registerOf(const Operand &o) const {
+        if (o.kind == OP_TEMP) return tempReg[o.id];
+        if (o.kind == OP_VAR) return varReg[o.id];
+        return -1;
+    }
+
+    // Whether reg holds a value that is live both before and after quad.
+    bool busy(int reg, size_t quad) const {
+        const vector<pair<int, int>> &list = occupied[reg];
+        auto it = upper_bound(list.begin(), list.end(), make_pair((int)quad, INT_MAX));
+        while (it != list.begin()) {
+            --it;
+            if (it->first < (int)quad) return it->second > (int)quad;
+        }
+        return false;
+    }
+
+    const Region *regionStartingAt(size_t quad) const {
+        auto it = lower_bound(regions.begin(), regions.end(), quad,
+                              [](const Region &r, size_t q) { return r.begin < q; });
+        return it != regions.end() && it->begin == quad ? &*it : nullptr;
+    }
+
+    // Lists the regions with spills, worst first.
+    void printReport() const {
+        int values = 0, spilled = 0;
+        vector<const Region *> hot;
+        for (const Region &region : regions) {
+            values += region.values;
+            spilled += region.spilled;
+            if (region.spilled > 0) hot.push_back(&region);
+        }
+        cout << "Register allocation: " << values << " values in " << regions.size() << " functions, "
+             << spilled << " spilled" << endl;
+        stable_sort(hot.begin(), hot.end(), [](const Region *a, const Region *b) { return a->spilled > b->spilled; });
+        const size_t shown = 10;
+        for (size_t i = 0; i < hot.size() && i < shown; i++) {
+            cout << "  " << hot[i]->name << ": " << hot[i]->spilled << " of " << hot[i]->values << " spilled" << endl;
+        }
+        if (hot.size() > shown) cout << "  ... " << hot.size() - shown << " more functions with spills" << endl;
+    }
+
+private:
+    // What allocating one region decided
+    struct Placement {
+        vector<pair<Operand, int>> registers;       // Values that got a register
+        vector<pair<int, int>> busy[NUM_REGISTERS]; // (start, end) in quad order
+    };
+
+    const IntermediateCodeGnerator &icg;
+    vector<int> tempReg, varReg;
+    vector<vector<pair<int, int>>> occupied;   // Per register, (start, end) in quad order
+
+    void allocate(Region &region, ValueIndex &values, Placement &placement) {
+        const vector<Quad> &code = icg.instructions;
+        values.clear();
+        ControlFlowGraph cfg(code, region.begin, region.end);
+        Liveness liveness(code, cfg, values);
+        auto candidate = [&](const Operand &o) {
+            return o.kind == OP_TEMP || (o.kind == OP_VAR && !icg.isGlobal(o)) ? values.find(o) : -1;
+        };
+
+        // Intervals: the first and last quad at which each value is live
+        vector<int> start(values.size(), INT_MAX), end(values.size(), -1);
+        vector<bool> live(values.size(), false);
+        vector<int> liveList;
+        auto extend = [&](int v, size_t at) {
+            start[v] = min(start[v], (int)at);
+            end[v] = max(end[v], (int)at);
+        };
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            const ControlFlowGraph::Block &block = cfg.blocks[b];
+            liveness.forEachLiveAtEnd((int)b, [&](int v) {
+                if (values.isGlobal(v)) return;
+                extend(v, block.end - 1);
+                live[v] = true;
+                liveList.push_back(v);
+            });
+            for (size_t i = block.end; i-- > block.begin;) {
+                const Quad &q = code[i];
+                int d = candidate(q.dst);
+                if (d >= 0) {
+                    extend(d, i);
+                    live[d] = false;
+                }
+                for (const Operand *o : {&q.a, &q.b}) {
+                    int v = candidate(*o);
+                    if (v < 0) continue;
+                    extend(v, i);
+                    if (!live[v]) {
+                        live[v] = true;
+                        liveList.push_back(v);
+                    }
+                }
+            }
+            for (int v : liveList) {
+                if (live[v]) extend(v, block.begin);
+                live[v] = false;
+            }
+            liveList.clear();
+        }
+
+        // Linear scan
+        vector<int> order;
+        for (size_t v = 0; v < values.size(); v++) {
+            if (end[v] >= 0) order.push_back((int)v);
+        }
+        sort(order.begin(), order.end(), [&](int a, int b) { return start[a] < start[b]; });
+        vector<int> assigned(values.size(), -1);
+        vector<int> active;             // Values holding a register
+        bool used[NUM_REGISTERS] = {};
+        for (int v : order) {
+            active.erase(remove_if(active.begin(), active.end(), [&](int a) { return end[a] < start[v]; }),
+                         active.end());
+            bool taken[NUM_REGISTERS] = {};
+            for (int a : active) taken[assigned[a]] = true;
+            int reg = 0;
+            while (reg < NUM_REGISTERS && taken[reg]) reg++;
+            if (reg == NUM_REGISTERS) {
+                auto furthest = max_element(active.begin(), active.end(), [&](int a, int b) { return end[a] < end[b]; });
+                region.spilled++;
+                if (end[*furthest] <= end[v]) continue;     // v itself stays in memory
+                reg = assigned[*furthest];
+                assigned[*furthest] = -1;
+                active.erase(furthest);
+            }
+            assigned[v] = reg;
+            used[reg] = true;
+            active.push_back(v);
+        }
+        region.values = (int)order.size();
+
+        for (size_t v = 0; v < values.size(); v++) {
+            if (assigned[v] >= 0) placement.registers.push_back(make_pair(values.operand((int)v), assigned[v]));
+        }
+        // Busy ranges in start order; spilled intervals were dropped above
+        for (int v : order) {
+            if (assigned[v] >= 0) placement.busy[assigned[v]].push_back(make_pair(start[v], end[v]));
+        }
+        // Dividing by a constant loads it into CX, which a caller may be keeping a value in
+        for (size_t i = region.begin; i < region.end; i++) {
+            if (code[i].op == TAC_DIV && code[i].b.kind == OP_IMM) used[REG_CX] = true;
+        }
+        for (int reg = 0; reg < NUM_REGISTERS; reg++) {
+            if (used[reg]) region.usedRegisters.push_back(reg);
+        }
+    }
+};
+
+class AssemblyCodeGenerator {
+public:
+    vector<string> assemblyInstructions;
+    bool omitLeafFrames = false;    // No BP frame in functions that call nothing
+    unsigned threads = 1;           // Functions translated at once
+
+    // With an allocator, temps and locals it placed in registers are used
+    // from there; everything else is addressed in memory. The top-level code
+    // and each function are translated on their own, in parallel, and joined
+    // in source order.
+    void generateFromTAC(const IntermediateCodeGnerator &icg, const RegisterAllocator *allocator = nullptr) {
+        this->icg = &icg;
+        this->allocator = allocator;
+        vector<pair<size_t, size_t>> ranges = ControlFlowGraph::functionRanges(icg.instructions);
+        vector<vector<string>> parts(ranges.size());
+        WorkStealingPool pool(threads);
+        pool.run(ranges.size(), [&](size_t f, unsigned) {
+            AssemblyCodeGenerator function;
+            function.omitLeafFrames = omitLeafFrames;
+            function.icg = &icg;
+            function.allocator = allocator;
+            for (function.current = ranges[f].first; function.current < ranges[f].second; function.current++) {
+                function.processTACInstruction(icg.instructions[function.current]);
+            }
+            parts[f].swap(function.assemblyInstructions);
+        });
+        for (vector<string> &part : parts) {
+            assemblyInstructions.insert(assemblyInstructions.end(), make_move_iterator(part.begin()),
+                                        make_move_iterator(part.end()));
+        }
+    }
+
+    void processTACInstruction(const Quad &q) {
+        switch (q.op) {
+            case TAC_ASSIGN:
+                // Assignment (e.g., d = 2.7); a bool keeps only 0 or 1
+                if (q.dst.kind == OP_VAR && icg->varType(q.dst) == TYPE_BOOL && !isFlag(q.a)) {
+                    compare(q.a, "0");
+                    emit("SETNE AL");
+                    storeFlag(q.dst);
+                    break;
+                }
+                move(q.dst, q.a);
+                break;
+            case TAC_ADD:
+            case TAC_SUB:
+            case TAC_MUL:
+                // Arithmetic (e.g., t0 = y * 3)
+                arithmetic(q.op == TAC_ADD ? "ADD" : q.op == TAC_SUB ? "SUB" : "IMUL", q, q.op != TAC_SUB);
+                break;
+            case TAC_DIV: {
+                // Division (e.g., t1 = x / y); IDIV takes no immediate operand
+                emit("MOV AX, " + loc(q.a));
+                emit("CWD");
+                if (q.b.kind == OP_IMM) {
+                    bool saveCX = allocator && allocator->busy(RegisterAllocator::REG_CX, current);
+                    if (saveCX) emit("PUSH CX");
+                    emit("MOV CX, " + loc(q.b));
+                    emit("IDIV CX");
+                    if (saveCX) emit("POP CX");
+                } else {
+                    emit("IDIV " + string(inRegister(q.b) ? "" : "WORD ") + loc(q.b));
+                }
+                emit("MOV " + loc(q.dst) + ", AX");
+                break;
+            }
+            case TAC_LT:
+            case TAC_LE:
+            case TAC_GT:
+            case TAC_GE:
+            case TAC_EQ:
+            case TAC_NEQ:
+                // Comparison (e.g., t5 = i < 10)
+                compare(q.a, loc(q.b));
+                emit(string("SET") + conditionCode(q.op) + " AL");
+                storeFlag(q.dst);
+                break;
+            case TAC_AND:
+            case TAC_OR:
+                // Logical operators normalize both sides to 0/1 first
+                compare(q.a, "0");
+                emit("SETNE DL");
+                compare(q.b, "0");
+                emit("SETNE AL");
+                emit(string(q.op == TAC_AND ? "AND" : "OR") + " AL, DL");
+                storeFlag(q.dst);
+                break;
+            case TAC_AGAR:
+                // Conditional jump (e.g., agar t1 goto L1)
+                if (inRegister(q.a)) {
+                    emit("CMP " + loc(q.a) + ", 0");
+                    emit("JNE " + loc(q.b));
+                    break;
+                }
+                emit("MOV AL, " + loc(q.a));
+                emit("CMP AL, 1");
+                emit("JE " + loc(q.b));
+                break;
+            case TAC_AGAR_LT:
+            case TAC_AGAR_LE:
+            case TAC_AGAR_GT:
+            case TAC_AGAR_GE:
+            case TAC_AGAR_EQ:
+            case TAC_AGAR_NEQ:
+                // Compare and branch (e.g., agar i >= 10 goto L2)
+                compare(q.a, loc(q.b));
+                emit(string("J") + conditionCode(relationOf(q.op)) + " " + loc(q.dst));
+                break;
+            case TAC_GOTO:
+                // Unconditional jump (e.g., goto L3)
+                emit("JMP " + loc(q.a));
+                break;
+            case TAC_LABEL:
+                // Label (e.g., L1:)
+                emit(loc(q.a) + ":");
+                break;
+            case TAC_FUNC:
+                // Function label
+                emit(loc(q.a) + ":");
+                framed = !omitLeafFrames || icg->makesCalls(current);
+                if (framed) {
+                    emit("PUSH BP");
+                    emit("MOV BP, SP");
+                }
+                inFunction = true;
+                savedRegisters.clear();
+                if (const RegisterAllocator::Region *region = allocator ? allocator->regionStartingAt(current) : nullptr) {
+                    savedRegisters = region->usedRegisters;
+                }
+                for (int reg : savedRegisters) emit(string("PUSH ") + RegisterAllocator::registerName(reg));
+                break;
+            case TAC_PRINT:
+                // Print statement (e.g., print "done")
+                emit("PUSH " + loc(q.a));
+                emit("CALL PRINT");
+                break;
+            case TAC_WAPSI:
+                // Return (e.g., wapsi b)
+                if (q.a.kind != OP_NONE) emit("MOV AX, " + loc(q.a));
+                if (inFunction) epilogue();
+                emit("RET");
+                break;
+            case TAC_RET:
+                // Return instruction
+                epilogue();
+                emit("RET");
+                break;
+            case TAC_CALL:
+                // Function call
+                emit("CALL " + loc(q.a));
+                break;
+            default:
+                throw CompileError("Unsupported TAC: " + icg->toString(q));
+        }
+    }
+
+    void printAssemblyCode() {
+        for (const string& instr : assemblyInstructions) {
+            cout << instr << endl;
+        }
+    }
+
+    // False if the file could not be written
+    bool saveToFile(const string& filename) const {
+        ofstream outFile(filename);
+        if (!outFile.is_open()) return false;
+        for (const string& instr : assemblyInstructions) {
+            outFile << instr << '\n';
+        }
+        outFile.close();
+        return !outFile.fail();
+    }
+
+private:
+    const IntermediateCodeGnerator *icg = nullptr;
+    const RegisterAllocator *allocator = nullptr;
+    size_t current = 0;          // Index of the quad being translated
+    bool inFunction = false;     // Past the first function label, so a frame is set up
+    bool framed = true;          // The current function pushed BP
+    vector<int> savedRegisters;  // Pushed after BP by the current function
+
+    void emit(const string &instr) {
+        assemblyInstructions.push_back(instr);
+    }
+
+    bool inRegister(const Operand &o) const {
+        return allocator && allocator->registerOf(o) >= 0;
+    }
+
+    // Whether o is known to hold 0 or 1: a bool variable or a 0/1 literal.
+    bool isFlag(const Operand &o) const {
+        if (o.kind == OP_VAR) return icg->varType(o) == TYPE_BOOL;
+        return o.kind == OP_IMM && (icg->literals[o.id] == "0" || icg->literals[o.id] == "1");
+    }
+
+    // Registers by name, memory operands bracketed (v_ in front of variables
+    // keeps a user's t0 or L1 apart from the temp and label of that name);
+    // immediates, labels and strings as they are.
+    string loc(const Operand &o) const {
+        if (inRegister(o)) return RegisterAllocator::registerName(allocator->registerOf(o));
+        if (o.kind == OP_TEMP || o.kind == OP_VAR) return "[" + icg->memoryName(o) + "]";
+        return icg->operandToString(o);
+    }
+
+    // x86 has no memory-to-memory MOV, so that case goes through AX.
+    void move(const Operand &dst, const Operand &src) {
+        string to = loc(dst), from = loc(src);
+        if (to == from) return;
+        if (src.kind == OP_IMM || inRegister(dst) || inRegister(src)) {
+            emit("MOV " + to + ", " + from);
+        } else {
+            emit("MOV AX, " + from);
+            emit("MOV " + to + ", AX");
+        }
+    }
+
+    // dst = a op b, computed in place when dst has a register that b is not in.
+    void arithmetic(const string &mnemonic, const Quad &q, bool commutative) {
+        string dst = loc(q.dst), a = loc(q.a), b = loc(q.b);
+        if (inRegister(q.dst) && dst != b) {
+            if (dst != a) emit("MOV " + dst + ", " + a);
+            emit(mnemonic + " " + dst + ", " + b);
+        } else if (inRegister(q.dst) && commutative) {
+            emit(mnemonic + " " + dst + ", " + a);
+        } else {
+            emit("MOV AX, " + a);
+            emit(mnemonic + " AX, " + b);
+            emit("MOV " + dst + ", AX");
+        }
+    }
+
+    void compare(const Operand &a, const string &b) {
+        if (inRegister(a)) {
+            emit("CMP " + loc(a) + ", " + b);
+        } else {
+            emit("MOV AX, " + loc(a));
+            emit("CMP AX, " + b);
+        }
+    }
+
+    // Stores the 0/1 in AL to dst.
+    void storeFlag(const Operand &dst) {
+        emit((inRegister(dst) ? "MOVZX " : "MOV ") + loc(dst) + ", AL");
+    }
+
+    // Undoes the frame set up at the function label. A leaf function leaves
+    // SP where its pushes left it, so popping is enough.
+    void epilogue() {
+        if (!framed) {
+            for (size_t i = savedRegisters.size(); i-- > 0;) {
+                emit(string("POP ") + RegisterAllocator::registerName(savedRegisters[i]));
+            }
+            return;
+        }
+        if (savedRegisters.empty()) {
+            emit("MOV SP, BP");
+        } else {
+            emit("LEA SP, [BP-" + to_string(2 * savedRegisters.size()) + "]");
+            for (size_t i = savedRegisters.size(); i-- > 0;) {
+                emit(string("POP ") + RegisterAllocator::registerName(savedRegisters[i]));
+            }
+        }
+        emit("POP BP");
+    }
+
+    static const char *conditionCode(TacOp op) {
+        switch (op) {
+            case TAC_LT: return "L";
+            case TAC_LE: return "LE";
+            case TAC_GT: return "G";
+            case TAC_GE: return "GE";
+            case TAC_EQ: return "E";
+            default: return "NE";
+        }
+    }
+};
+
+// System V x86-64 backend. It writes NASM source for a static Linux
+// executable:
+//     nasm -f elf64 output.asm -o output.o && ld -o program output.o
+// Instruction selection follows AssemblyCodeGenerator with 64-bit registers.
+// The allocator's BX, SI, DI and CX become RBX, R12, R13 and R14; all four
+// are callee-saved, so values stay in them across calls into the runtime.
+// Variables and temps that live in memory get a qword each in .bss (the
+// language has no initializers), and print's string literals are stored
+// once each in .rodata. float and double values are computed in double with
+// scalar SSE2 in XMM0 and XMM1; between instructions they are kept as raw
+// bits in the same registers and qwords as integers, since the allocator
+// only knows general-purpose registers. Temps get their types from
+// IntermediateCodeGnerator::tempTypes, mixed operands are converted with
+// CVTSI2SD and CVTTSD2SI (truncating, as in C), and floating constants are
+// loaded from a pool in .rodata. The runtime buffers the output and talks to the
+// kernel through the write and exit system calls. _start runs the
+// top-level code, which calls main_func at its end, and exits with the
+// value main returns. The top-level code and each function are translated
+// in parallel; pool entries are named after the literal they hold, so the
+// pieces agree on them.
+class X64CodeGenerator {
+public:
+    vector<string> text;            // Labels and instructions of .text, as the peephole optimizer sees them
+    bool treeSelection = true;      // Integer code through the tree matcher, else one template per quad
+    bool omitLeafFrames = false;    // No RBP frame or stack alignment in functions that call nothing
+    unsigned threads = 1;           // Functions translated at once
+
+    void generateFromTAC(const IntermediateCodeGnerator &icg, const RegisterAllocator *allocator = nullptr) {
+        this->icg = &icg;
+        this->allocator = allocator;
+        tempTypes = icg.tempTypes();
+        numberConstants();
+        const vector<Quad> &code = icg.instructions;
+        bool hasMain = find(icg.names.begin(), icg.names.end(), "main_func") != icg.names.end();
+        // The top-level code gets a range even when it is empty, it still calls main
+        vector<pair<size_t, size_t>> ranges = ControlFlowGraph::functionRanges(code);
+        if (code.empty() || code[0].op == TAC_FUNC) ranges.insert(ranges.begin(), make_pair((size_t)0, (size_t)0));
+
+        // One generator per worker keeps its tables from one function to the next
+        vector<Part> parts(ranges.size());
+        WorkStealingPool pool(threads);
+        vector<unique_ptr<X64CodeGenerator>> workers(pool.workersFor(ranges.size()));
+        for (unique_ptr<X64CodeGenerator> &worker : workers) {
+            worker.reset(new X64CodeGenerator());
+            worker->treeSelection = treeSelection;
+            worker->omitLeafFrames = omitLeafFrames;
+            worker->icg = &icg;
+            worker->allocator = allocator;
+            worker->program = this;
+        }
+        pool.run(ranges.size(), [&](size_t f, unsigned worker) {
+            workers[worker]->translate(ranges[f].first, ranges[f].second, f == 0, hasMain, parts[f]);
+        });
+
+        stringUsed.assign(icg.strings.size(), false);
+        constantUsed.assign(constantData.size(), false);
+        for (Part &part : parts) {
+            text.insert(text.end(), make_move_iterator(part.text.begin()), make_move_iterator(part.text.end()));
+            for (const string &name : part.memoryNames) {
+                if (memoryIndex.emplace(name, (int)memoryNames.size()).second) memoryNames.push_back(name);
+            }
+            for (int id : part.strings) stringUsed[id] = true;
+            for (int c : part.constants) constantUsed[c] = true;
+        }
+    }
+
+    // The whole NASM source: header, .text, runtime and data sections.
+    vector<string> listing() const {
+        vector<string> lines = {"; x86-64 Linux, System V; nasm -f elf64", "default rel", "global _start", "",
+                                "section .text"};
+        for (const string &line : text) lines.push_back(isLabel(line) ? line : "    " + line);
+        lines.push_back("");
+        // Output goes through a 4 KB buffer that is written out when full and
+        // at exit. Only caller-saved registers are touched.
+        static const char *const runtime[] = {
+            "__print_int:                ; RDI = value",
+            "    MOV RAX, RDI",
+            "    LEA RSI, [__digits+31]",
+            "    MOV BYTE [RSI], 10",
+            "    MOV RCX, RSI",
+            "    MOV R9, 10",
+            "    TEST RAX, RAX",
+            "    JNS __print_int_digits",
+            "    NEG RAX                     ; the minimum value stays itself, as unsigned it is right",
+            "__print_int_digits:",
+            "    XOR EDX, EDX",
+            "    DIV R9",
+            "    ADD DL, 48                  ; '0'",
+            "    DEC RCX",
+            "    MOV [RCX], DL",
+            "    TEST RAX, RAX",
+            "    JNZ __print_int_digits",
+            "    TEST RDI, RDI",
+            "    JNS __print_int_write",
+            "    DEC RCX",
+            "    MOV BYTE [RCX], 45          ; '-'",
+            "__print_int_write:",
+            "    LEA RDX, [RSI+1]",
+            "    SUB RDX, RCX",
+            "    MOV RSI, RCX",
+            "    JMP __write",
+            // printf's %g: six significant digits, trailing zeros dropped,
+            // exponent form below 1e-4 and from 1e6. The digits are |x| *
+            // 10^(5-E) rounded to an integer, E found by repeated division.
+            "__print_double:             ; XMM0 = value",
+            "    LEA RDI, [__digits]",
+            "    MOVQ RAX, XMM0",
+            "    BTR RAX, 63",
+            "    JNC __print_double_positive",
+            "    MOV BYTE [RDI], 45          ; '-'",
+            "    INC RDI",
+            "    MOVQ XMM0, RAX",
+            "__print_double_positive:",
+            "    MOV RDX, 0x7FF0000000000000",
+            "    MOV RCX, RAX",
+            "    AND RCX, RDX",
+            "    CMP RCX, RDX",
+            "    JNE __print_double_finite",
+            "    MOV DWORD [RDI], 0x666E69   ; 'inf'",
+            "    SHL RAX, 12",
+            "    JZ __print_double_word",
+            "    MOV DWORD [RDI], 0x6E616E   ; 'nan'",
+            "__print_double_word:",
+            "    ADD RDI, 3",
+            "    JMP __print_double_write",
+            "__print_double_finite:",
+            "    TEST RAX, RAX",
+            "    JNZ __print_double_nonzero",
+            "    MOV BYTE [RDI], 48",
+            "    INC RDI",
+            "    JMP __print_double_write",
+            "__print_double_nonzero:",
+            "    XOR R8D, R8D                ; R8 = E, with 10^E <= |x| < 10^(E+1) roughly",
+            "    MOVSD XMM1, XMM0",
+            "__print_double_shrink:",
+            "    UCOMISD XMM1, QWORD [__powers+8]",
+            "    JB __print_double_grow",
+            "    DIVSD XMM1, QWORD [__powers+8]",
+            "    INC R8",
+            "    JMP __print_double_shrink",
+            "__print_double_grow:",
+            "    UCOMISD XMM1, QWORD [__powers]",
+            "    JAE __print_double_round",
+            "    MULSD XMM1, QWORD [__powers+8]",
+            "    DEC R8",
+            "    JMP __print_double_grow",
+            "__print_double_round:",
+            "    MOV RCX, 5",
+            "    SUB RCX, R8",
+            "    CALL __scale",
+            "    CMP R9, 1000000",
+            "    JB __print_double_not_big",
+            "    INC R8",
+            "    DEC RCX",
+            "    CALL __scale",
+            "__print_double_not_big:",
+            "    CMP R9, 100000",
+            "    JAE __print_double_split",
+            "    DEC R8",
+            "    INC RCX",
+            "    CALL __scale",
+            "__print_double_split:               ; the six digits of R9 to __sig",
+            "    LEA R11, [__sig]",
+            "    MOV RAX, R9",
+            "    MOV ECX, 6",
+            "    MOV R10, 10",
+            "__print_double_digit:",
+            "    XOR EDX, EDX",
+            "    DIV R10",
+            "    ADD DL, 48",
+            "    MOV [R11+RCX-1], DL",
+            "    DEC RCX",
+            "    JNZ __print_double_digit",
+            "    MOV R10, 6                  ; R10 = digits left without trailing zeros",
+            "__print_double_trim:",
+            "    CMP R10, 1",
+            "    JE __print_double_trimmed",
+            "    CMP BYTE [R11+R10-1], 48",
+            "    JNE __print_double_trimmed",
+            "    DEC R10",
+            "    JMP __print_double_trim",
+            "__print_double_trimmed:",
+            "    XOR ECX, ECX                ; RCX = next digit",
+            "    CMP R8, -4",
+            "    JL __print_double_exponent",
+            "    CMP R8, 6",
+            "    JGE __print_double_exponent",
+            "    TEST R8, R8",
+            "    JNS __print_double_integer",
+            "    MOV WORD [RDI], 0x2E30      ; '0.', then -E-1 zeros",
+            "    ADD RDI, 2",
+            "    MOV RDX, R8",
+            "__print_double_zeros:",
+            "    INC RDX",
+            "    JZ __print_double_fraction",
+            "    MOV BYTE [RDI], 48",
+            "    INC RDI",
+            "    JMP __print_double_zeros",
+            "__print_double_integer:",
+            "    MOV AL, [R11+RCX]",
+            "    MOV [RDI], AL",
+            "    INC RDI",
+            "    INC RCX",
+            "    CMP RCX, R8",
+            "    JLE __print_double_integer",
+            "    CMP RCX, R10",
+            "    JGE __print_double_write",
+            "    MOV BYTE [RDI], 46          ; '.'",
+            "    INC RDI",
+            "__print_double_fraction:",
+            "    MOV AL, [R11+RCX]",
+            "    MOV [RDI], AL",
+            "    INC RDI",
+            "    INC RCX",
+            "    CMP RCX, R10",
+            "    JL __print_double_fraction",
+            "    JMP __print_double_write",
+            "__print_double_exponent:",
+            "    MOV AL, [R11]",
+            "    MOV [RDI], AL",
+            "    INC RDI",
+            "    INC RCX",
+            "    CMP R10, 1",
+            "    JE __print_double_e",
+            "    MOV BYTE [RDI], 46",
+            "    INC RDI",
+            "__print_double_mantissa:",
+            "    MOV AL, [R11+RCX]",
+            "    MOV [RDI], AL",
+            "    INC RDI",
+            "    INC RCX",
+            "    CMP RCX, R10",
+            "    JL __print_double_mantissa",
+            "__print_double_e:",
+            "    MOV WORD [RDI], 0x2B65      ; 'e+'",
+            "    TEST R8, R8",
+            "    JNS __print_double_e_digits",
+            "    MOV BYTE [RDI+1], 45        ; '-'",
+            "    NEG R8",
+            "__print_double_e_digits:",
+            "    ADD RDI, 2",
+            "    MOV RAX, R8",
+            "    MOV ECX, 10",
+            "    CMP RAX, 100",
+            "    JB __print_double_e_two",
+            "    XOR EDX, EDX",
+            "    MOV ECX, 100",
+            "    DIV RCX",
+            "    ADD AL, 48",
+            "    MOV [RDI], AL",
+            "    INC RDI",
+            "    MOV RAX, RDX",
+            "    MOV ECX, 10",
+            "__print_double_e_two:",
+            "    XOR EDX, EDX",
+            "    DIV RCX",
+            "    ADD AL, 48",
+            "    ADD DL, 48",
+            "    MOV [RDI], AL",
+            "    MOV [RDI+1], DL",
+            "    ADD RDI, 2",
+            "__print_double_write:",
+            "    MOV BYTE [RDI], 10",
+            "    LEA RSI, [__digits]",
+            "    LEA RDX, [RDI+1]",
+            "    SUB RDX, RSI",
+            "    JMP __write",
+            // The scaling goes in steps of exact powers of ten, at most 1e22,
+            // keeping what each step's rounding drops (Dekker's two-product,
+            // or the remainder of a quotient) in XMM9, so that halfway cases
+            // come out as the exact decimal value says.
+            "__scale:                    ; R9 = |x| (XMM0) * 10^RCX rounded to an integer",
+            "    LEA RDX, [__powers]",
+            "    MOV RAX, RCX",
+            "    MOVSD XMM1, XMM0",
+            "    XORPD XMM9, XMM9",
+            "    TEST RAX, RAX",
+            "    JS __scale_down",
+            "__scale_up:",
+            "    MOV R10, 22",
+            "    CMP RAX, R10",
+            "    CMOVL R10, RAX",
+            "    SUB RAX, R10",
+            "    MOVSD XMM2, QWORD [RDX+R10*8]",
+            "    CALL __two_product",
+            "    MULSD XMM9, XMM2",
+            "    ADDSD XMM9, XMM7",
+            "    MOVSD XMM1, XMM8",
+            "    TEST RAX, RAX",
+            "    JNZ __scale_up",
+            "    JMP __scale_round",
+            "__scale_down:               ; |x| >= 1e5 here; 2^-64 keeps the two-product away from overflow",
+            "    NEG RAX",
+            "    MULSD XMM1, QWORD [__two_powers]",
+            "__scale_down_more:",
+            "    MOV R10, 22",
+            "    CMP RAX, R10",
+            "    CMOVL R10, RAX",
+            "    SUB RAX, R10",
+            "    MOVSD XMM2, QWORD [RDX+R10*8]",
+            "    MOVSD XMM10, XMM1",
+            "    DIVSD XMM1, XMM2",
+            "    CALL __two_product",
+            "    SUBSD XMM10, XMM8",
+            "    SUBSD XMM10, XMM7           ; remainder of the quotient",
+            "    ADDSD XMM10, XMM9",
+            "    DIVSD XMM10, XMM2",
+            "    MOVSD XMM9, XMM10",
+            "    TEST RAX, RAX",
+            "    JNZ __scale_down_more",
+            "    MULSD XMM1, QWORD [__two_powers+8]",
+            "    MULSD XMM9, QWORD [__two_powers+8]",
+            "__scale_round:              ; the exact value is XMM1 + XMM9",
+            "    MOVSD XMM3, XMM1",
+            "    ADDSD XMM3, XMM9",
+            "    MOVSD XMM4, XMM3",
+            "    SUBSD XMM4, XMM1",
+            "    SUBSD XMM9, XMM4",
+            "    MOVSD XMM1, XMM3            ; now XMM9 is at most half an ulp of XMM1",
+            "    CVTSD2SI R9, XMM1",
+            "    CVTSI2SD XMM2, R9",
+            "    SUBSD XMM1, XMM2",
+            "    XORPD XMM3, XMM3",
+            "    UCOMISD XMM1, QWORD [__half]",
+            "    JNE __scale_below_half",
+            "    UCOMISD XMM9, XMM3",
+            "    JBE __scale_done",
+            "    INC R9",
+            "    RET",
+            "__scale_below_half:",
+            "    ADDSD XMM1, QWORD [__half]",
+            "    UCOMISD XMM1, XMM3",
+            "    JNE __scale_done",
+            "    UCOMISD XMM9, XMM3",
+            "    JAE __scale_done",
+            "    DEC R9",
+            "__scale_done:",
+            "    RET",
+            "__two_product:              ; XMM8 = XMM1 * XMM2 rounded, XMM7 = what the rounding dropped (Dekker)",
+            "    MOVSD XMM8, XMM1",
+            "    MULSD XMM8, XMM2",
+            "    MOVSD XMM3, QWORD [__split]",
+            "    MULSD XMM3, XMM1",
+            "    MOVSD XMM4, XMM3",
+            "    SUBSD XMM4, XMM1",
+            "    SUBSD XMM3, XMM4            ; high half of XMM1",
+            "    MOVSD XMM4, XMM1",
+            "    SUBSD XMM4, XMM3            ; low half",
+            "    MOVSD XMM5, QWORD [__split]",
+            "    MULSD XMM5, XMM2",
+            "    MOVSD XMM6, XMM5",
+            "    SUBSD XMM6, XMM2",
+            "    SUBSD XMM5, XMM6            ; high half of XMM2",
+            "    MOVSD XMM6, XMM2",
+            "    SUBSD XMM6, XMM5            ; low half",
+            "    MOVSD XMM7, XMM3",
+            "    MULSD XMM7, XMM5",
+            "    SUBSD XMM7, XMM8",
+            "    MULSD XMM3, XMM6",
+            "    ADDSD XMM7, XMM3",
+            "    MULSD XMM5, XMM4",
+            "    ADDSD XMM7, XMM5",
+            "    MULSD XMM4, XMM6",
+            "    ADDSD XMM7, XMM4",
+            "    RET",
+            "__print_str:                ; RSI = text, RDX = length",
+            "    CALL __write",
+            "    LEA RSI, [__digits+31]",
+            "    MOV BYTE [RSI], 10",
+            "    MOV EDX, 1",
+            "__write:                    ; appends RDX bytes at RSI to the buffer",
+            "    MOV RAX, [__out_len]",
+            "    ADD RAX, RDX",
+            "    CMP RAX, 4096",
+            "    JBE __write_copy",
+            "    PUSH RSI",
+            "    PUSH RDX",
+            "    CALL __flush",
+            "    POP RDX",
+            "    POP RSI",
+            "    CMP RDX, 4096",
+            "    JBE __write_copy",
+            "    MOV EDI, 1                  ; too long to buffer",
+            "    MOV EAX, 1",
+            "    SYSCALL",
+            "    RET",
+            "__write_copy:",
+            "    LEA RDI, [__out_buf]",
+            "    ADD RDI, [__out_len]",
+            "    ADD [__out_len], RDX",
+            "    MOV RCX, RDX",
+            "    REP MOVSB",
+            "    RET",
+            "__flush:",
+            "    LEA RSI, [__out_buf]",
+            "    MOV RDX, [__out_len]",
+            "__flush_more:",
+            "    TEST RDX, RDX",
+            "    JLE __flush_done",
+            "    MOV EDI, 1",
+            "    MOV EAX, 1                  ; write",
+            "    SYSCALL",
+            "    TEST RAX, RAX",
+            "    JLE __flush_done",
+            "    ADD RSI, RAX",
+            "    SUB RDX, RAX",
+            "    JMP __flush_more",
+            "__flush_done:",
+            "    MOV QWORD [__out_len], 0",
+            "    RET",
+            "_start:",
+            "    CALL __top",
+            "    MOV RBX, RAX",
+            "    CALL __flush",
+            "    MOV RDI, RBX",
+            "    MOV EAX, 60                 ; exit",
+            "    SYSCALL",
+        };
+        lines.insert(lines.end(), begin(runtime), end(runtime));
+        lines.push_back("");
+        lines.push_back("section .rodata");
+        lines.push_back("align 8");
+        string powers;
+        double power = 1;
+        for (int i = 0; i <= 22; i++, power *= 10) powers += (i ? ", " : "") + hexBits(bitsOf(power));
+        lines.push_back("__powers: dq " + powers + "    ; 1e0 .. 1e22, all exact");
+        lines.push_back("__two_powers: dq " + hexBits(bitsOf(ldexp(1.0, -64))) + ", " + hexBits(bitsOf(ldexp(1.0, 64))));
+        lines.push_back("__half: dq " + hexBits(bitsOf(0.5)));
+        lines.push_back("__split: dq " + hexBits(bitsOf(134217729.0)) + "    ; 2^27 + 1");
+        for (size_t c = 0; c < constantData.size(); c++) {
+            if (!constantUsed[c]) continue;
+            double value;
+            char text[32];
+            memcpy(&value, &constantData[c], sizeof value);
+            snprintf(text, sizeof text, "%.17g", value);
+            lines.push_back("c" + to_string(c) + ": dq " + hexBits(constantData[c]) + "    ; " + text);
+        }
+        for (size_t s = 0; s < stringUsed.size(); s++) {
+            if (stringUsed[s]) lines.push_back("s" + to_string(s) + ": db " + stringBytes((int)s));
+        }
+        lines.push_back("");
+        lines.push_back("section .bss");
+        lines.push_back("__out_len: resq 1");
+        lines.push_back("__out_buf: resb 4096");
+        lines.push_back("__digits: resb 32");
+        lines.push_back("__sig: resb 8");
+        for (const string &name : memoryNames) lines.push_back(name + ": resq 1");
+        return lines;
+    }
+
+    void printAssemblyCode() const {
+        for (const string &line : listing()) cout << line << endl;
+    }
+
+    // False if the file could not be written
+    bool saveToFile(const string &filename) const {
+        ofstream outFile(filename);
+        if (!outFile.is_open()) return false;
+        for (const string &line : listing()) outFile << line << '\n';
+        outFile.close();
+        return !outFile.fail();
+    }
+
+    size_t instructionCount() const {
+        return count_if(text.begin(), text.end(), [](const string &line) { return !isLabel(line); });
+    }
+
+private:
+
+    // What translating the top-level code or one function produced
+    struct Part {
+        vector<string> text;
+        vector<string> memoryNames;     // In order of first use
+        vector<int> strings, constants; // The sN and cN it refers to, with repeats
+    };
+
+    const IntermediateCodeGnerator *icg = nullptr;
+    const RegisterAllocator *allocator = nullptr;
+    const X64CodeGenerator *program = this;     // Holds the tables shared by all workers
+    size_t current = 0;             // Index of the quad being translated
+    bool framed = true;             // The current function pushed RBP
+    vector<int> savedRegisters;     // Pushed after RBP by the current function
+    vector<string> memoryNames;     // .bss qwords, in order of first use
+    unordered_map<string, int> memoryIndex;
+    vector<int> usedStrings, usedConstants;     // Referred to by the current part, with repeats
+    vector<VarType> tempTypes;
+    vector<uint64_t> constantData;  // Bits of the doubles c0, c1, ...
+    vector<int> literalConstant;    // OP_IMM id -> N of the cN holding its value
+    vector<bool> stringUsed, constantUsed;      // Entries the listing needs
+
+    // Numbers the distinct values of all literals, as doubles, in order, so
+    // cN means the same constant in every function.
+    void numberConstants() {
+        unordered_map<uint64_t, int> number;
+        literalConstant.assign(icg->literals.size(), 0);
+        for (size_t id = 0; id < icg->literals.size(); id++) {
+            uint64_t bits = bitsOf(literalValue(Operand{OP_IMM, (int)id}));
+            auto it = number.emplace(bits, (int)constantData.size()).first;
+            if (it->second == (int)constantData.size()) constantData.push_back(bits);
+            literalConstant[id] = it->second;
+        }
+    }
+
+    // Translates the quads [begin, end) into part; top for the top-level code.
+    void translate(size_t begin, size_t end, bool top, bool hasMain, Part &part) {
+        text.clear();
+        memoryNames.clear();
+        memoryIndex.clear();
+        usedStrings.clear();
+        usedConstants.clear();
+        if (treeSelection) buildTrees(begin, end);
+        if (top) {
+            emit("__top:");
+            prologue(begin == end ? icg->instructions.size() : begin);    // No region when it is empty
+        }
+        for (current = begin; current < end; current++) processTACInstruction(icg->instructions[current]);
+        if (top) endTopLevel(hasMain);
+        part.text.swap(text);
+        part.memoryNames.swap(memoryNames);
+        part.strings.swap(usedStrings);
+        part.constants.swap(usedConstants);
+    }
+
+    static bool isLabel(const string &line) { return !line.empty() && line.back() == ':'; }
+
+    static string hexBits(uint64_t bits) {
+        char text[24];
+        snprintf(text, sizeof text, "0x%016llX", (unsigned long long)bits);
+        return text;
+    }
+
+    static const char *registerName(int reg) {
+        static const char *const names[RegisterAllocator::NUM_REGISTERS] = {"RBX", "R12", "R13", "R14"};
+        return names[reg];
+    }
+
+    void emit(const string &instr) { text.push_back(instr); }
+
+    bool inRegister(const Operand &o) const { return allocator && allocator->registerOf(o) >= 0; }
+
+    bool isFlag(const Operand &o) const {
+        if (o.kind == OP_VAR) return icg->varType(o) == TYPE_BOOL;
+        return o.kind == OP_IMM && (icg->literals[o.id] == "0" || icg->literals[o.id] == "1");
+    }
+
+    // Immediates that do not fit a sign-extended 32-bit field go through R11.
+    static bool wideImmediate(const string &literal) {
+        int64_t value = strtoll(literal.c_str(), nullptr, 10);
+        return value < INT32_MIN || value > INT32_MAX;
+    }
+
+    // Registers by name, memory as QWORD [name] (v_ in front of variables
+    // keeps them apart from registers and mnemonics), immediates as written.
+    string loc(const Operand &o) {
+        if (inRegister(o)) return registerName(allocator->registerOf(o));
+        if (o.kind == OP_TEMP || o.kind == OP_VAR) {
+            string name = icg->memoryName(o);
+            if (memoryIndex.emplace(name, (int)memoryNames.size()).second) memoryNames.push_back(name);
+            return "QWORD [" + name + "]";
+        }
+        return icg->operandToString(o);
+    }
+
+    // loc for an operand that can take at most a 32-bit immediate (the
+    // second operand of arithmetic and compares, stores to memory); a wider
+    // one is moved into R11 first.
+    string source(const Operand &o) {
+        if (o.kind == OP_IMM && wideImmediate(icg->literals[o.id])) {
+            emit("MOV R11, " + icg->literals[o.id]);
+            return "R11";
+        }
+        return loc(o);
+    }
+
+    bool inMemory(const Operand &o) const { return !inRegister(o) && (o.kind == OP_TEMP || o.kind == OP_VAR); }
+
+    bool isDouble(const Operand &o) const {
+        switch (o.kind) {
+            case OP_TEMP: return program->tempTypes[o.id] == TYPE_DOUBLE;
+            case OP_VAR: return icg->varType(o) == TYPE_DOUBLE || icg->varType(o) == TYPE_FLOAT;
+            case OP_IMM: return icg->literals[o.id].find_first_of(".eE") != string::npos;
+            default: return false;
+        }
+    }
+
+    static uint64_t bitsOf(double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof bits);
+        return bits;
+    }
+
+    // A literal's value as a double, an integer one read as an integer first
+    // (as ConstValue::parse does).
+    double literalValue(const Operand &o) const {
+        const string &literal = icg->literals[o.id];
+        if (isDouble(o)) return strtod(literal.c_str(), nullptr);
+        return (double)strtoll(literal.c_str(), nullptr, 10);
+    }
+
+    // The pool entry cN holding the value of literal o, as a memory operand.
+    string constant(const Operand &o) {
+        int c = program->literalConstant[o.id];
+        usedConstants.push_back(c);
+        return "QWORD [c" + to_string(c) + "]";
+    }
+
+    // An operand as a double for the second operand of an SSE2 instruction:
+    // a double in memory or a constant is used where it is, anything else is
+    // loaded (and converted) into scratch.
+    string doubleSource(const Operand &o, const string &scratch) {
+        if (o.kind == OP_IMM) return constant(o);
+        if (isDouble(o) && inMemory(o)) return loc(o);
+        loadDouble(scratch, o);
+        return scratch;
+    }
+
+    void loadDouble(const string &xmm, const Operand &o) {
+        if (o.kind == OP_IMM) {
+            double value = literalValue(o);
+            emit(bitsOf(value) == 0 ? "XORPD " + xmm + ", " + xmm : "MOVSD " + xmm + ", " + constant(o));
+        } else if (!isDouble(o)) {
+            emit("CVTSI2SD " + xmm + ", " + loc(o));
+        } else {
+            emit(string(inRegister(o) ? "MOVQ " : "MOVSD ") + xmm + ", " + loc(o));
+        }
+    }
+
+    // Stores the double in xmm to dst, truncating it for an integer.
+    void storeDouble(const Operand &dst, const string &xmm) {
+        if (isDouble(dst)) {
+            emit(string(inRegister(dst) ? "MOVQ " : "MOVSD ") + loc(dst) + ", " + xmm);
+        } else if (inRegister(dst)) {
+            emit("CVTTSD2SI " + loc(dst) + ", " + xmm);
+        } else {
+            emit("CVTTSD2SI RAX, " + xmm);
+            emit("MOV " + loc(dst) + ", RAX");
+        }
+    }
+
+    // UCOMISD for a relation b. Returns the condition code that holds when
+    // the relation does; < and <= are turned around into > and >=, whose
+    // codes are false for unordered (NaN) operands as C wants. E and NE
+    // still have to look at the parity flag, which unordered sets.
+    string doubleCompare(TacOp relation, const Operand &a, const Operand &b) {
+        bool swap = relation == TAC_LT || relation == TAC_LE;
+        loadDouble("XMM0", swap ? b : a);
+        emit("UCOMISD XMM0, " + doubleSource(swap ? a : b, "XMM1"));
+        switch (relation) {
+            case TAC_LT:
+            case TAC_GT: return "A";
+            case TAC_LE:
+            case TAC_GE: return "AE";
+            case TAC_EQ: return "E";
+            default: return "NE";
+        }
+    }
+
+    // Sets AL to the outcome of a UCOMISD that doubleCompare returned cc for.
+    void setDoubleCondition(const string &cc) {
+        if (cc == "E") {
+            emit("SETE AL");
+            emit("SETNP DL");
+            emit("AND AL, DL");
+        } else if (cc == "NE") {
+            emit("SETNE AL");
+            emit("SETP DL");
+            emit("OR AL, DL");
+        } else {
+            emit("SET" + cc + " AL");
+        }
+    }
+
+    // Sets the byte register to 1 if o is non-zero (NaN counts), else 0.
+    // Uses CL for the parity of a double.
+    void truth(const Operand &o, const string &byteRegister) {
+        if (!isDouble(o)) {
+            compare(o, "0");
+            emit("SETNE " + byteRegister);
+            return;
+        }
+        loadDouble("XMM0", o);
+        emit("XORPD XMM1, XMM1");
+        emit("UCOMISD XMM0, XMM1");
+        emit("SETNE " + byteRegister);
+        emit("SETP CL");
+        emit("OR " + byteRegister + ", CL");
+    }
+
+    void processTACInstruction(const Quad &q) {
+        if (!roots.empty() && (folded[current - treeBase] || roots[current - treeBase])) {
+            if (roots[current - treeBase]) emitTree(q, roots[current - treeBase]);
+            return;
+        }
+        switch (q.op) {
+            case TAC_ASSIGN:
+                // Assignment (e.g., b = 7); a bool keeps only 0 or 1
+                if (q.dst.kind == OP_VAR && icg->varType(q.dst) == TYPE_BOOL && !isFlag(q.a)) {
+                    truth(q.a, "AL");
+                    storeFlag(q.dst);
+                    break;
+                }
+                // Conversions between int and double, and floating constants
+                if (isDouble(q.dst) != isDouble(q.a) || (isDouble(q.dst) && q.a.kind == OP_IMM)) {
+                    loadDouble("XMM0", q.a);
+                    storeDouble(q.dst, "XMM0");
+                    break;
+                }
+                move(q.dst, q.a);
+                break;
+            case TAC_ADD:
+            case TAC_SUB:
+            case TAC_MUL:
+            case TAC_DIV:
+                if (isDouble(q.dst)) {
+                    // Floating arithmetic (e.g., t2 = f * 3)
+                    static const char *const mnemonics[] = {"ADDSD", "SUBSD", "MULSD", "DIVSD"};
+                    loadDouble("XMM0", q.a);
+                    emit(string(mnemonics[q.op - TAC_ADD]) + " XMM0, " + doubleSource(q.b, "XMM1"));
+                    storeDouble(q.dst, "XMM0");
+                } else if (q.op != TAC_DIV) {
+                    // Arithmetic (e.g., t0 = y * 3)
+                    arithmetic(q.op == TAC_ADD ? "ADD" : q.op == TAC_SUB ? "SUB" : "IMUL", q, q.op != TAC_SUB);
+                } else {
+                    // Division (e.g., t1 = x / y); IDIV takes no immediate operand
+                    emit("MOV RAX, " + loc(q.a));
+                    emit("CQO");
+                    if (q.b.kind == OP_IMM) {
+                        emit("MOV R11, " + loc(q.b));
+                        emit("IDIV R11");
+                    } else {
+                        emit("IDIV " + loc(q.b));
+                    }
+                    emit("MOV " + loc(q.dst) + ", RAX");
+                }
+                break;
+            case TAC_LT:
+            case TAC_LE:
+            case TAC_GT:
+            case TAC_GE:
+            case TAC_EQ:
+            case TAC_NEQ:
+                // Comparison (e.g., t5 = i < 10)
+                if (isDouble(q.a) || isDouble(q.b)) {
+                    setDoubleCondition(doubleCompare(q.op, q.a, q.b));
+                } else {
+                    compare(q.a, source(q.b));
+                    emit(string("SET") + conditionCode(q.op) + " AL");
+                }
+                storeFlag(q.dst);
+                break;
+            case TAC_AND:
+            case TAC_OR:
+                // Logical operators normalize both sides to 0/1 first
+                truth(q.a, "DL");
+                truth(q.b, "AL");
+                emit(string(q.op == TAC_AND ? "AND" : "OR") + " AL, DL");
+                storeFlag(q.dst);
+                break;
+            case TAC_AGAR:
+                // Conditional jump (e.g., agar t1 goto L1)
+                if (isDouble(q.a)) {
+                    loadDouble("XMM0", q.a);
+                    emit("XORPD XMM1, XMM1");
+                    emit("UCOMISD XMM0, XMM1");
+                    emit("JP " + icg->operandToString(q.b));
+                } else {
+                    compare(q.a, "0");
+                }
+                emit("JNE " + icg->operandToString(q.b));
+                break;
+            case TAC_AGAR_LT:
+            case TAC_AGAR_LE:
+            case TAC_AGAR_GT:
+            case TAC_AGAR_GE:
+            case TAC_AGAR_EQ:
+            case TAC_AGAR_NEQ:
+                // Compare and branch (e.g., agar i >= 10 goto L2)
+                if (isDouble(q.a) || isDouble(q.b)) {
+                    string cc = doubleCompare(relationOf(q.op), q.a, q.b);
+                    if (cc == "E") {
+                        setDoubleCondition(cc);
+                        cc = "NE";      // Of AND AL, DL
+                    } else if (cc == "NE") {
+                        emit("JP " + icg->operandToString(q.dst));
+                    }
+                    emit("J" + cc + " " + icg->operandToString(q.dst));
+                    break;
+                }
+                compare(q.a, source(q.b));
+                emit(string("J") + conditionCode(relationOf(q.op)) + " " + icg->operandToString(q.dst));
+                break;
+            case TAC_GOTO:
+                emit("JMP " + icg->operandToString(q.a));
+                break;
+            case TAC_LABEL:
+                emit(icg->operandToString(q.a) + ":");
+                break;
+            case TAC_FUNC:
+                emit(icg->operandToString(q.a) + ":");
+                prologue(current);
+                break;
+            case TAC_PRINT:
+                // print: the runtime takes the value in RDI or XMM0, or a string in RSI and its length in RDX
+                if (q.a.kind == OP_STR) {
+                    usedStrings.push_back(q.a.id);
+                    emit("LEA RSI, [s" + to_string(q.a.id) + "]");
+                    emit("MOV EDX, " + to_string(icg->strings[q.a.id].size()));
+                    emit("CALL __print_str");
+                } else if (isDouble(q.a)) {
+                    loadDouble("XMM0", q.a);
+                    emit("CALL __print_double");
+                } else {
+                    emit("MOV RDI, " + loc(q.a));
+                    emit("CALL __print_int");
+                }
+                break;
+            case TAC_WAPSI:
+                // Return (e.g., wapsi b); the value goes back in RAX, a double truncated
+                if (isDouble(q.a)) {
+                    loadDouble("XMM0", q.a);
+                    emit("CVTTSD2SI RAX, XMM0");
+                } else if (q.a.kind != OP_NONE) {
+                    emit("MOV RAX, " + loc(q.a));
+                }
+                epilogue();
+                emit("RET");
+                break;
+            case TAC_RET:
+                epilogue();
+                emit("RET");
+                break;
+            case TAC_CALL:
+                emit("CALL " + icg->operandToString(q.a));
+                break;
+            default:
+                throw CompileError("Unsupported TAC: " + icg->toString(q));
+        }
+    }
+
+    // RBP frame, then the allocator's registers; an odd number of them is
+    // padded so calls keep the stack 16-byte aligned. A leaf function makes
+    // no calls, so it only saves the registers.
+    void prologue(size_t quad) {
+        const vector<Quad> &code = icg->instructions;
+        framed = !omitLeafFrames || quad >= code.size() || code[quad].op != TAC_FUNC || icg->makesCalls(quad);
+        if (framed) {
+            emit("PUSH RBP");
+            emit("MOV RBP, RSP");
+        }
+        savedRegisters.clear();
+        if (const RegisterAllocator::Region *region = allocator ? allocator->regionStartingAt(quad) : nullptr) {
+            savedRegisters = region->usedRegisters;
+        }
+        for (int reg : savedRegisters) emit(string("PUSH ") + registerName(reg));
+        if (framed && savedRegisters.size() % 2 == 1) emit("SUB RSP, 8");
+    }
+
+    void epilogue() {
+        if (!framed) {
+            for (size_t i = savedRegisters.size(); i-- > 0;) emit(string("POP ") + registerName(savedRegisters[i]));
+            return;
+        }
+        if (savedRegisters.empty()) {
+            emit("MOV RSP, RBP");
+        } else {
+            emit("LEA RSP, [RBP-" + to_string(8 * savedRegisters.size()) + "]");
+            for (size_t i = savedRegisters.size(); i-- > 0;) emit(string("POP ") + registerName(savedRegisters[i]));
+        }
+        emit("POP RBP");
+    }
+
+    // Where the top-level code would fall into the first function. The exit
+    // status is 0 unless main returns something else.
+    void endTopLevel(bool hasMain) {
+        emit("XOR EAX, EAX");
+        if (hasMain) emit("CALL main_func");
+        epilogue();
+        emit("RET");
+    }
+
+    // db operands of sN, the string literal with id N. Equal texts are
+    // interned to one id, so each literal is stored once.
+    string stringBytes(int id) const {
+        string bytes;
+        bool quoted = false;
+        for (unsigned char c : icg->strings[id]) {
+            bool printable = c >= 32 && c < 127 && c != '"';
+            if (printable != quoted || !printable) {
+                if (quoted) bytes += '"';
+                if (!bytes.empty()) bytes += ", ";
+                if (printable) bytes += '"';
+            }
+            if (printable) bytes += (char)c;
+            else bytes += to_string(c);
+            quoted = printable;
+        }
+        if (quoted) bytes += '"';
+        if (bytes.empty()) bytes = "0";
+        return bytes;
+    }
+
+    // x86 has no memory-to-memory MOV, so that case goes through RAX.
+    void move(const Operand &dst, const Operand &src) {
+        string from = inMemory(dst) ? source(src) : loc(src), to = loc(dst);
+        if (to == from) return;
+        if (inMemory(dst) && inMemory(src)) {
+            emit("MOV RAX, " + from);
+            emit("MOV " + to + ", RAX");
+        } else {
+            emit("MOV " + to + ", " + from);
+        }
+    }
+
+    // dst = a op b, computed in place when dst has a register that b is not in.
+    void arithmetic(const string &mnemonic, const Quad &q, bool commutative) {
+        string b = source(q.b), a = loc(q.a), dst = loc(q.dst);
+        if (inRegister(q.dst) && dst != b) {
+            if (dst != a) emit("MOV " + dst + ", " + a);
+            emit(mnemonic + " " + dst + ", " + b);
+        } else if (inRegister(q.dst) && commutative) {
+            emit(mnemonic + " " + dst + ", " + source(q.a));
+        } else {
+            emit("MOV RAX, " + a);
+            emit(mnemonic + " RAX, " + b);
+            emit("MOV " + dst + ", RAX");
+        }
+    }
+
+    void compare(const Operand &a, const string &b) {
+        if (inRegister(a)) {
+            emit("CMP " + loc(a) + ", " + b);
+        } else {
+            emit("MOV RAX, " + loc(a));
+            emit("CMP RAX, " + b);
+        }
+    }
+
+    // Stores the 0/1 in AL to dst.
+    void storeFlag(const Operand &dst) {
+        if (inRegister(dst)) {
+            emit("MOVZX " + loc(dst) + ", AL");
+        } else {
+            emit("MOVZX RAX, AL");
+            emit("MOV " + loc(dst) + ", RAX");
+        }
+    }
+
+    static const char *conditionCode(TacOp op) {
+        switch (op) {
+            case TAC_LT: return "L";
+            case TAC_LE: return "LE";
+            case TAC_GT: return "G";
+            case TAC_GE: return "GE";
+            case TAC_EQ: return "E";
+            default: return "NE";
+        }
+    }
+
+    // Tree-pattern instruction selection for integer code. Quads are grouped
+    // back into the expression trees they were lowered from: a temp defined
+    // by ADD, SUB, MUL or a copy and used once, later in the same run of
+    // straight-line quads, is folded into its use as long as nothing in
+    // between writes what its tree reads. Each tree is labelled bottom-up
+    // with the cheapest derivation of every nonterminal under the rules
+    // below (BURS), then reduced top-down along the chosen rules. Costs are
+    // instruction counts, so immediates, memory operands, three-operand IMUL
+    // and LEA for base + index * scale + displacement shapes are used
+    // whenever they save an instruction.
+    enum Nonterminal : uint8_t {
+        NT_REG,         // In a scratch register
+        NT_RREG,        // A value that lives in a register; read-only
+        NT_MEM,         // A qword in memory
+        NT_IMM,         // A sign-extended 32-bit immediate
+        NT_RM,          // Register or memory
+        NT_OPND,        // Register, memory or immediate
+        NT_BASE,        // In a register, usable in an address
+        NT_INDEX,       // A register times 1, 2, 4 or 8
+        NT_ADDRESS,     // base + index * scale
+        NT_LEA,         // An address with a displacement
+        NT_COUNT
+    };
+    enum RuleId : uint8_t {
+        LEAF_IMM, LEAF_WIDE, LEAF_MEM, LEAF_RREG,
+        RM_REG, RM_RREG, RM_MEM, OPND_RM, OPND_IMM, BASE_REG, BASE_RREG, ADDRESS_BASE, ADDRESS_INDEX,
+        LEA_ADDRESS, REG_OPND, REG_LEA,
+        REG_ADD, REG_ADD_SWAP, REG_SUB, REG_MUL, REG_MUL_SWAP, REG_MUL_IMM, REG_MUL_IMM_SWAP,
+        INDEX_MUL, INDEX_MUL_SWAP, ADDRESS_SCALE, ADDRESS_SCALE_SWAP, ADDRESS_ADD, ADDRESS_ADD_INDEX,
+        ADDRESS_ADD_INDEX_SWAP, LEA_ADD, LEA_ADD_SWAP, LEA_SUB,
+        RULE_COUNT
+    };
+    enum RuleKind : uint8_t { RULE_LEAF, RULE_CHAIN, RULE_OPERATOR };
+    struct Rule {
+        RuleKind kind;
+        Nonterminal lhs;
+        TacOp op;               // Of an operator rule
+        Nonterminal kids[2];    // kids[0] is what a chain rule converts from
+        int cost;
+    };
+    static const Rule &rule(int id) {
+        static const Rule rules[RULE_COUNT] = {
+            {RULE_LEAF, NT_IMM, TAC_ASSIGN, {}, 0},                           // LEAF_IMM     literal
+            {RULE_LEAF, NT_REG, TAC_ASSIGN, {}, 1},                           // LEAF_WIDE    MOV r, imm64
+            {RULE_LEAF, NT_MEM, TAC_ASSIGN, {}, 0},                           // LEAF_MEM     QWORD [x]
+            {RULE_LEAF, NT_RREG, TAC_ASSIGN, {}, 0},                          // LEAF_RREG    its register
+            {RULE_CHAIN, NT_RM, TAC_ASSIGN, {NT_REG}, 0},                     // RM_REG
+            {RULE_CHAIN, NT_RM, TAC_ASSIGN, {NT_RREG}, 0},                    // RM_RREG
+            {RULE_CHAIN, NT_RM, TAC_ASSIGN, {NT_MEM}, 0},                     // RM_MEM
+            {RULE_CHAIN, NT_OPND, TAC_ASSIGN, {NT_RM}, 0},                    // OPND_RM
+            {RULE_CHAIN, NT_OPND, TAC_ASSIGN, {NT_IMM}, 0},                   // OPND_IMM
+            {RULE_CHAIN, NT_BASE, TAC_ASSIGN, {NT_REG}, 0},                   // BASE_REG
+            {RULE_CHAIN, NT_BASE, TAC_ASSIGN, {NT_RREG}, 0},                  // BASE_RREG
+            {RULE_CHAIN, NT_ADDRESS, TAC_ASSIGN, {NT_BASE}, 0},               // ADDRESS_BASE
+            {RULE_CHAIN, NT_ADDRESS, TAC_ASSIGN, {NT_INDEX}, 0},              // ADDRESS_INDEX
+            {RULE_CHAIN, NT_LEA, TAC_ASSIGN, {NT_ADDRESS}, 0},                // LEA_ADDRESS
+            {RULE_CHAIN, NT_REG, TAC_ASSIGN, {NT_OPND}, 1},                   // REG_OPND     MOV r, o
+            {RULE_CHAIN, NT_REG, TAC_ASSIGN, {NT_LEA}, 1},                    // REG_LEA      LEA r, [a]
+            {RULE_OPERATOR, NT_REG, TAC_ADD, {NT_REG, NT_OPND}, 1},           // REG_ADD      ADD r, o
+            {RULE_OPERATOR, NT_REG, TAC_ADD, {NT_OPND, NT_REG}, 1},           // REG_ADD_SWAP
+            {RULE_OPERATOR, NT_REG, TAC_SUB, {NT_REG, NT_OPND}, 1},           // REG_SUB      SUB r, o
+            {RULE_OPERATOR, NT_REG, TAC_MUL, {NT_REG, NT_RM}, 1},             // REG_MUL      IMUL r, rm
+            {RULE_OPERATOR, NT_REG, TAC_MUL, {NT_RM, NT_REG}, 1},             // REG_MUL_SWAP
+            {RULE_OPERATOR, NT_REG, TAC_MUL, {NT_RM, NT_IMM}, 1},             // REG_MUL_IMM  IMUL r, rm, imm
+            {RULE_OPERATOR, NT_REG, TAC_MUL, {NT_IMM, NT_RM}, 1},             // REG_MUL_IMM_SWAP
+            {RULE_OPERATOR, NT_INDEX, TAC_MUL, {NT_BASE, NT_IMM}, 0},         // INDEX_MUL    b*1|2|4|8
+            {RULE_OPERATOR, NT_INDEX, TAC_MUL, {NT_IMM, NT_BASE}, 0},         // INDEX_MUL_SWAP
+            {RULE_OPERATOR, NT_ADDRESS, TAC_MUL, {NT_BASE, NT_IMM}, 0},       // ADDRESS_SCALE  b+b*2|4|8 for 3, 5, 9
+            {RULE_OPERATOR, NT_ADDRESS, TAC_MUL, {NT_IMM, NT_BASE}, 0},       // ADDRESS_SCALE_SWAP
+            {RULE_OPERATOR, NT_ADDRESS, TAC_ADD, {NT_BASE, NT_BASE}, 0},      // ADDRESS_ADD  a+b
+            {RULE_OPERATOR, NT_ADDRESS, TAC_ADD, {NT_BASE, NT_INDEX}, 0},     // ADDRESS_ADD_INDEX  a+b*s
+            {RULE_OPERATOR, NT_ADDRESS, TAC_ADD, {NT_INDEX, NT_BASE}, 0},     // ADDRESS_ADD_INDEX_SWAP
+            {RULE_OPERATOR, NT_LEA, TAC_ADD, {NT_ADDRESS, NT_IMM}, 0},        // LEA_ADD      a+d
+            {RULE_OPERATOR, NT_LEA, TAC_ADD, {NT_IMM, NT_ADDRESS}, 0},        // LEA_ADD_SWAP
+            {RULE_OPERATOR, NT_LEA, TAC_SUB, {NT_ADDRESS, NT_IMM}, 0},        // LEA_SUB      a-d
+        };
+        return rules[id];
+    }
+
+    static const int INFINITE_COST = INT_MAX / 4;
+    static const int SCRATCH_REGISTERS = 8;
+    static const int MAX_TREE_REGISTERS = 6;    // Trees that need more stay split, with temps in between
+    static const size_t MAX_FOLD_DISTANCE = 64; // Quads between a definition and the use it is folded into
+
+    struct Node {
+        TacOp op = TAC_ASSIGN;          // TAC_ASSIGN for a leaf
+        Operand leaf;
+        Node *kids[2] = {nullptr, nullptr};
+        int need = 0;                   // Scratch registers to evaluate it (Sethi-Ullman)
+        int cost[NT_COUNT];
+        RuleId rule[NT_COUNT];
+        bool isLeaf() const { return op == TAC_ASSIGN; }
+    };
+
+    deque<Node> nodes;
+    size_t treeBase = 0;                // First quad of the function; roots and folded start there
+    vector<Node *> roots;               // Tree of each quad that is a root, by quad
+    vector<bool> folded;                // Quads folded into a later tree
+    vector<size_t> foldedList;          // The same quads, in the order they were folded
+    vector<size_t> foldPath;            // Definitions being folded into the tree under construction
+    int tempBase = 0;                   // Lowest temp of the function; the tables below start there
+    vector<int> tempUses, tempDefs;
+    vector<size_t> tempDefAt;
+    unsigned scratchFree = 0;           // Bit per SCRATCH_NAMES entry
+
+    static const char *scratchName(int r) {
+        static const char *const names[SCRATCH_REGISTERS] = {"RAX", "RCX", "RDX", "RSI", "RDI", "R8", "R9", "R10"};
+        return names[r];
+    }
+
+    int64_t immediateValue(const Node *n) const { return strtoll(icg->literals[n->leaf.id].c_str(), nullptr, 10); }
+
+    bool isInteger(const Operand &o) const { return o.kind != OP_STR && !isDouble(o); }
+
+    // Quads whose value can be folded into the tree of its one use.
+    bool foldable(const Quad &q) const {
+        if (q.dst.kind != OP_TEMP || !isInteger(q.dst)) return false;
+        if (q.op == TAC_ASSIGN) return isInteger(q.a);
+        return (q.op == TAC_ADD || q.op == TAC_SUB || q.op == TAC_MUL) && isInteger(q.a) && isInteger(q.b);
+    }
+
+    bool isTreeRoot(const Quad &q) const {
+        switch (q.op) {
+            case TAC_ASSIGN:
+                if (q.dst.kind == OP_VAR && icg->varType(q.dst) == TYPE_BOOL && !isFlag(q.a)) return false;
+                return isInteger(q.dst) && isInteger(q.a);
+            case TAC_ADD:
+            case TAC_SUB:
+            case TAC_MUL: return isInteger(q.dst) && isInteger(q.a) && isInteger(q.b);
+            case TAC_LT: case TAC_LE: case TAC_GT: case TAC_GE: case TAC_EQ: case TAC_NEQ:
+            case TAC_AGAR_LT: case TAC_AGAR_LE: case TAC_AGAR_GT: case TAC_AGAR_GE: case TAC_AGAR_EQ: case TAC_AGAR_NEQ:
+                return isInteger(q.a) && isInteger(q.b);
+            case TAC_AGAR:
+            case TAC_PRINT: return isInteger(q.a);
+            case TAC_WAPSI: return q.a.kind != OP_NONE && isInteger(q.a);
+            default: return false;
+        }
+    }
+
+    // Trees of the quads [begin, end), one function. Temps never cross
+    // functions, so their uses are counted within it.
+    void buildTrees(size_t begin, size_t end) {
+        const vector<Quad> &code = icg->instructions;
+        int lowest = INT_MAX, highest = -1;
+        for (size_t i = begin; i < end; i++) {
+            for (const Operand *o : {&code[i].dst, &code[i].a, &code[i].b}) {
+                if (o->kind != OP_TEMP) continue;
+                lowest = min(lowest, o->id);
+                highest = max(highest, o->id);
+            }
+        }
+        tempBase = highest < 0 ? 0 : lowest;
+        tempUses.assign(highest + 1 - tempBase, 0);
+        tempDefs.assign(highest + 1 - tempBase, 0);
+        tempDefAt.assign(highest + 1 - tempBase, 0);
+        for (size_t i = begin; i < end; i++) {
+            const Quad &q = code[i];
+            if (q.a.kind == OP_TEMP) tempUses[q.a.id - tempBase]++;
+            if (q.b.kind == OP_TEMP) tempUses[q.b.id - tempBase]++;
+            if (q.dst.kind == OP_TEMP) {
+                tempDefs[q.dst.id - tempBase]++;
+                tempDefAt[q.dst.id - tempBase] = i;
+            }
+        }
+        nodes.clear();
+        foldedList.clear();
+        treeBase = begin;
+        roots.assign(end - begin, nullptr);
+        folded.assign(end - begin, false);
+        // Backwards, so a quad is folded before it would become a root of its own
+        for (size_t i = end; i-- > begin;) {
+            const Quad &q = code[i];
+            if (folded[i - begin] || !isTreeRoot(q)) continue;
+            bool binary = q.op != TAC_ASSIGN && q.op != TAC_AGAR && q.op != TAC_PRINT && q.op != TAC_WAPSI;
+            roots[i - begin] = binary ? node(q.op, tree(q.a, i), tree(q.b, i)) : tree(q.a, i);
+        }
+    }
+
+    Node *leaf(const Operand &o) {
+        nodes.emplace_back();
+        Node *n = &nodes.back();
+        n->leaf = o;
+        n->need = o.kind == OP_IMM && wideImmediate(icg->literals[o.id]) ? 1 : 0;
+        return n;
+    }
+
+    Node *node(TacOp op, Node *left, Node *right) {
+        nodes.emplace_back();
+        Node *n = &nodes.back();
+        n->op = op;
+        n->kids[0] = left;
+        n->kids[1] = right;
+        n->need = left->need == right->need ? left->need + 1 : max(left->need, right->need);
+        n->need = max(n->need, 1);
+        return n;
+    }
+
+    // The tree of operand o as read by the quad at evalAt.
+    Node *tree(const Operand &o, size_t evalAt) {
+        if (o.kind != OP_TEMP || tempUses[o.id - tempBase] != 1 || tempDefs[o.id - tempBase] != 1) return leaf(o);
+        size_t def = tempDefAt[o.id - tempBase];
+        const Quad &q = icg->instructions[def];
+        if (def >= evalAt || evalAt - def > MAX_FOLD_DISTANCE || !foldable(q) || !straightLine(def, evalAt)) {
+            return leaf(o);
+        }
+        size_t mark = foldedList.size();
+        foldPath.push_back(def);
+        Node *n = q.op == TAC_ASSIGN ? tree(q.a, evalAt) : node(q.op, tree(q.a, evalAt), tree(q.b, evalAt));
+        foldPath.pop_back();
+        if (n->need <= MAX_TREE_REGISTERS && !clobbered(n, def, evalAt)) {
+            folded[def - treeBase] = true;
+            foldedList.push_back(def);
+            return n;
+        }
+        for (size_t i = mark; i < foldedList.size(); i++) folded[foldedList[i] - treeBase] = false;
+        foldedList.resize(mark);
+        return leaf(o);
+    }
+
+    bool straightLine(size_t from, size_t to) const {
+        for (size_t i = from + 1; i < to; i++) {
+            switch (icg->instructions[i].op) {
+                case TAC_ASSIGN: case TAC_ADD: case TAC_SUB: case TAC_MUL: case TAC_DIV:
+                case TAC_LT: case TAC_LE: case TAC_GT: case TAC_GE: case TAC_EQ: case TAC_NEQ:
+                case TAC_AND: case TAC_OR: case TAC_PRINT:
+                    break;
+                default: return false;      // Labels, jumps and calls
+            }
+        }
+        return true;
+    }
+
+    // Whether a quad between from and to writes a leaf of n. A quad that
+    // touches another value in a leaf's register counts too: the allocator
+    // shares a register only between values whose intervals do not
+    // overlap, and folding stretches the leaf's interval up to the use.
+    // Folded quads emit nothing where they stand, so they are skipped.
+    bool clobbered(const Node *n, size_t from, size_t to) const {
+        if (!n->isLeaf()) return clobbered(n->kids[0], from, to) || clobbered(n->kids[1], from, to);
+        if (n->leaf.kind != OP_TEMP && n->leaf.kind != OP_VAR) return false;
+        int reg = allocator ? allocator->registerOf(n->leaf) : -1;
+        for (size_t i = from + 1; i < to; i++) {
+            if (folded[i - treeBase] || find(foldPath.begin(), foldPath.end(), i) != foldPath.end()) continue;
+            const Quad &q = icg->instructions[i];
+            if (q.dst == n->leaf) return true;
+            if (reg < 0) continue;
+            for (const Operand *o : {&q.dst, &q.a, &q.b}) {
+                if (*o != n->leaf && allocator->registerOf(*o) == reg) return true;
+            }
+        }
+        return false;
+    }
+
+    bool readsRegister(const Node *n, int reg) const {
+        if (!n->isLeaf()) return readsRegister(n->kids[0], reg) || readsRegister(n->kids[1], reg);
+        return reg >= 0 && allocator && allocator->registerOf(n->leaf) == reg;
+    }
+
+    bool applies(int id, const Node *n) const {
+        switch (id) {
+            case LEAF_IMM:
+            case LEAF_WIDE:
+                return n->leaf.kind == OP_IMM && wideImmediate(icg->literals[n->leaf.id]) == (id == LEAF_WIDE);
+            case LEAF_MEM: return inMemory(n->leaf);
+            case LEAF_RREG: return inRegister(n->leaf);
+            case INDEX_MUL:
+            case INDEX_MUL_SWAP:
+            case ADDRESS_SCALE:
+            case ADDRESS_SCALE_SWAP: {
+                const Node *k = n->kids[id == INDEX_MUL || id == ADDRESS_SCALE ? 1 : 0];
+                if (!k->isLeaf() || k->leaf.kind != OP_IMM) return false;
+                int64_t v = immediateValue(k);
+                return id == INDEX_MUL || id == INDEX_MUL_SWAP ? v == 1 || v == 2 || v == 4 || v == 8
+                                                                : v == 3 || v == 5 || v == 9;
+            }
+            case LEA_SUB: return immediateValue(n->kids[1]) != INT32_MIN;
+            default: return true;
+        }
+    }
+
+    void labelTree(Node *n) {
+        if (!n->isLeaf()) {
+            labelTree(n->kids[0]);
+            labelTree(n->kids[1]);
+        }
+        fill(begin(n->cost), end(n->cost), INFINITE_COST);
+        for (int id = 0; id < RULE_COUNT; id++) {
+            const Rule &r = rule(id);
+            if (r.kind == RULE_CHAIN || (r.kind == RULE_LEAF) != n->isLeaf()) continue;
+            if (r.kind == RULE_OPERATOR && r.op != n->op) continue;
+            int cost = r.cost;
+            if (r.kind == RULE_OPERATOR) cost += n->kids[0]->cost[r.kids[0]] + n->kids[1]->cost[r.kids[1]];
+            if (cost < n->cost[r.lhs] && applies(id, n)) {
+                n->cost[r.lhs] = cost;
+                n->rule[r.lhs] = RuleId(id);
+            }
+        }
+        // Chain rules, until no nonterminal gets cheaper
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (int id = 0; id < RULE_COUNT; id++) {
+                const Rule &r = rule(id);
+                if (r.kind != RULE_CHAIN) continue;
+                int cost = r.cost + n->cost[r.kids[0]];
+                if (cost < n->cost[r.lhs]) {
+                    n->cost[r.lhs] = cost;
+                    n->rule[r.lhs] = RuleId(id);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    string scratch(vector<int> &held) {
+        for (int r = 0; r < SCRATCH_REGISTERS; r++) {
+            if (scratchFree & (1u << r)) {
+                scratchFree &= ~(1u << r);
+                held.push_back(r);
+                return scratchName(r);
+            }
+        }
+        throw CompileError("x86-64 backend: out of scratch registers");
+    }
+
+    void release(vector<int> &held) {
+        for (int r : held) scratchFree |= 1u << r;
+        held.clear();
+    }
+
+    static string displacement(int64_t value) { return (value < 0 ? "" : "+") + to_string(value); }
+
+    // Reduces the kids of n to a and b in the order that needs fewer registers.
+    void reduceKids(Node *n, Nonterminal a, string &textA, vector<int> &heldA, Nonterminal b, string &textB,
+                    vector<int> &heldB, const string &targetA = "", const string &targetB = "") {
+        if (n->kids[1]->need > n->kids[0]->need) {
+            textB = reduce(n->kids[1], b, heldB, targetB);
+            textA = reduce(n->kids[0], a, heldA, targetA);
+        } else {
+            textA = reduce(n->kids[0], a, heldA, targetA);
+            textB = reduce(n->kids[1], b, heldB, targetB);
+        }
+    }
+
+    // Emits the instructions for n as nt along its chosen rules and returns
+    // the operand that holds it. Scratch registers that operand uses are
+    // added to held. A REG goes to target when one is given.
+    string reduce(Node *n, Nonterminal nt, vector<int> &held, const string &target = "") {
+        RuleId id = n->rule[nt];
+        const Rule &r = rule(id);
+        vector<int> other;
+        string a, b;
+        switch (id) {
+            case LEAF_IMM: return icg->literals[n->leaf.id];
+            case LEAF_MEM:
+            case LEAF_RREG: return loc(n->leaf);
+            case LEAF_WIDE: {
+                string dst = target.empty() ? scratch(held) : target;
+                emit("MOV " + dst + ", " + icg->literals[n->leaf.id]);
+                return dst;
+            }
+            case REG_OPND:
+            case REG_LEA: {
+                a = reduce(n, r.kids[0], other);
+                release(other);
+                string dst = target.empty() ? scratch(held) : target;
+                if (id == REG_LEA) emit("LEA " + dst + ", [" + a + "]");
+                else if (dst != a) emit("MOV " + dst + ", " + a);
+                return dst;
+            }
+            case REG_ADD:
+            case REG_SUB:
+            case REG_MUL:
+                reduceKids(n, NT_REG, a, held, r.kids[1], b, other, target);
+                emit(string(id == REG_ADD ? "ADD " : id == REG_SUB ? "SUB " : "IMUL ") + a + ", " + b);
+                release(other);
+                return a;
+            case REG_ADD_SWAP:
+            case REG_MUL_SWAP:
+                reduceKids(n, r.kids[0], a, other, NT_REG, b, held, "", target);
+                emit(string(id == REG_ADD_SWAP ? "ADD " : "IMUL ") + b + ", " + a);
+                release(other);
+                return b;
+            case REG_MUL_IMM:
+            case REG_MUL_IMM_SWAP: {
+                Node *operand = n->kids[id == REG_MUL_IMM ? 0 : 1], *factor = n->kids[id == REG_MUL_IMM ? 1 : 0];
+                a = reduce(operand, NT_RM, other);
+                release(other);
+                string dst = target.empty() ? scratch(held) : target;
+                emit("IMUL " + dst + ", " + a + ", " + to_string(immediateValue(factor)));
+                return dst;
+            }
+            case INDEX_MUL:
+            case INDEX_MUL_SWAP:
+            case ADDRESS_SCALE:
+            case ADDRESS_SCALE_SWAP: {
+                bool factorRight = id == INDEX_MUL || id == ADDRESS_SCALE;
+                a = reduce(n->kids[factorRight ? 0 : 1], NT_BASE, held);
+                int64_t factor = immediateValue(n->kids[factorRight ? 1 : 0]);
+                if (id == INDEX_MUL || id == INDEX_MUL_SWAP) return factor == 1 ? a : a + "*" + to_string(factor);
+                return a + "+" + a + "*" + to_string(factor - 1);
+            }
+            case ADDRESS_ADD:
+            case ADDRESS_ADD_INDEX:
+            case ADDRESS_ADD_INDEX_SWAP:
+                reduceKids(n, r.kids[0], a, held, r.kids[1], b, held);
+                return id == ADDRESS_ADD_INDEX_SWAP ? b + "+" + a : a + "+" + b;
+            case LEA_ADD:
+            case LEA_ADD_SWAP:
+            case LEA_SUB: {
+                bool addressLeft = id != LEA_ADD_SWAP;
+                a = reduce(n->kids[addressLeft ? 0 : 1], NT_ADDRESS, held);
+                int64_t d = immediateValue(n->kids[addressLeft ? 1 : 0]);
+                return a + displacement(id == LEA_SUB ? -d : d);
+            }
+            default:
+                // The remaining chain rules pass the kid's operand on
+                return reduce(n, r.kids[0], held, r.lhs == NT_REG ? target : "");
+        }
+    }
+
+    void emitTree(const Quad &q, Node *n) {
+        scratchFree = (1u << SCRATCH_REGISTERS) - 1;
+        string label = icg->operandToString(q.op >= TAC_AGAR_LT && q.op <= TAC_AGAR_NEQ ? q.dst : q.b);
+        switch (q.op) {
+            case TAC_ASSIGN:
+            case TAC_ADD:
+            case TAC_SUB:
+            case TAC_MUL:
+                storeTree(q.dst, n);
+                break;
+            case TAC_AGAR:
+                testTree(n);
+                emit("JNE " + label);
+                break;
+            case TAC_PRINT:
+            case TAC_WAPSI: {
+                // Straight into the register the value is passed in
+                int target = q.op == TAC_PRINT ? 4 : 0;
+                vector<int> held;
+                labelTree(n);
+                scratchFree &= ~(1u << target);
+                reduce(n, NT_REG, held, scratchName(target));
+                if (q.op == TAC_PRINT) {
+                    emit("CALL __print_int");
+                } else {
+                    epilogue();
+                    emit("RET");
+                }
+                break;
+            }
+            default:
+                if (q.op >= TAC_AGAR_LT && q.op <= TAC_AGAR_NEQ) {
+                    emit("J" + compareTree(relationOf(q.op), n) + " " + label);
+                } else {
+                    emit("SET" + compareTree(q.op, n) + " AL");
+                    storeFlag(q.dst);
+                }
+        }
+    }
+
+    // dst = n: computed straight into dst's register when n does not read
+    // it, in place for x = x op y, or into a scratch register and stored.
+    void storeTree(const Operand &dst, Node *n) {
+        labelTree(n);
+        if (n->isLeaf() && n->leaf == dst) return;
+        vector<int> held, other;
+        string to = loc(dst), a;
+        int reg = allocator ? allocator->registerOf(dst) : -1;
+        // x = x op y, with y as an immediate, register or (into a register) memory
+        int rmwCost = INFINITE_COST;
+        Node *y = nullptr;
+        bool commutative = n->op == TAC_ADD || n->op == TAC_MUL;
+        if (!n->isLeaf() && (n->op != TAC_MUL || reg >= 0)) {
+            Node *left = n->kids[0], *right = n->kids[1];
+            if (left->isLeaf() && left->leaf == dst) y = right;
+            else if (commutative && right->isLeaf() && right->leaf == dst) y = left;
+        }
+        Nonterminal yAs = NT_OPND;
+        if (y) {
+            if (reg >= 0) {
+                yAs = n->op == TAC_MUL && y->cost[NT_IMM] > y->cost[NT_RM] ? NT_RM : NT_OPND;
+            } else {
+                yAs = y->cost[NT_IMM] <= y->cost[NT_BASE] ? NT_IMM : NT_BASE;
+            }
+            rmwCost = 1 + y->cost[yAs];
+        }
+        int direct = INFINITE_COST;
+        if (reg >= 0) {
+            direct = readsRegister(n, reg) ? n->cost[NT_REG] + 1 : n->cost[NT_REG];
+        } else {
+            direct = 1 + min(n->cost[NT_IMM], n->cost[NT_BASE]);
+        }
+        if (rmwCost < direct || (rmwCost == direct && y)) {
+            a = reduce(y, yAs, other);
+            emit(string(n->op == TAC_ADD ? "ADD " : n->op == TAC_SUB ? "SUB " : "IMUL ") + to + ", " + a);
+        } else if (reg >= 0 && !readsRegister(n, reg)) {
+            reduce(n, NT_REG, held, to);
+        } else if (reg >= 0) {
+            emit("MOV " + to + ", " + reduce(n, NT_REG, held));
+        } else {
+            emit("MOV " + to + ", " + reduce(n, n->cost[NT_IMM] <= n->cost[NT_BASE] ? NT_IMM : NT_BASE, held));
+        }
+    }
+
+    // CMP for n's relation; returns the condition code of it (turned
+    // around when the operands are).
+    string compareTree(TacOp relation, Node *n) {
+        labelTree(n->kids[0]);
+        labelTree(n->kids[1]);
+        struct Form { Nonterminal a, b; bool swapped; };
+        static const Form forms[] = {
+            {NT_RM, NT_IMM, false}, {NT_BASE, NT_RM, false}, {NT_RM, NT_BASE, false}, {NT_IMM, NT_RM, true},
+        };
+        const Form *best = nullptr;
+        int bestCost = INFINITE_COST;
+        for (const Form &f : forms) {
+            int cost = n->kids[0]->cost[f.a] + n->kids[1]->cost[f.b];
+            if (cost < bestCost) {
+                best = &f;
+                bestCost = cost;
+            }
+        }
+        vector<int> heldA, heldB;
+        string a, b;
+        reduceKids(n, best->a, a, heldA, best->b, b, heldB);
+        if (best->swapped) {
+            emit("CMP " + b + ", " + a);
+            switch (relation) {
+                case TAC_LT: relation = TAC_GT; break;
+                case TAC_LE: relation = TAC_GE; break;
+                case TAC_GT: relation = TAC_LT; break;
+                case TAC_GE: relation = TAC_LE; break;
+                default: break;
+            }
+        } else {
+            emit("CMP " + a + ", " + b);
+        }
+        return conditionCode(relation);
+    }
+
+    void testTree(Node *n) {
+        labelTree(n);
+        vector<int> held;
+        if (n->cost[NT_BASE] < n->cost[NT_RM]) {
+            string r = reduce(n, NT_BASE, held);
+            emit("TEST " + r + ", " + r);
+        } else {
+            emit("CMP " + reduce(n, NT_RM, held) + ", 0");
+        }
+    }
+};
+
+
+// Peephole optimizer over the generated assembly text: the 16-bit listing,
+// or the .text of the x86-64 backend, where RAX plays the part of AX. Each
+// pattern looks at a few instructions starting at one position and rewrites
+// them in place; sweeps over the whole listing repeat until no pattern fires.
+// Deleted lines are only marked during a sweep and compacted after it, so a
+// sweep is linear.
+class PeepholeOptimizer {
+public:
+    PeepholeOptimizer(vector<string> &code) : code(code) {
+        patterns = {
+            {"jump-to-next", &PeepholeOptimizer::jumpToNext},
+            {"jump-over-jump", &PeepholeOptimizer::jumpOverJump},
+            {"jump-threading", &PeepholeOptimizer::jumpThreading},
+            {"reload-after-store", &PeepholeOptimizer::reloadAfterStore},
+            {"self-move", &PeepholeOptimizer::selfMove},
+            {"identity-arith", &PeepholeOptimizer::identityArith},
+            {"branch-on-setcc", &PeepholeOptimizer::branchOnSetcc},
+            {"dead-temp-store", &PeepholeOptimizer::deadTempStore},
+            {"dead-ax", &PeepholeOptimizer::deadAX},
+            {"unreachable-code", &PeepholeOptimizer::unreachableCode},
+            {"unused-label", &PeepholeOptimizer::unusedLabel},
+        };
+    }
+
+    // "all", "none" or a comma separated list of pattern names. Returns false
+    // and leaves the selection alone if a name is unknown.
+    bool select(const string &list) {
+        vector<bool> enabled(patterns.size(), list == "all");
+        if (list != "all" && list != "none") {
+            stringstream names(list);
+            string name;
+            while (getline(names, name, ',')) {
+                auto it = find_if(patterns.begin(), patterns.end(), [&](const Pattern &p) { return name == p.name; });
+                if (it == patterns.end()) return false;
+                enabled[it - patterns.begin()] = true;
+            }
+        }
+        for (size_t i = 0; i < patterns.size(); i++) patterns[i].enabled = enabled[i];
+        return true;
+    }
+
+    string patternNames() const {
+        string names;
+        for (const Pattern &p : patterns) names += string(names.empty() ? "" : ", ") + p.name;
+        return names;
+    }
+
+    void run() {
+        linesBefore = code.size();
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            index();
+            for (size_t i = 0; i < code.size(); i++) {
+                Line line = at(i);
+                for (Pattern &p : patterns) {
+                    if (removed[i]) break;
+                    if (p.enabled && (this->*p.apply)(i, line)) {
+                        p.hits++;
+                        changed = true;
+                        line = at(i);
+                    }
+                }
+            }
+            compact();
+        }
+    }
+
+    void printReport() const {
+        cout << "Peephole: " << linesBefore << " -> " << code.size() << " lines" << endl;
+        for (const Pattern &p : patterns) {
+            if (p.enabled) cout << "  " << p.name << ": " << p.hits << " hits" << endl;
+        }
+    }
+
+private:
+    // One line split into views: "op x, y" or "op x, y, z", or a label with
+    // its name in op.
+    struct Line {
+        string_view op, x, y, z;
+        bool label = false;
+    };
+    struct Pattern {
+        const char *name;
+        bool (PeepholeOptimizer::*apply)(size_t, const Line &);
+        bool enabled = true;
+        long hits = 0;
+    };
+
+    vector<string> &code;
+    vector<Pattern> patterns;
+    vector<bool> removed;
+    vector<size_t> labelAt;         // Line of each local label LN, by N
+    vector<int> labelRefs;          // Jumps to each local label
+    vector<int> tempReads;          // Reads of [tN], by N
+    size_t linesBefore = 0;
+
+    static Line parse(const string &text) {
+        Line line;
+        string_view s(text);
+        if (!s.empty() && s.back() == ':') {
+            line.label = true;
+            line.op = s.substr(0, s.size() - 1);
+            return line;
+        }
+        size_t space = s.find(' ');
+        line.op = s.substr(0, space);
+        if (space == string_view::npos) return line;
+        string_view rest = s.substr(space + 1);
+        size_t comma = rest[0] == '"' ? string_view::npos : rest.find(", ");
+        line.x = rest.substr(0, comma);
+        if (comma == string_view::npos) return line;
+        line.y = rest.substr(comma + 2);
+        comma = line.y.find(", ");
+        if (comma != string_view::npos) {
+            line.z = line.y.substr(comma + 2);
+            line.y = line.y.substr(0, comma);
+        }
+        return line;
+    }
+
+    Line at(size_t i) const { return parse(code[i]); }
+    void remove(size_t i) { removed[i] = true; }
+
+    // Next line that is still there, or code.size().
+    size_t next(size_t i) const {
+        do i++; while (i < code.size() && removed[i]);
+        return i;
+    }
+
+    static bool isJump(const Line &l) { return !l.label && l.op.size() >= 2 && l.op[0] == 'J'; }
+    static bool isConditionalJump(const Line &l) { return isJump(l) && l.op != "JMP"; }
+    static bool isAX(string_view operand) {
+        return operand == "AX" || operand == "AL" || operand == "AH" || operand == "RAX" || operand == "EAX";
+    }
+
+    // Whether an address such as [RAX+RCX*4+8] is computed from AX.
+    static bool addressesAX(string_view operand) {
+        size_t open = operand.find('[');
+        if (open == string_view::npos) return false;
+        string_view address = operand.substr(open + 1, operand.size() - open - 2);
+        while (!address.empty()) {
+            size_t end = address.find_first_of("+-*");
+            if (isAX(address.substr(0, end))) return true;
+            if (end == string_view::npos) break;
+            address.remove_prefix(end + 1);
+        }
+        return false;
+    }
+
+    // N for a "[tN]" operand, -1 for anything else. Variables are [v_name]
+    // (see memoryName), so this never matches one, whatever it is called.
+    static int tempNumber(string_view operand) {
+        if (operand.substr(0, 5) == "WORD ") operand.remove_prefix(5);
+        else if (operand.substr(0, 6) == "QWORD ") operand.remove_prefix(6);
+        if (operand.size() < 4 || operand.substr(0, 2) != "[t" || operand.back() != ']') return -1;
+        int n = 0;
+        for (char c : operand.substr(2, operand.size() - 3)) {
+            if (!isdigit((unsigned char)c)) return -1;
+            n = n * 10 + (c - '0');
+        }
+        return n;
+    }
+
+    // N for a local label "LN", -1 for anything else (function labels).
+    static int labelNumber(string_view name) {
+        if (name.size() < 2 || name[0] != 'L') return -1;
+        int n = 0;
+        for (char c : name.substr(1)) {
+            if (!isdigit((unsigned char)c)) return -1;
+            n = n * 10 + (c - '0');
+        }
+        return n;
+    }
+
+    // Line of the local label called name, or code.size() if there is none.
+    size_t labelLine(string_view name) const {
+        int n = labelNumber(name);
+        return n >= 0 && n < (int)labelAt.size() ? labelAt[n] : code.size();
+    }
+
+    static string invert(string_view jcc) {
+        static const pair<const char *, const char *> opposite[] = {
+            {"JE", "JNE"}, {"JNE", "JE"}, {"JL", "JGE"}, {"JGE", "JL"}, {"JG", "JLE"}, {"JLE", "JG"},
+            {"JA", "JBE"}, {"JBE", "JA"}, {"JAE", "JB"}, {"JB", "JAE"},
+        };
+        for (const auto &p : opposite) {
+            if (jcc == p.first) return p.second;
+        }
+        return "";
+    }
+
+    // Label positions, jump references and temp reads for this sweep. Lines
+    // removed later in the sweep still count, which only makes the patterns
+    // that use these more careful.
+    void index() {
+        removed.assign(code.size(), false);
+        labelAt.clear();
+        labelRefs.clear();
+        tempReads.clear();
+        for (size_t i = 0; i < code.size(); i++) {
+            Line l = at(i);
+            if (l.label) {
+                int n = labelNumber(l.op);
+                if (n < 0) continue;
+                if (n >= (int)labelAt.size()) labelAt.resize(n + 1, code.size());
+                labelAt[n] = i;
+                continue;
+            }
+            if (isJump(l)) {
+                int n = labelNumber(l.x);
+                if (n >= 0) {
+                    if (n >= (int)labelRefs.size()) labelRefs.resize(n + 1, 0);
+                    labelRefs[n]++;
+                }
+            }
+            bool store = l.op == "MOV" || l.op == "MOVZX";
+            for (string_view operand : {store ? string_view() : l.x, l.y, l.z}) {
+                int n = tempNumber(operand);
+                if (n < 0) continue;
+                if (n >= (int)tempReads.size()) tempReads.resize(n + 1, 0);
+                tempReads[n]++;
+            }
+        }
+    }
+
+    void compact() {
+        size_t out = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (removed[i]) continue;
+            if (out != i) code[out] = move(code[i]);
+            out++;
+        }
+        code.resize(out);
+    }
+
+    // Whether the label named target comes after line i with only labels between.
+    bool fallsInto(size_t i, string_view target) const {
+        for (size_t j = next(i); j < code.size(); j = next(j)) {
+            Line l = at(j);
+            if (!l.label) return false;
+            if (l.op == target) return true;
+        }
+        return false;
+    }
+
+    // Whether AX is overwritten (or clobbered by a call) before anything reads
+    // it on every path from line i. The budget is shared by all paths, and the
+    // answer is no once it runs out.
+    bool axDeadFrom(size_t i) const {
+        int budget = 16;
+        return axDeadFrom(i, budget);
+    }
+
+    bool axDeadFrom(size_t i, int &budget) const {
+        for (; budget > 0 && i < code.size(); i = next(i), budget--) {
+            Line l = at(i);
+            if (l.label) continue;
+            if (l.op == "JMP") {
+                size_t target = labelLine(l.x);
+                return target < code.size() && axDeadFrom(target, --budget);
+            }
+            if (isConditionalJump(l)) {
+                size_t target = labelLine(l.x);
+                if (target >= code.size() || !axDeadFrom(target, --budget)) return false;
+                continue;
+            }
+            if (l.op == "CALL") return true;
+            if (l.op == "RET" || l.op == "CWD" || l.op == "CQO" || l.op == "IDIV") return false;
+            if (isAX(l.y) || isAX(l.z) || addressesAX(l.x) || addressesAX(l.y) || addressesAX(l.z)) return false;
+            bool writes = l.op == "MOV" || l.op == "MOVZX" || l.op.substr(0, 3) == "SET";
+            if (isAX(l.x)) {
+                if (!writes) return false;
+                if (l.x == "AX" || l.x == "RAX") return true;   // AL/AH writes leave the rest of AX as it was
+            }
+        }
+        return false;
+    }
+
+    // JMP L / Jcc L right before L:
+    bool jumpToNext(size_t i, const Line &l) {
+        if (!isJump(l) || !fallsInto(i, l.x)) return false;
+        remove(i);
+        return true;
+    }
+
+    // Jcc L1 / JMP L2 / L1:  ->  J!cc L2 / L1:
+    bool jumpOverJump(size_t i, const Line &l) {
+        if (!isConditionalJump(l)) return false;
+        size_t j = next(i);
+        if (j >= code.size()) return false;
+        Line jump = at(j);
+        string inverse = invert(l.op);
+        if (jump.op != "JMP" || jump.label || inverse.empty() || !fallsInto(j, l.x)) return false;
+        code[i] = inverse + " " + string(jump.x);
+        remove(j);
+        return true;
+    }
+
+    // J* L ... L: JMP M  ->  J* M, following chains of such jumps. Jumps
+    // that go around in a circle are left alone.
+    bool jumpThreading(size_t i, const Line &l) {
+        if (!isJump(l)) return false;
+        string_view target = l.x;
+        vector<string_view> seen{target};
+        for (;;) {
+            size_t j = labelLine(target);
+            while (j < code.size() && (removed[j] || at(j).label)) j++;
+            if (j >= code.size() || at(j).op != "JMP") break;
+            string_view hop = at(j).x;
+            if (find(seen.begin(), seen.end(), hop) != seen.end()) return false;
+            seen.push_back(hop);
+            target = hop;
+        }
+        if (target == l.x) return false;
+        code[i] = string(l.op) + " " + string(target);
+        return true;
+    }
+
+    // MOV a, b / MOV b, a  ->  MOV a, b
+    bool reloadAfterStore(size_t i, const Line &l) {
+        size_t j = next(i);
+        if (l.op != "MOV" || j >= code.size()) return false;
+        Line reload = at(j);
+        if (reload.label || reload.op != "MOV" || reload.x != l.y || reload.y != l.x) return false;
+        remove(j);
+        return true;
+    }
+
+    bool selfMove(size_t i, const Line &l) {
+        if (l.op != "MOV" || l.x != l.y) return false;
+        remove(i);
+        return true;
+    }
+
+    // ADD x, 0 / SUB x, 0 / IMUL x, 1; nothing branches on their flags
+    bool identityArith(size_t i, const Line &l) {
+        if (!l.z.empty()) return false;     // IMUL r, rm, 1 is a copy
+        if (!(((l.op == "ADD" || l.op == "SUB") && l.y == "0") || (l.op == "IMUL" && l.y == "1"))) return false;
+        remove(i);
+        return true;
+    }
+
+    // SETcc AL / MOV v, AL / [MOV AL, v] / CMP AL|v, 1|0 / JE|JNE L
+    //   ->  SETcc AL / MOV v, AL / [MOV AL, v] / Jcc|J!cc L
+    // The flags of the comparison that fed SETcc are still intact, since MOV
+    // and MOVZX leave them alone.
+    bool branchOnSetcc(size_t i, const Line &l) {
+        if (l.label || l.op.substr(0, 3) != "SET" || l.x != "AL") return false;
+        string cc(l.op.substr(3));
+        size_t j = next(i);
+        string_view copy = "AL";
+        if (j < code.size()) {
+            Line store = at(j);
+            if ((store.op == "MOV" || store.op == "MOVZX") && store.y == "AL") {
+                copy = store.x;
+                j = next(j);
+                if (j < code.size() && at(j).op == "MOV" && at(j).x == "AL" && at(j).y == copy) j = next(j);
+            }
+        }
+        size_t k = next(j);
+        if (k >= code.size()) return false;
+        Line cmp = at(j), jump = at(k);
+        if (cmp.op != "CMP" || (cmp.x != "AL" && cmp.x != copy) || (cmp.y != "0" && cmp.y != "1")) return false;
+        if (jump.op != "JE" && jump.op != "JNE") return false;
+        bool whenSet = (jump.op == "JE") == (cmp.y == "1");
+        string jcc = "J" + cc;
+        if (!whenSet && invert(jcc).empty()) return false;
+        code[k] = (whenSet ? jcc : invert(jcc)) + " " + string(jump.x);
+        remove(j);
+        return true;
+    }
+
+    // MOV [tN], v where nothing reads [tN]
+    bool deadTempStore(size_t i, const Line &l) {
+        int n = l.op == "MOV" ? tempNumber(l.x) : -1;
+        if (n < 0 || (n < (int)tempReads.size() && tempReads[n] > 0)) return false;
+        remove(i);
+        return true;
+    }
+
+    // A write to AX, AL or SETcc AL whose value is never read
+    bool deadAX(size_t i, const Line &l) {
+        bool write = (l.op == "MOV" && isAX(l.x) && !isAX(l.y)) || (l.op.substr(0, 3) == "SET" && l.x == "AL");
+        if (l.label || !write || !axDeadFrom(next(i))) return false;
+        remove(i);
+        return true;
+    }
+
+    // Anything between JMP/RET and the next label
+    bool unreachableCode(size_t i, const Line &l) {
+        if (l.op != "JMP" && l.op != "RET") return false;
+        bool any = false;
+        for (size_t j = next(i); j < code.size() && !at(j).label; j = next(j)) {
+            remove(j);
+            any = true;
+        }
+        return any;
+    }
+
+    // Local labels no jump refers to; function labels are entry points.
+    bool unusedLabel(size_t i, const Line &l) {
+        int n = l.label ? labelNumber(l.op) : -1;
+        if (n < 0 || (n < (int)labelRefs.size() && labelRefs[n] > 0)) return false;
+        remove(i);
+        return true;
+    }
+};
+
+// Bump allocator for the AST. Nodes are carved out of large blocks and are all
+// released together when the arena goes away, so node types must be trivially
+// destructible (they only hold pointers and string_views into the source).
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+        for (char *block : blocks) delete[] block;
+    }
+
+    template <typename T>
+    T *make() {
+        static_assert(is_trivially_destructible<T>::value, "arena nodes are never destroyed");
+        void *memory = allocate(sizeof(T), alignof(T));
+        nodes++;
+        return new (memory) T();
+    }
+
+    size_t nodeCount() const { return nodes; }
+    size_t bytesUsed() const { return used; }
+
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    vector<char *> blocks;
+    char *cursor = nullptr;
+    size_t remaining = 0;
+    size_t nodes = 0;
+    size_t used = 0;
+
+    void *allocate(size_t size, size_t align) {
+        size_t padding = (align - (uintptr_t)cursor % align) % align;
+        if (!cursor || padding + size > remaining) {
+            blocks.push_back(new char[BLOCK_SIZE]);
+            cursor = blocks.back();
+            remaining = BLOCK_SIZE;
+            padding = 0;
+        }
+        void *result = cursor + padding;
+        cursor += padding + size;
+        remaining -= padding + size;
+        used += padding + size;
+        return result;
+    }
+};
+
+enum ExprKind : uint8_t {
+    E_NUM, E_VAR, E_BINARY,
+};
+
+struct Expr {
+    ExprKind kind;
+    TacOp op;               // E_BINARY
+    int symbol = -1;        // E_VAR, resolved by the parser
+    string_view text;       // E_NUM literal or E_VAR name
+    Expr *lhs = nullptr;
+    Expr *rhs = nullptr;
+};
+
+enum StmtKind : uint8_t {
+    S_DECL, S_ASSIGN, S_IF, S_WHILE, S_FOR, S_RETURN, S_BLOCK, S_CALL, S_PRINT, S_FUNC,
+};
+
+// Statements form singly linked lists through next.
+struct Stmt {
+    StmtKind kind;
+    uint32_t line = 0;
+    Stmt *next = nullptr;
+};
+
+struct DeclStmt : Stmt {
+    VarType type;
+    int symbol;
+};
+
+struct AssignStmt : Stmt {
+    int symbol;
+    Expr *value;
+};
+
+struct IfStmt : Stmt {
+    Expr *cond;
+    Stmt *thenBody;
+    Stmt *elseBody = nullptr;
+    bool hasElse = false;
+};
+
+struct WhileStmt : Stmt {
+    Expr *cond;
+    Stmt *body;
+};
+
+struct ForStmt : Stmt {
+    AssignStmt *init;
+    Expr *cond;
+    AssignStmt *step;
+    Stmt *body;
+};
+
+struct ReturnStmt : Stmt {
+    Expr *value = nullptr;
+};
+
+struct BlockStmt : Stmt {
+    Stmt *body = nullptr;
+};
+
+struct CallStmt : Stmt {
+    string_view name;
+};
+
+struct PrintStmt : Stmt {
+    bool isString;
+    int symbol = -1;        // Printed variable
+    string_view text;       // Raw string literal
+};
+
+struct FuncStmt : Stmt {
+    TokenType returnType;
+    string_view name;
+    Stmt *body = nullptr;
+};
+
+// Appends statement chains while keeping track of the tail.
+struct StmtList {
+    Stmt *head = nullptr;
+    Stmt *tail = nullptr;
+
+    void append(Stmt *chain) {
+        if (!chain) return;
+        if (tail) tail->next = chain;
+        else head = chain;
+        tail = chain;
+        while (tail->next) tail = tail->next;
+    }
+};
+
+class Parser {
+public:
+    // The parser pulls tokens from the stream on demand and borrows the source
+    // they point into; both must outlive it, as must the arena the AST lives in.
+    Parser(TokenStream &tokens, string_view src, SymbolTable &symTable, Arena &arena)
+        : tokens(tokens), src(src), symTable(symTable), arena(arena) {}
+
+    bool quiet = false;     // No success message, for benchmarks
+
+    Stmt *parseProgram() {
+        StmtList program;
+        while (tokens.peek().type != T_EOF) {
+            program.append(parseStatement());
+        }
+        if (!quiet) cout << "Parsing completed successfully! No Syntax Error" << endl;
+        return program.head;
+    }
+
+private:
+    struct BinaryOperator {
+        TokenType token;
+        TacOp op;
+        int precedence;     // Higher binds tighter
+    };
+
+    TokenStream &tokens;
+    string_view src;
+    SymbolTable &symTable;
+    Arena &arena;
+    vector<Expr *> operands;                    // Of parseExpression
+    vector<const BinaryOperator *> operators;   // Null for an open parenthesis
+
+    template <typename T>
+    T *node(StmtKind kind) {
+        T *stmt = arena.make<T>();
+        stmt->kind = kind;
+        stmt->line = tokens.peek().line;
+        return stmt;
+    }
+
+    Stmt *parseStatement() {
+        if (tokens.peek().type == T_VOID) {
+            return parseFunctionDeclaration();
+        } else if (tokens.peek().type == T_ID && tokens.peek(1).type == T_LPAREN) {
+            return parseFunctionCall();
+        }
+        else if (tokens.peek().type == T_INT || tokens.peek().type == T_FLOAT || tokens.peek().type == T_DOUBLE || 
+            tokens.peek().type == T_BOOL || tokens.peek().type == T_CHAR || tokens.peek().type == T_STRING) {
+            // Lookahead to check if it's a function or variable
+            if (tokens.peek(1).type == T_ID && tokens.peek(2).type == T_LPAREN) {
+                // Function declaration or definition
+                return parseFunctionDeclaration();
+            } else {
+                // Variable declaration
+                return parseDeclaration();
+            }
+        } else if (tokens.peek().type == T_ID) {
+            AssignStmt *assign = parseAssignment();
+            expect(T_SEMICOLON);
+            return assign;
+        } else if (tokens.peek().type == T_AGAR) {
+            return parseIfStatement();
+        } else if (tokens.peek().type == T_JABTAK) {
+            return parseWhileStatement();
+        } else if (tokens.peek().type == T_FOR) {
+            return parseForStatement();
+        } else if (tokens.peek().type == T_WAPSI) {
+            return parseReturnStatement();
+        } else if (tokens.peek().type == T_LBRACE) {
+            return parseBlock();
+        } else if (tokens.peek().type == T_COUT) {
+            return parseCoutStatement();
+        } else {
+            throw CompileError("Syntax error: unexpected token " + string(text(tokens.peek())) +
+                               " at line " + to_string(tokens.peek().line));
+        }
+    }
+
+    Stmt *parseFunctionDeclaration() {
+        if (!symTable.isGlobalScope()) {
+            throw CompileError("Syntax error: nested function declarations are not supported at line " +
+                               to_string(tokens.peek().line));
+        }
+        FuncStmt *func = node<FuncStmt>(S_FUNC);
+        func->returnType = tokens.peek().type; // Capture the return type
+        if (func->returnType != T_VOID && func->returnType != T_INT) {
+            throw CompileError("Unsupported return type for function");
+        }
+        tokens.advance(); // Move past the return type
+
+        func->name = expectAndReturnValue(T_ID); // Function name
+        expect(T_LPAREN); // Expect '('
+        expect(T_RPAREN); // Expect ')'
+
+        expect(T_LBRACE); // Expect '{'
+        symTable.enterScope();  // Locals are dropped again at the closing brace
+        StmtList body;
+        while (tokens.peek().type != T_RBRACE && tokens.peek().type != T_EOF) {
+            body.append(parseStatement()); // Parse statements inside the function
+        }
+        expect(T_RBRACE);
+        symTable.exitScope();
+        func->body = body.head;
+        return func;
+    }
+
+
+    Stmt *parseFunctionCall() {
+        CallStmt *call = node<CallStmt>(S_CALL);
+        call->name = expectAndReturnValue(T_ID);
+        expect(T_LPAREN);       // Expect '('
+        expect(T_RPAREN);       // Expect ')'
+        expect(T_SEMICOLON);    // Expect ';'
+        return call;
+    }
+
+
+
+    // Each operand of cout becomes its own print statement.
+    Stmt *parseCoutStatement() {
+        expect(T_COUT); // Expect the 'cout' token
+
+        StmtList prints;
+        while (tokens.peek().type == T_LSHIFT) {
+            expect(T_LSHIFT); // Expect the '<<' operator
+
+            PrintStmt *print = node<PrintStmt>(S_PRINT);
+            if (tokens.peek().type == T_STRING_LITERAL) { // String literal
+                print->isString = true;
+                print->text = text(tokens.next());
+            } else if (tokens.peek().type == T_ID) { // Variable name
+                print->isString = false;
+                print->symbol = symTable.resolve(text(tokens.next())); // Check if variable is declared
+            } else {
+                throw CompileError("Syntax error: Expected string literal or variable name after '<<'");
+            }
+            prints.append(print);
+        }
+
+        expect(T_SEMICOLON); // Expect the semicolon at the end of the statement
+        return prints.head;
+    }
+
+    Stmt *parseDeclaration() {
+        DeclStmt *decl = node<DeclStmt>(S_DECL);
+        TokenType varType = tokens.peek().type; 
+        expect(varType);
+        string_view varName = expectAndReturnValue(T_ID);
+        switch (varType) {
+            case T_INT:
+                decl->type = TYPE_INT;
+                break;
+            case T_FLOAT:
+                decl->type = TYPE_FLOAT;
+                break;
+            case T_DOUBLE:
+                decl->type = TYPE_DOUBLE;
+                break;
+            case T_BOOL:
+                decl->type = TYPE_BOOL;
+                break;
+            case T_CHAR:
+                decl->type = TYPE_CHAR;
+                break;
+            case T_STRING:
+                decl->type = TYPE_STRING;
+                break;
+            default:
+                throw CompileError("Unsupported type in declaration");
+        }
+        decl->symbol = symTable.declareVariable(varName, decl->type);
+        expect(T_SEMICOLON);
+        return decl;
+    }
+
+
+    // Parses `name = expr` without the terminating ';' (shared with for headers).
+    AssignStmt *parseAssignment() {
+        AssignStmt *assign = node<AssignStmt>(S_ASSIGN);
+        assign->symbol = symTable.resolve(expectAndReturnValue(T_ID));
+        expect(T_ASSIGN);
+        assign->value = parseExpression();
+        return assign;
+    }
+    Stmt *parseBlock() {
+        BlockStmt *block = node<BlockStmt>(S_BLOCK);
+        expect(T_LBRACE);
+        symTable.enterScope();
+        StmtList body;
+        while (tokens.peek().type != T_RBRACE && tokens.peek().type != T_EOF) {
+            body.append(parseStatement());
+        }
+        expect(T_RBRACE);
+        symTable.exitScope();
+        block->body = body.head;
+        return block;
+    }
+
+    Stmt *parseBody() {
+        if (tokens.peek().type == T_LBRACE) {
+            return parseBlock();
+        }
+        return parseStatement();
+    }
+
+    Stmt *parseIfStatement() {
+        IfStmt *ifStmt = node<IfStmt>(S_IF);
+        expect(T_AGAR);    
+        expect(T_LPAREN); 
+        ifStmt->cond = parseExpression();
+        expect(T_RPAREN);
+
+        ifStmt->thenBody = parseBody();   // True block
+        if (tokens.peek().type == T_WARNA) { // Else block
+            expect(T_WARNA);
+            ifStmt->hasElse = true;
+            ifStmt->elseBody = parseBody();
+        }
+        return ifStmt;
+    }
+
+
+    Stmt *parseWhileStatement() {
+        WhileStmt *loop = node<WhileStmt>(S_WHILE);
+        expect(T_JABTAK);
+        expect(T_LPAREN);
+        loop->cond = parseExpression();
+        expect(T_RPAREN);
+        loop->body = parseBody();
+        return loop;
+    }
+
+
+    Stmt *parseForStatement() {
+        ForStmt *loop = node<ForStmt>(S_FOR);
+        expect(T_FOR);               
+        expect(T_LPAREN);            
+
+        loop->init = parseAssignment();          // Handles the initialization (e.g., `i = 0;`)
+        expect(T_SEMICOLON);
+        loop->cond = parseExpression();          // Handles condition (e.g., `i < 10`)
+        expect(T_SEMICOLON);
+        loop->step = parseAssignment();          // Handles increment (e.g., `i = i + 1`)
+        expect(T_RPAREN);
+
+        loop->body = parseBody();                // Parse block if `{}` is used, else a single statement
+        return loop;
+    }
+
+
+    Stmt *parseReturnStatement() {
+        ReturnStmt *ret = node<ReturnStmt>(S_RETURN);
+        expect(T_WAPSI); // 'wapsi' is the return keyword in your syntax
+        if (tokens.peek().type != T_SEMICOLON) {
+            ret->value = parseExpression(); // Parse return expression
+        }
+        expect(T_SEMICOLON); // Expect ';'
+        return ret;
+    }
+
+    Expr *binary(TacOp op, Expr *lhs, Expr *rhs) {
+        Expr *expr = arena.make<Expr>();
+        expr->kind = E_BINARY;
+        expr->op = op;
+        expr->lhs = lhs;
+        expr->rhs = rhs;
+        return expr;
+    }
+
+    // Binary operators from the loosest to the tightest binding; all are
+    // left associative, as in C.
+    static const BinaryOperator *binaryOperator(TokenType type) {
+        static const BinaryOperator table[] = {
+            {T_OR, TAC_OR, 1},
+            {T_AND, TAC_AND, 2},
+            {T_EQ, TAC_EQ, 3}, {T_NEQ, TAC_NEQ, 3},
+            {T_LT, TAC_LT, 4}, {T_LE, TAC_LE, 4}, {T_GT, TAC_GT, 4}, {T_GE, TAC_GE, 4},
+            {T_PLUS, TAC_ADD, 5}, {T_MINUS, TAC_SUB, 5},
+            {T_MUL, TAC_MUL, 6}, {T_DIV, TAC_DIV, 6},
+        };
+        for (const BinaryOperator &entry : table) {
+            if (entry.token == type) return &entry;
+        }
+        return nullptr;
+    }
+
+    // Operator precedence parsing with explicit operand and operator stacks
+    // instead of one native call per nesting level, so neither long operator
+    // chains nor deep parentheses can run out of stack. An operator is
+    // pushed once everything on the stack that binds at least as tightly
+    // has been reduced to a node; an open parenthesis is a null entry that
+    // stops the reductions until its ')' pops it. The expression ends at
+    // the first token that neither continues it nor closes one of its own
+    // parentheses.
+    Expr *parseExpression() {
+        size_t operandBase = operands.size(), operatorBase = operators.size();
+        for (;;) {
+            while (tokens.peek().type == T_LPAREN) {
+                tokens.advance();
+                operators.push_back(nullptr);
+            }
+            operands.push_back(parseOperand());
+            const BinaryOperator *next;
+            for (;;) {
+                next = binaryOperator(tokens.peek().type);
+                int precedence = next ? next->precedence : 0;
+                while (operators.size() > operatorBase && operators.back() && operators.back()->precedence >= precedence) {
+                    reduce();
+                }
+                if (next || operators.size() == operatorBase) break;
+                expect(T_RPAREN);
+                operators.pop_back();
+            }
+            if (!next) break;
+            tokens.advance();
+            operators.push_back(next);
+        }
+        Expr *expr = operands.back();
+        operands.resize(operandBase);
+        return expr;
+    }
+
+    void reduce() {
+        Expr *rhs = operands.back();
+        operands.pop_back();
+        operands.back() = binary(operators.back()->op, operands.back(), rhs);
+        operators.pop_back();
+    }
+
+    Expr *parseOperand() {
+        if (tokens.peek().type == T_NUM || tokens.peek().type == T_TRUE || tokens.peek().type == T_FALSE) {
+            Expr *leaf = arena.make<Expr>();
+            leaf->kind = E_NUM;
+            Token token = tokens.next();
+            leaf->text = token.type == T_TRUE ? "1" : token.type == T_FALSE ? "0" : text(token);
+            return leaf;
+        } else if (tokens.peek().type == T_ID) {
+            Expr *leaf = arena.make<Expr>();
+            leaf->kind = E_VAR;
+            leaf->text = text(tokens.peek());
+            leaf->symbol = symTable.resolve(text(tokens.next()));
+            return leaf;
+        } else {
+            throw CompileError("Syntax error: unexpected token '" + string(text(tokens.peek())) + "' at line " +
+                               to_string(tokens.peek().line));
+        }
+    }
+
+    void expect(TokenType type) {
+        if (tokens.peek().type == type) {
+            tokens.advance();
+        } else {
+            throw CompileError("Syntax error: expected " + tokenTypeToString(type) + " but found " +
+                               tokenTypeToString(tokens.peek().type) + " at line " + to_string(tokens.peek().line));
+        }
+    }
+    string tokenTypeToString(TokenType type) {
+        switch (type) {
+            case T_FLOAT: return "float";
+            case T_DOUBLE: return "double";
+            case T_BOOL: return "bool";
+            case T_CHAR: return "char";
+            case T_STRING: return "string";
+            case T_JABTAK: return "jabtak";
+            case T_FOR: return "for";
+            case T_INT: return "int";
+            case T_ID: return "T_ID";
+            case T_NUM: return "number";
+            case T_AGAR: return "agar";
+            case T_WARNA: return "warna";
+            case T_WAPSI: return "wapsi";
+            case T_ASSIGN: return "=";
+            case T_PLUS: return "+";
+            case T_MINUS: return "-";
+            case T_MUL: return "*";
+            case T_DIV: return "/";
+            case T_LPAREN: return "(";
+            case T_RPAREN: return ")";
+            case T_LBRACE: return "{";
+            case T_RBRACE: return "}";
+            case T_SEMICOLON: return ";";
+            case T_LT: return "<";
+            case T_LE: return "<=";
+            case T_GT: return ">";
+            case T_GE: return ">=";
+            case T_EQ: return "==";
+            case T_NEQ: return "!=";
+            case T_AND: return "&&";
+            case T_OR: return "||";
+            case T_EOF: return "End of File";
+            case T_COUT: return "cout";
+            case T_LSHIFT: return "<<";
+            case T_STRING_LITERAL: return "T_STRING_LITERAL";
+            case T_VOID: return "T_VOID";
+            case T_TRUE: return "true";
+            case T_FALSE: return "false";
+            default: return "UNKNOWN_TOKEN";
+        }
+    }
+
+
+    string_view expectAndReturnValue(TokenType type) {
+        string_view value = text(tokens.peek());
+        expect(type);
+        return value;
+    }
+
+    string_view text(const Token &token) const {
+        return src.substr(token.offset, token.length);
+    }
+};
+
+// Lowers the AST to TAC. Top-level statements come first and every function
+// follows in source order, so straight-line code never falls into a function
+// body.
+class Lowering {
+public:
+    Lowering(IntermediateCodeGnerator &icg, const SymbolTable &symTable) : icg(icg), symTable(symTable) {}
+
+    void lowerProgram(Stmt *program) {
+        lowerStatements(program);
+        for (size_t i = 0; i < pendingFunctions.size(); i++) {
+            lowerFunction(pendingFunctions[i]);
+        }
+    }
+
+private:
+    IntermediateCodeGnerator &icg;
+    const SymbolTable &symTable;
+    vector<FuncStmt *> pendingFunctions;
+    vector<Operand> symbolOperands;     // Symbol id -> OP_VAR operand, filled lazily
+
+    struct Branch {
+        Expr *cond;             // Null to place the label target
+        Operand target;
+        bool whenTrue;
+    };
+    vector<Branch> branches;                // Of lowerCondition
+    vector<pair<Expr *, bool>> pending;     // Of lowerExpression, with whether the operands were pushed
+    vector<Operand> values;                 // Lowered operands waiting for their node
+    vector<bool> floatingTemps;             // Per temp, whether it may hold a double
+
+    // Whether o may be a float or double, and so NaN.
+    bool mayBeFloating(const Operand &o) const {
+        if (o.kind == OP_VAR) return icg.varType(o) == TYPE_FLOAT || icg.varType(o) == TYPE_DOUBLE;
+        if (o.kind == OP_IMM) return icg.literals[o.id].find_first_of(".eE") != string::npos;
+        return o.kind == OP_TEMP && o.id < (int)floatingTemps.size() && floatingTemps[o.id];
+    }
+
+    Operand var(int symbol) {
+        if (symbol >= (int)symbolOperands.size()) symbolOperands.resize(symTable.symbolCount());
+        if (symbolOperands[symbol].kind == OP_NONE) {
+            const SymbolTable::Symbol &info = symTable.symbol(symbol);
+            symbolOperands[symbol] = icg.var(info.storageName, info.type, info.depth == 1);
+        }
+        return symbolOperands[symbol];
+    }
+
+    void lowerStatements(Stmt *list) {
+        for (Stmt *stmt = list; stmt; stmt = stmt->next) {
+            lowerStatement(stmt);
+        }
+    }
+
+    void lowerFunction(FuncStmt *func) {
+        icg.addInstruction(TAC_FUNC, Operand(), icg.func(string(func->name) + "_func")); // Add function label in TAC
+        lowerStatements(func->body);
+        icg.addInstruction(TAC_RET);    // Default return, also for int functions
+    }
+
+    void lowerStatement(Stmt *stmt) {
+        switch (stmt->kind) {
+            case S_DECL:
+                break;      // Declarations only matter to the symbol table
+            case S_ASSIGN: {
+                AssignStmt *assign = static_cast<AssignStmt *>(stmt);
+                Operand value = lowerExpression(assign->value);
+                icg.addInstruction(TAC_ASSIGN, var(assign->symbol), value);
+                break;
+            }
+            case S_IF:
+                lowerIf(static_cast<IfStmt *>(stmt));
+                break;
+            case S_WHILE:
+                lowerWhile(static_cast<WhileStmt *>(stmt));
+                break;
+            case S_FOR:
+                lowerFor(static_cast<ForStmt *>(stmt));
+                break;
+            case S_RETURN: {
+                ReturnStmt *ret = static_cast<ReturnStmt *>(stmt);
+                if (ret->value) {
+                    icg.addInstruction(TAC_WAPSI, Operand(), lowerExpression(ret->value));
+                } else {
+                    icg.addInstruction(TAC_WAPSI);
+                }
+                break;
+            }
+            case S_BLOCK:
+                lowerStatements(static_cast<BlockStmt *>(stmt)->body);
+                break;
+            case S_CALL:
+                icg.addInstruction(TAC_CALL, Operand(), icg.func(string(static_cast<CallStmt *>(stmt)->name) + "_func"));
+                break;
+            case S_PRINT: {
+                PrintStmt *print = static_cast<PrintStmt *>(stmt);
+                Operand value = print->isString ? icg.str(unescapeStringLiteral(print->text)) : var(print->symbol);
+                icg.addInstruction(TAC_PRINT, Operand(), value);
+                break;
+            }
+            case S_FUNC:
+                pendingFunctions.push_back(static_cast<FuncStmt *>(stmt));
+                break;
+        }
+    }
+
+    void lowerIf(IfStmt *ifStmt) {
+        Operand falseLabel = icg.newLabel(); // Generate new label for the false block
+
+        lowerCondition(ifStmt->cond, falseLabel, false);   // Falls through into the true block
+        lowerStatement(ifStmt->thenBody);
+
+        if (ifStmt->hasElse) { // Else block
+            Operand endLabel = icg.newLabel();   // Generate label for the end of the if-else
+            icg.addInstruction(TAC_GOTO, Operand(), endLabel);
+            icg.addInstruction(TAC_LABEL, Operand(), falseLabel);
+            lowerStatement(ifStmt->elseBody);
+            icg.addInstruction(TAC_LABEL, Operand(), endLabel);
+        } else {
+            icg.addInstruction(TAC_LABEL, Operand(), falseLabel);
+        }
+    }
+
+    // Loops are rotated: a copy of the condition guards the entry and the one
+    // at the bottom jumps back, so an iteration costs a single branch.
+    void lowerWhile(WhileStmt *loop) {
+        Operand bodyLabel = icg.newLabel();    // Label for the loop body
+        Operand endLabel = icg.newLabel();     // Label for exiting the loop
+
+        lowerCondition(loop->cond, endLabel, false);
+        icg.addInstruction(TAC_LABEL, Operand(), bodyLabel);
+        lowerStatement(loop->body);
+        lowerCondition(loop->cond, bodyLabel, true);   // Re-evaluated on every iteration
+        icg.addInstruction(TAC_LABEL, Operand(), endLabel);
+    }
+
+    void lowerFor(ForStmt *loop) {
+        lowerStatement(loop->init);        // Initialization (e.g., `i = 0;`)
+
+        Operand bodyLabel = icg.newLabel();      // Label for the loop body
+        Operand endLabel = icg.newLabel();       // Label for loop exit
+
+        lowerCondition(loop->cond, endLabel, false);
+        icg.addInstruction(TAC_LABEL, Operand(), bodyLabel);
+        lowerStatement(loop->body);
+        lowerStatement(loop->step);         // Increment/Update step right after the body
+        lowerCondition(loop->cond, bodyLabel, true);
+        icg.addInstruction(TAC_LABEL, Operand(), endLabel);
+    }
+
+    // Jumps to target when cond is true (whenTrue) or false and falls through
+    // otherwise. A relation becomes one compare-and-branch instead of a 0/1
+    // temp that is tested again, and && / || skip their right side once the
+    // left one decides. The pending branches are kept on an explicit stack,
+    // since && and || chains can be as long as the source.
+    void lowerCondition(Expr *cond, Operand target, bool whenTrue) {
+        size_t base = branches.size();
+        branches.push_back(Branch{cond, target, whenTrue});
+        while (branches.size() > base) {
+            Branch branch = branches.back();
+            branches.pop_back();
+            cond = branch.cond;
+            if (!cond) {
+                icg.addInstruction(TAC_LABEL, Operand(), branch.target);
+                continue;
+            }
+            if (cond->kind == E_BINARY && (cond->op == TAC_AND || cond->op == TAC_OR)) {
+                // Pushed in reverse: the left side, the right side, then the skip label
+                bool decidedBy = cond->op == TAC_OR;    // Left value that settles the result
+                if (branch.whenTrue == decidedBy) {
+                    branches.push_back(Branch{cond->rhs, branch.target, branch.whenTrue});
+                    branches.push_back(Branch{cond->lhs, branch.target, branch.whenTrue});
+                } else {
+                    Operand skip = icg.newLabel();
+                    branches.push_back(Branch{nullptr, skip, false});
+                    branches.push_back(Branch{cond->rhs, branch.target, branch.whenTrue});
+                    branches.push_back(Branch{cond->lhs, skip, decidedBy});
+                }
+                continue;
+            }
+            if (cond->kind == E_BINARY && isRelation(cond->op)) {
+                Operand lhs = lowerExpression(cond->lhs);
+                Operand rhs = lowerExpression(cond->rhs);
+                bool ordered = cond->op != TAC_EQ && cond->op != TAC_NEQ;
+                if (branch.whenTrue) {
+                    icg.addInstruction(branchOn(cond->op), branch.target, lhs, rhs);
+                } else if (ordered && (mayBeFloating(lhs) || mayBeFloating(rhs))) {
+                    // Branching on the inverse would be taken for NaN, so go around a goto
+                    Operand skip = icg.newLabel();
+                    icg.addInstruction(branchOn(cond->op), skip, lhs, rhs);
+                    icg.addInstruction(TAC_GOTO, Operand(), branch.target);
+                    icg.addInstruction(TAC_LABEL, Operand(), skip);
+                } else {
+                    icg.addInstruction(branchOn(invertRelation(cond->op)), branch.target, lhs, rhs);
+                }
+                continue;
+            }
+            Operand value = lowerExpression(cond);
+            icg.addInstruction(branchOn(branch.whenTrue ? TAC_NEQ : TAC_EQ), branch.target, value, icg.imm("0"));
+        }
+    }
+
+    // Left operand, right operand, then the node, walked with an explicit
+    // stack for the same reason.
+    Operand lowerExpression(Expr *expr) {
+        size_t base = pending.size();
+        pending.push_back(make_pair(expr, false));
+        while (pending.size() > base) {
+            Expr *e = pending.back().first;
+            switch (e->kind) {
+                case E_NUM:
+                    values.push_back(icg.imm(string(e->text)));
+                    break;
+                case E_VAR:
+                    values.push_back(var(e->symbol));
+                    break;
+                default: {
+                    if (!pending.back().second) {
+                        pending.back().second = true;   // Operands first
+                        pending.push_back(make_pair(e->rhs, false));
+                        pending.push_back(make_pair(e->lhs, false));
+                        continue;
+                    }
+                    Operand rhs = values.back();
+                    values.pop_back();
+                    Operand temp = icg.newTemp();
+                    if (!isRelation(e->op) && e->op != TAC_AND && e->op != TAC_OR &&
+                        (mayBeFloating(values.back()) || mayBeFloating(rhs))) {
+                        if (temp.id >= (int)floatingTemps.size()) floatingTemps.resize(temp.id + 1, false);
+                        floatingTemps[temp.id] = true;
+                    }
+                    icg.addInstruction(e->op, temp, values.back(), rhs);
+                    values.back() = temp;
+                    break;
+                }
+            }
+            pending.pop_back();
+        }
+        Operand result = values.back();
+        values.pop_back();
+        return result;
+    }
+};
+
+// Value of a numeric literal or of a folded expression. Arithmetic follows C:
+// an operation is done in double when either side is floating, else in int64.
+struct ConstValue {
+    bool isDouble = false;
+    int64_t i = 0;
+    double d = 0;
+
+    static ConstValue ofInt(int64_t value) { ConstValue c; c.i = value; return c; }
+    static ConstValue ofDouble(double value) { ConstValue c; c.isDouble = true; c.d = value; return c; }
+
+    static ConstValue parse(const string &literal) {
+        if (literal.find_first_of(".eE") != string::npos) return ofDouble(strtod(literal.c_str(), nullptr));
+        return ofInt(strtoll(literal.c_str(), nullptr, 10));
+    }
+
+    double asDouble() const { return isDouble ? d : (double)i; }
+    bool truthy() const { return isDouble ? d != 0 : i != 0; }
+
+    // Value after being stored in a variable of the given type.
+    ConstValue convertTo(VarType type) const {
+        switch (type) {
+            case TYPE_FLOAT:
+            case TYPE_DOUBLE: return ofDouble(asDouble());
+            case TYPE_BOOL: return ofInt(truthy() ? 1 : 0);
+            default: return isDouble ? ofInt((int64_t)d) : *this;
+        }
+    }
+
+    // Shortest fixed-point literal that reads back to the same value, so it
+    // looks like something the lexer accepts; doubles always keep a '.'.
+    string toLiteral() const {
+        if (!isDouble) return to_string(i);
+        char buffer[400];
+        for (int precision = 1; precision <= 17; precision++) {
+            snprintf(buffer, sizeof(buffer), "%.*f", precision, d);
+            if (strtod(buffer, nullptr) == d) return buffer;
+        }
+        snprintf(buffer, sizeof(buffer), "%.17g", d);
+        string text = buffer;
+        if (text.find_first_of(".e") == string::npos) text += ".0";
+        return text;
+    }
+};
+
+// Evaluates a binary TAC operator. Fails (returns false) where the result is
+// not a plain number: division by zero, int64 overflow on division, inf/nan
+// literals.
+bool foldBinary(TacOp op, const ConstValue &a, const ConstValue &b, ConstValue &result) {
+    bool useDouble = a.isDouble || b.isDouble;
+    switch (op) {
+        case TAC_AND: result = ConstValue::ofInt(a.truthy() && b.truthy()); return true;
+        case TAC_OR: result = ConstValue::ofInt(a.truthy() || b.truthy()); return true;
+        default: break;
+    }
+    if (useDouble) {
+        double x = a.asDouble(), y = b.asDouble();
+        switch (op) {
+            case TAC_ADD: result = ConstValue::ofDouble(x + y); break;
+            case TAC_SUB: result = ConstValue::ofDouble(x - y); break;
+            case TAC_MUL: result = ConstValue::ofDouble(x * y); break;
+            case TAC_DIV:
+                if (y == 0) return false;
+                result = ConstValue::ofDouble(x / y);
+                break;
+            case TAC_LT: result = ConstValue::ofInt(x < y); break;
+            case TAC_LE: result = ConstValue::ofInt(x <= y); break;
+            case TAC_GT: result = ConstValue::ofInt(x > y); break;
+            case TAC_GE: result = ConstValue::ofInt(x >= y); break;
+            case TAC_EQ: result = ConstValue::ofInt(x == y); break;
+            case TAC_NEQ: result = ConstValue::ofInt(x != y); break;
+            default: return false;
+        }
+        return !result.isDouble || isfinite(result.d);
+    }
+    // Wrap around like the target instead of invoking signed overflow
+    uint64_t x = (uint64_t)a.i, y = (uint64_t)b.i;
+    switch (op) {
+        case TAC_ADD: result = ConstValue::ofInt((int64_t)(x + y)); break;
+        case TAC_SUB: result = ConstValue::ofInt((int64_t)(x - y)); break;
+        case TAC_MUL: result = ConstValue::ofInt((int64_t)(x * y)); break;
+        case TAC_DIV:
+            if (b.i == 0 || (a.i == INT64_MIN && b.i == -1)) return false;
+            result = ConstValue::ofInt(a.i / b.i);
+            break;
+        case TAC_LT: result = ConstValue::ofInt(a.i < b.i); break;
+        case TAC_LE: result = ConstValue::ofInt(a.i <= b.i); break;
+        case TAC_GT: result = ConstValue::ofInt(a.i > b.i); break;
+        case TAC_GE: result = ConstValue::ofInt(a.i >= b.i); break;
+        case TAC_EQ: result = ConstValue::ofInt(a.i == b.i); break;
+        case TAC_NEQ: result = ConstValue::ofInt(a.i != b.i); break;
+        default: return false;
+    }
+    return true;
+}
+
+bool isBinaryOp(TacOp op) {
+    return op >= TAC_ADD && op <= TAC_OR;
+}
+
+// Global value numbering over SSA form, one function at a time.
+//
+// Each definition of a temp or local first gets a version of its own (a fresh
+// temp), with phis at the iterated dominance frontier of the definitions
+// wherever the value is live. One walk down the dominator tree renames the
+// uses and numbers the values: an operation with the same operator and
+// operand values as one in a dominating block, a plain copy, and a phi whose
+// inputs are all one value are dropped, and their uses read that value
+// instead. Out of SSA, phis become copies on the incoming edges (a critical
+// edge gets a block of its own) and the versions of each variable merge back
+// into it unless two of them are live at once. Globals are left alone since
+// any call may change them, and so are shared locals (see markSharedLocals),
+// whose value a later call of the function reads or a recursive call changes.
+class ValueNumbering {
+public:
+    explicit ValueNumbering(IntermediateCodeGnerator &icg) : icg(icg), values(icg), outValues(icg) {}
+
+    // Appends the rewritten quads [begin, end) of one function to out and
+    // returns how many computations and copies were dropped.
+    int run(size_t begin, size_t end, vector<Quad> &out) {
+        const vector<Quad> &code = icg.instructions;
+        // Split blocks go after the last one, so it must not fall through.
+        // Only the top-level code can, and it works on globals anyway.
+        if (ControlFlowGraph::fallsThrough(code[end - 1])) {
+            out.insert(out.end(), code.begin() + begin, code.begin() + end);
+            return 0;
+        }
+        ControlFlowGraph cfg(code, begin, end);
+        values.clear();
+        Liveness liveness(code, cfg, values);
+        DominatorTree dom(cfg);
+        placePhis(cfg, dom, liveness);
+        int dropped = renameAndNumber(cfg, dom);
+        removeDeadPhis();
+
+        vector<Quad> function;
+        leaveSsa(cfg, dom, function);
+        hoistEdgeCopies(function);
+        coalesce(function);
+        for (const Quad &q : function) {
+            if (q.op != TAC_ASSIGN || q.dst != q.a) out.push_back(q);
+        }
+        return dropped;
+    }
+
+private:
+    // What a value is known to hold, which decides whether storing it in a
+    // variable is a plain copy or a conversion.
+    enum ValueKind : uint8_t { KIND_INT, KIND_BOOL, KIND_DOUBLE };
+
+    struct Phi {
+        int value;                  // ValueIndex id of the variable or temp
+        Operand dst;
+        vector<Operand> args;       // Per predecessor; OP_NONE until that edge is renamed
+        bool removed = false;
+    };
+
+    // Operator and operand values of a computation; type is 1 + the VarType
+    // of a converting store, else 0.
+    struct ExprKey {
+        TacOp op;
+        uint8_t type;
+        Operand a, b;
+        bool operator==(const ExprKey &o) const { return op == o.op && type == o.type && a == o.a && b == o.b; }
+    };
+    struct ExprHash {
+        size_t operator()(const ExprKey &k) const {
+            size_t h = k.op * 31 + k.type;
+            for (const Operand &o : {k.a, k.b}) h = h * 1000003 ^ (size_t(o.kind) << 32 | unsigned(o.id));
+            return h;
+        }
+    };
+
+    IntermediateCodeGnerator &icg;
+    ValueIndex values, outValues;   // Numbering of the function before and after
+    vector<vector<Phi>> phis;       // Per block
+    int firstVersion = 0;           // Temps [firstVersion, + versionOrigin.size()) are versions
+    vector<int> versionOrigin;      // Per version, ValueIndex id of what it is a version of
+    vector<Operand> versionRep;     // Per version, the value its uses read (itself unless dropped)
+    vector<ValueKind> versionKind;
+    vector<vector<Quad>> blockCode; // Per block, renamed quads
+
+    // Block of copies on a branch's taken edge, appended after the function
+    struct SplitEdge {
+        size_t branch;              // Index of the branch
+        size_t begin, end;          // Label, copies and goto back
+        Operand target;             // Where the branch went before the split
+    };
+    vector<SplitEdge> splitEdges;
+
+    // Temps and the locals private to one call of the function
+    bool tracked(int value) const { return value >= 0 && !values.isGlobal(value); }
+    bool isGlobalVar(const Operand &o) const { return o.kind == OP_VAR && icg.isGlobal(o); }
+    bool isVersion(const Operand &o) const {
+        return o.kind == OP_TEMP && o.id >= firstVersion && o.id - firstVersion < (int)versionOrigin.size();
+    }
+    Operand rep(const Operand &o) const { return isVersion(o) ? versionRep[o.id - firstVersion] : o; }
+
+    static ValueKind kindOfType(VarType type) {
+        if (type == TYPE_FLOAT || type == TYPE_DOUBLE) return KIND_DOUBLE;
+        return type == TYPE_BOOL ? KIND_BOOL : KIND_INT;
+    }
+    ValueKind kindOf(const Operand &o) const {
+        if (isVersion(o)) return versionKind[o.id - firstVersion];
+        if (o.kind == OP_IMM) return ConstValue::parse(icg.literals[o.id]).isDouble ? KIND_DOUBLE : KIND_INT;
+        if (o.kind == OP_VAR) return kindOfType(icg.varType(o));
+        return KIND_INT;
+    }
+
+    Operand newVersion(int value, ValueKind kind) {
+        Operand version = icg.newTemp();
+        versionOrigin.push_back(value);
+        versionRep.push_back(version);
+        versionKind.push_back(kind);
+        return version;
+    }
+
+    void placePhis(const ControlFlowGraph &cfg, const DominatorTree &dom, const Liveness &liveness) {
+        const vector<Quad> &code = icg.instructions;
+        size_t blockCount = cfg.blocks.size();
+        vector<vector<int>> defBlocks(values.size());
+        for (size_t b = 0; b < blockCount; b++) {
+            if (!dom.reachable((int)b)) continue;
+            for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+                int d = values.find(code[i].dst);
+                if (tracked(d) && (defBlocks[d].empty() || defBlocks[d].back() != (int)b)) defBlocks[d].push_back((int)b);
+            }
+        }
+        phis.assign(blockCount, vector<Phi>());
+        vector<vector<int>> frontiers = dom.frontiers();
+        vector<int> placed(blockCount, -1), queued(blockCount, -1);
+        for (size_t v = 0; v < values.size(); v++) {
+            vector<int> &work = defBlocks[v];
+            for (int b : work) queued[b] = (int)v;
+            while (!work.empty()) {
+                int b = work.back();
+                work.pop_back();
+                for (int f : frontiers[b]) {
+                    if (placed[f] == (int)v || !liveness.liveAtStart(f, (int)v)) continue;
+                    placed[f] = (int)v;
+                    phis[f].push_back(Phi{(int)v, Operand(), vector<Operand>(cfg.blocks[f].preds.size()), false});
+                    if (queued[f] != (int)v) {
+                        queued[f] = (int)v;
+                        work.push_back(f);
+                    }
+                }
+            }
+        }
+    }
+
+    // Walks the dominator tree with children in reverse postorder, so every
+    // predecessor of a block but those on back edges is done before it.
+    int renameAndNumber(const ControlFlowGraph &cfg, const DominatorTree &dom) {
+        const vector<Quad> &code = icg.instructions;
+        firstVersion = icg.tempCount;
+        versionOrigin.clear();
+        versionRep.clear();
+        versionKind.clear();
+        blockCode.assign(cfg.blocks.size(), vector<Quad>());
+        vector<Operand> current(values.size());     // Version each value has at this point
+        for (size_t v = 0; v < values.size(); v++) current[v] = values.operand((int)v);
+        vector<pair<int, Operand>> renamed;         // Undo log of current
+        unordered_map<ExprKey, Operand, ExprHash> available;
+        vector<ExprKey> inserted;                   // Undo log of available
+        int dropped = 0;
+
+        auto define = [&](int value, Operand version) {
+            renamed.push_back(make_pair(value, current[value]));
+            current[value] = version;
+        };
+        auto visit = [&](int b) {
+            const ControlFlowGraph::Block &block = cfg.blocks[b];
+            for (Phi &phi : phis[b]) {
+                const Operand &original = values.operand(phi.value);
+                phi.dst = newVersion(phi.value, original.kind == OP_VAR ? kindOfType(icg.varType(original)) : KIND_INT);
+                Operand same;
+                bool uniform = true;
+                for (size_t k = 0; k < block.preds.size() && uniform; k++) {
+                    if (!dom.reachable(block.preds[k])) continue;
+                    const Operand &arg = phi.args[k];
+                    uniform = arg.kind != OP_NONE && (same.kind == OP_NONE || arg == same);
+                    same = arg;
+                }
+                if (uniform && same.kind != OP_NONE) {
+                    versionRep[phi.dst.id - firstVersion] = same;
+                    phi.removed = true;
+                }
+                define(phi.value, phi.dst);
+            }
+            for (size_t i = block.begin; i < block.end; i++) {
+                Quad q = code[i];
+                for (Operand *o : {&q.a, &q.b}) {
+                    int v = values.find(*o);
+                    if (tracked(v)) *o = rep(current[v]);
+                }
+                int d = values.find(q.dst);
+                if (!tracked(d)) {
+                    blockCode[b].push_back(q);
+                    continue;
+                }
+                ExprKey key{q.op, 0, q.a, q.b};
+                bool hashable = !isGlobalVar(q.a) && !isGlobalVar(q.b);
+                bool copy = false;
+                ValueKind kind = KIND_INT;
+                if (q.op == TAC_ASSIGN) {
+                    ValueKind from = kindOf(q.a), to = kindOfType(icg.varType(q.dst));
+                    copy = q.dst.kind == OP_TEMP || from == to || (from == KIND_BOOL && to == KIND_INT);
+                    kind = copy ? from : to;
+                    key.type = uint8_t(icg.varType(q.dst) + 1);
+                } else if (isRelation(q.op) || q.op == TAC_AND || q.op == TAC_OR) {
+                    kind = KIND_BOOL;
+                } else if (kindOf(q.a) == KIND_DOUBLE || kindOf(q.b) == KIND_DOUBLE) {
+                    kind = KIND_DOUBLE;
+                }
+                bool commutative = q.op == TAC_ADD || q.op == TAC_MUL || q.op == TAC_EQ || q.op == TAC_NEQ ||
+                                   q.op == TAC_AND || q.op == TAC_OR;
+                if (commutative && (key.b.kind < key.a.kind || (key.b.kind == key.a.kind && key.b.id < key.a.id))) {
+                    swap(key.a, key.b);
+                }
+
+                Operand version = newVersion(d, kind);
+                define(d, version);
+                if (copy && hashable) {
+                    versionRep.back() = q.a;
+                    dropped++;
+                    continue;
+                }
+                if (hashable) {
+                    auto found = available.find(key);
+                    if (found != available.end()) {
+                        versionRep.back() = found->second;
+                        dropped++;
+                        continue;
+                    }
+                    available.emplace(key, version);
+                    inserted.push_back(key);
+                }
+                q.dst = version;
+                blockCode[b].push_back(q);
+            }
+            for (int s : block.succs) {
+                const vector<int> &preds = cfg.blocks[s].preds;
+                size_t k = find(preds.begin(), preds.end(), b) - preds.begin();
+                for (Phi &phi : phis[s]) phi.args[k] = rep(current[phi.value]);
+            }
+        };
+
+        struct Frame {
+            int block;
+            size_t child, renamedMark, insertedMark;
+        };
+        vector<Frame> stack;
+        auto enter = [&](int b) {
+            stack.push_back(Frame{b, 0, renamed.size(), inserted.size()});
+            visit(b);
+        };
+        enter(0);
+        while (!stack.empty()) {
+            Frame &top = stack.back();
+            if (top.child < dom.children[top.block].size()) {
+                enter(dom.children[top.block][top.child++]);
+                continue;
+            }
+            for (; renamed.size() > top.renamedMark; renamed.pop_back()) current[renamed.back().first] = renamed.back().second;
+            for (; inserted.size() > top.insertedMark; inserted.pop_back()) available.erase(inserted.back());
+            stack.pop_back();
+        }
+        return dropped;
+    }
+
+    // Drops phis nothing reads, including those only read by other such phis.
+    void removeDeadPhis() {
+        vector<int> uses(versionOrigin.size(), 0);
+        vector<Phi *> phiOf(versionOrigin.size(), nullptr);
+        auto count = [&](const Operand &o, int delta) {
+            if (isVersion(o)) uses[o.id - firstVersion] += delta;
+        };
+        for (const vector<Quad> &body : blockCode) {
+            for (const Quad &q : body) {
+                count(q.a, 1);
+                count(q.b, 1);
+            }
+        }
+        for (vector<Phi> &list : phis) {
+            for (Phi &phi : list) {
+                if (phi.removed) continue;
+                phiOf[phi.dst.id - firstVersion] = &phi;
+                for (const Operand &arg : phi.args) count(arg, 1);
+            }
+        }
+        vector<Phi *> work;
+        for (size_t v = 0; v < uses.size(); v++) {
+            if (phiOf[v] && uses[v] == 0) work.push_back(phiOf[v]);
+        }
+        while (!work.empty()) {
+            Phi *phi = work.back();
+            work.pop_back();
+            phi->removed = true;
+            for (const Operand &arg : phi->args) {
+                count(arg, -1);
+                if (isVersion(arg)) {
+                    Phi *source = phiOf[arg.id - firstVersion];
+                    if (source && !source->removed && uses[arg.id - firstVersion] == 0) work.push_back(source);
+                }
+            }
+        }
+    }
+
+    // Copies that take the edge pred -> succ into the phis of succ, ordered
+    // so that no source is overwritten before it is read.
+    vector<Quad> edgeCopies(const ControlFlowGraph &cfg, int pred, int succ) {
+        const vector<int> &preds = cfg.blocks[succ].preds;
+        size_t k = find(preds.begin(), preds.end(), pred) - preds.begin();
+        vector<pair<Operand, Operand>> pending;     // (dst, src), all at once
+        for (const Phi &phi : phis[succ]) {
+            if (!phi.removed && phi.args[k] != phi.dst) pending.push_back(make_pair(phi.dst, phi.args[k]));
+        }
+        vector<Quad> copies;
+        while (!pending.empty()) {
+            size_t ready = 0;
+            for (; ready < pending.size(); ready++) {
+                bool stillRead = false;
+                for (const pair<Operand, Operand> &other : pending) stillRead |= other.second == pending[ready].first;
+                if (!stillRead) break;
+            }
+            if (ready == pending.size()) {
+                // Every destination is still to be read: a cycle, broken with a temp
+                Operand saved = icg.newTemp();
+                copies.push_back(Quad{TAC_ASSIGN, saved, pending[0].first, Operand()});
+                for (pair<Operand, Operand> &other : pending) {
+                    if (other.second == pending[0].first) other.second = saved;
+                }
+                continue;
+            }
+            copies.push_back(Quad{TAC_ASSIGN, pending[ready].first, pending[ready].second, Operand()});
+            pending.erase(pending.begin() + ready);
+        }
+        return copies;
+    }
+
+    void leaveSsa(const ControlFlowGraph &cfg, const DominatorTree &dom, vector<Quad> &function) {
+        const vector<Quad> &code = icg.instructions;
+        vector<Quad> splits;
+        splitEdges.clear();
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            const ControlFlowGraph::Block &block = cfg.blocks[b];
+            if (!dom.reachable((int)b)) {
+                function.insert(function.end(), code.begin() + block.begin, code.begin() + block.end);
+                continue;
+            }
+            vector<Quad> &body = blockCode[b];
+            bool branches = !body.empty() && (body.back().op == TAC_AGAR || isCompareBranch(body.back().op));
+            if (!branches) {
+                // At most one successor: copies go before a goto, else at the end
+                vector<Quad> copies;
+                if (block.succs.size() == 1) copies = edgeCopies(cfg, (int)b, block.succs[0]);
+                bool jumps = !body.empty() && body.back().op == TAC_GOTO;
+                function.insert(function.end(), body.begin(), body.end() - (jumps ? 1 : 0));
+                function.insert(function.end(), copies.begin(), copies.end());
+                if (jumps) function.push_back(body.back());
+                continue;
+            }
+            // The taken edge gets a block of its own, appended after the
+            // function; the fall-through copies follow the branch.
+            Quad branch = body.back();
+            Operand &target = branch.op == TAC_AGAR ? branch.b : branch.dst;
+            size_t firstSplit = splitEdges.size();
+            for (int s : block.succs) {
+                const Quad &first = code[cfg.blocks[s].begin];
+                if (first.op != TAC_LABEL || first.a != target) continue;
+                vector<Quad> copies = edgeCopies(cfg, (int)b, s);
+                if (copies.empty()) continue;
+                Operand label = icg.newLabel();
+                size_t start = splits.size();
+                splits.push_back(Quad{TAC_LABEL, Operand(), label, Operand()});
+                splits.insert(splits.end(), copies.begin(), copies.end());
+                splits.push_back(Quad{TAC_GOTO, Operand(), target, Operand()});
+                splitEdges.push_back(SplitEdge{0, start, splits.size(), target});
+                target = label;
+            }
+            function.insert(function.end(), body.begin(), body.end() - 1);
+            for (size_t e = firstSplit; e < splitEdges.size(); e++) splitEdges[e].branch = function.size();
+            function.push_back(branch);
+            if (b + 1 < cfg.blocks.size()) {
+                vector<Quad> copies = edgeCopies(cfg, (int)b, (int)b + 1);
+                function.insert(function.end(), copies.begin(), copies.end());
+            }
+        }
+        for (SplitEdge &edge : splitEdges) {
+            edge.begin += function.size();
+            edge.end += function.size();
+        }
+        function.insert(function.end(), splits.begin(), splits.end());
+    }
+
+    // The copies of a split edge can go before the branch instead when the
+    // branch does not read what they write and the fall-through path does
+    // not either. That is the usual case for a loop's back edge, and it saves
+    // a jump on every trip around.
+    void hoistEdgeCopies(vector<Quad> &function) {
+        if (splitEdges.empty()) return;
+        ControlFlowGraph cfg(function, 0, function.size());
+        outValues.clear();
+        SparseLiveness liveness(function, cfg, outValues);
+        vector<int> hoisted(function.size(), -1);   // Branch index -> split edge moved before it
+        for (size_t e = 0; e < splitEdges.size(); e++) {
+            const SplitEdge &edge = splitEdges[e];
+            const Quad &branch = function[edge.branch];
+            int fallThrough = cfg.blockOf(edge.branch + 1);
+            bool movable = true;
+            for (size_t i = edge.begin + 1; i + 1 < edge.end && movable; i++) {
+                const Operand &dst = function[i].dst;
+                int d = outValues.find(dst);
+                movable = dst != branch.a && dst != branch.b && !(d >= 0 && liveness.liveAtStart(fallThrough, d));
+            }
+            if (movable) hoisted[edge.branch] = (int)e;
+        }
+        vector<Quad> rewritten;
+        rewritten.reserve(function.size());
+        vector<bool> dropped(function.size(), false);
+        for (size_t i = 0; i < function.size(); i++) {
+            if (dropped[i]) continue;
+            if (hoisted[i] < 0) {
+                rewritten.push_back(function[i]);
+                continue;
+            }
+            const SplitEdge &edge = splitEdges[hoisted[i]];
+            rewritten.insert(rewritten.end(), function.begin() + edge.begin + 1, function.begin() + edge.end - 1);
+            Quad branch = function[i];
+            (branch.op == TAC_AGAR ? branch.b : branch.dst) = edge.target;
+            rewritten.push_back(branch);
+            fill(dropped.begin() + edge.begin, dropped.begin() + edge.end, true);
+        }
+        function.swap(rewritten);
+    }
+
+    // Renames every version back to the variable or temp it came from, unless
+    // two versions of it (or the original) are live at the same time; those
+    // keep apart, a variable's as fresh locals of the same type.
+    void coalesce(vector<Quad> &function) {
+        auto originOf = [&](const Operand &o) {
+            if (isVersion(o)) return versionOrigin[o.id - firstVersion];
+            int v = values.find(o);
+            return tracked(v) ? v : -1;
+        };
+        ControlFlowGraph cfg(function, 0, function.size());
+        outValues.clear();
+        SparseLiveness liveness(function, cfg, outValues);
+        vector<bool> conflict(values.size(), false);
+        vector<int> liveCount(values.size(), 0);
+        vector<int> origin(outValues.size());
+        for (size_t v = 0; v < outValues.size(); v++) origin[v] = originOf(outValues.operand((int)v));
+        vector<bool> live(outValues.size(), false);
+        vector<int> liveList;
+        auto makeLive = [&](int v) {
+            if (v < 0 || live[v]) return;
+            live[v] = true;
+            liveList.push_back(v);
+            if (origin[v] >= 0) liveCount[origin[v]]++;
+        };
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            liveness.forEachLiveAtEnd((int)b, makeLive);
+            for (size_t i = cfg.blocks[b].end; i-- > cfg.blocks[b].begin;) {
+                const Quad &q = function[i];
+                int d = outValues.find(q.dst);
+                if (d >= 0 && origin[d] >= 0) {
+                    int others = liveCount[origin[d]] - (live[d] ? 1 : 0);
+                    int source = q.op == TAC_ASSIGN ? outValues.find(q.a) : -1;
+                    if (source >= 0 && source != d && live[source] && origin[source] == origin[d]) others--;
+                    if (others > 0) conflict[origin[d]] = true;
+                }
+                if (d >= 0 && live[d]) {
+                    live[d] = false;
+                    if (origin[d] >= 0) liveCount[origin[d]]--;
+                }
+                makeLive(outValues.find(q.a));
+                makeLive(outValues.find(q.b));
+            }
+            for (int v : liveList) {
+                if (live[v] && origin[v] >= 0) liveCount[origin[v]]--;
+                live[v] = false;
+            }
+            liveList.clear();
+        }
+
+        vector<Operand> renamed(versionOrigin.size());
+        for (size_t k = 0; k < versionOrigin.size(); k++) {
+            const Operand &original = values.operand(versionOrigin[k]);
+            Operand version{OP_TEMP, firstVersion + (int)k};
+            if (!conflict[versionOrigin[k]]) renamed[k] = original;
+            else if (original.kind == OP_TEMP) renamed[k] = version;
+            else renamed[k] = icg.var(icg.names[original.id] + "." + to_string(version.id), icg.varType(original), false);
+        }
+        for (Quad &q : function) {
+            for (Operand *o : {&q.dst, &q.a, &q.b}) {
+                if (isVersion(*o)) *o = renamed[o->id - firstVersion];
+            }
+        }
+    }
+};
+
+// Unrolls counted loops, one function at a time: innermost loops with a
+// preheader and a trip count known at compile time. The counter is an int
+// local set to a constant just before the loop, whose only update in the
+// loop is i = i + c or i - c on every way round, and which the branch at the
+// bottom compares with a constant. A loop that stays small is replaced by one
+// copy of its body per trip. A larger one gets factor copies per iteration,
+// with the trips left over peeled off in front. Every copy keeps its own
+// update of the counter, so the copies compute exactly what the iterations
+// did, and a wapsi inside still returns from whichever one it is in.
+class LoopUnroller {
+public:
+    static const int FULL_UNROLL_QUADS = 256;       // Size a fully unrolled loop may grow to
+    static const int UNROLLED_BODY_QUADS = 256;     // Size of the body of a partly unrolled loop
+
+    int fullyUnrolled = 0, partlyUnrolled = 0;
+
+    explicit LoopUnroller(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    // Appends the quads [begin, end) of one function to out with its counted
+    // loops unrolled by factor, or fully where they are small enough.
+    void run(size_t begin, size_t end, int factor, vector<Quad> &out) {
+        const vector<Quad> &code = icg.instructions;
+        ControlFlowGraph cfg(code, begin, end);
+        DominatorTree dom(cfg);
+        LoopNest nest(cfg, dom);
+        vector<bool> header(cfg.blocks.size(), false);
+        for (const LoopNest::Loop &loop : nest.loops) header[loop.header] = true;
+        noteTemps(begin, end);
+
+        vector<Plan> plans;
+        for (const LoopNest::Loop &loop : nest.loops) {
+            bool innermost = none_of(loop.blocks.begin() + 1, loop.blocks.end(), [&](int b) { return header[b]; });
+            Plan plan;
+            if (innermost && planUnrolling(cfg, dom, loop, factor, plan)) plans.push_back(plan);
+        }
+        sort(plans.begin(), plans.end(), [](const Plan &a, const Plan &b) { return a.begin < b.begin; });
+
+        size_t next = begin;
+        for (const Plan &plan : plans) {
+            out.insert(out.end(), code.begin() + next, code.begin() + plan.begin);
+            // Leftover trips first, then the loop around the rest
+            int64_t peeled = plan.copies == 0 ? plan.trips : plan.trips % plan.copies;
+            for (int64_t k = 0; k < peeled; k++) copyBody(plan, out);
+            if (plan.copies > 0) {
+                out.push_back(code[plan.begin]);
+                for (int k = 0; k < plan.copies; k++) copyBody(plan, out);
+                out.push_back(code[plan.end - 1]);
+                partlyUnrolled++;
+            } else {
+                fullyUnrolled++;
+            }
+            next = plan.end;
+        }
+        out.insert(out.end(), code.begin() + next, code.begin() + end);
+        forgetTemps();
+    }
+
+    void printReport() const {
+        cout << "Loop unrolling: " << fullyUnrolled << " loops fully unrolled, " << partlyUnrolled << " partly" << endl;
+    }
+
+private:
+    struct Plan {
+        size_t begin, end;          // Header label to the branch at the bottom
+        int64_t trips;
+        int copies;                 // Per iteration of the unrolled loop; 0 unrolls fully
+    };
+
+    IntermediateCodeGnerator &icg;
+    vector<size_t> firstSeen, lastSeen;     // Per temp, where it appears in the function
+    vector<int> seenTemps;
+    unordered_map<int, Operand> labels, temps;  // Fresh names in the current copy
+
+    void noteTemps(size_t begin, size_t end) {
+        firstSeen.resize(icg.tempCount, SIZE_MAX);
+        lastSeen.resize(icg.tempCount, 0);
+        for (size_t i = begin; i < end; i++) {
+            for (const Operand *o : {&icg.instructions[i].a, &icg.instructions[i].b, &icg.instructions[i].dst}) {
+                if (o->kind != OP_TEMP) continue;
+                if (firstSeen[o->id] == SIZE_MAX) seenTemps.push_back(o->id);
+                firstSeen[o->id] = min(firstSeen[o->id], i);
+                lastSeen[o->id] = i;
+            }
+        }
+    }
+
+    void forgetTemps() {
+        for (int t : seenTemps) {
+            firstSeen[t] = SIZE_MAX;
+            lastSeen[t] = 0;
+        }
+        seenTemps.clear();
+    }
+
+    static TacOp mirrored(TacOp relation) {
+        switch (relation) {
+            case TAC_LT: return TAC_GT;
+            case TAC_LE: return TAC_GE;
+            case TAC_GT: return TAC_LT;
+            case TAC_GE: return TAC_LE;
+            default: return relation;
+        }
+    }
+
+    bool intLiteral(const Operand &o, int64_t &value) const {
+        if (o.kind != OP_IMM) return false;
+        ConstValue c = ConstValue::parse(icg.literals[o.id]);
+        value = c.i;
+        return !c.isDouble;
+    }
+
+    bool planUnrolling(const ControlFlowGraph &cfg, const DominatorTree &dom, const LoopNest::Loop &loop,
+                       int factor, Plan &plan) const {
+        const vector<Quad> &code = icg.instructions;
+        if (loop.latches.size() != 1 || !LoopNest::hasPreheader(code, cfg, loop)) return false;
+        // The body must be laid out in one piece, header first and latch last
+        int h = loop.header, latch = loop.latches[0];
+        if (latch - h + 1 != (int)loop.blocks.size()) return false;
+        for (int b : loop.blocks) {
+            if (b < h || b > latch) return false;
+        }
+        plan.begin = cfg.blocks[h].begin;
+        plan.end = cfg.blocks[latch].end;
+        const Quad &top = code[plan.begin], &bottom = code[plan.end - 1];
+        if (top.op != TAC_LABEL || !isCompareBranch(bottom.op) || bottom.dst != top.a) return false;
+
+        // Loops while counter <relation> bound
+        TacOp relation = relationOf(bottom.op);
+        Operand counter = bottom.a;
+        int64_t bound;
+        if (!intLiteral(bottom.b, bound)) {
+            counter = bottom.b;
+            relation = mirrored(relation);
+            if (!intLiteral(bottom.a, bound)) return false;
+        }
+        if (counter.kind != OP_VAR || icg.isGlobal(counter) || icg.varType(counter) != TYPE_INT) return false;
+
+        // One update, t = counter +/- step then counter = t, passed every time round
+        size_t update = SIZE_MAX;
+        for (size_t i = plan.begin; i < plan.end; i++) {
+            if (code[i].dst != counter) continue;
+            if (update != SIZE_MAX) return false;
+            update = i;
+        }
+        if (update == SIZE_MAX || code[update].op != TAC_ASSIGN || code[update].a.kind != OP_TEMP) return false;
+        if (!dom.dominates(cfg.blockOf(update), latch)) return false;
+        Operand next = code[update].a;
+        size_t stepAt = firstSeen[next.id];
+        if (stepAt < plan.begin || stepAt >= update) return false;
+        const Quad &step = code[stepAt];
+        int64_t stride = 0;
+        bool counts = step.dst == next && ((step.op == TAC_ADD && step.a == counter && intLiteral(step.b, stride)) ||
+                                           (step.op == TAC_ADD && step.b == counter && intLiteral(step.a, stride)) ||
+                                           (step.op == TAC_SUB && step.a == counter && intLiteral(step.b, stride)));
+        if (!counts || stride == 0) return false;
+        if (step.op == TAC_SUB) stride = -stride;
+        for (size_t i = stepAt + 1; i < plan.end; i++) {
+            if (code[i].dst == next) return false;
+        }
+
+        // Start value: the last store to the counter in the block falling into the loop
+        const ControlFlowGraph::Block &before = cfg.blocks[h - 1];
+        int64_t value = 0;
+        bool known = false;
+        for (size_t i = before.end; i-- > before.begin;) {
+            if (code[i].dst != counter) continue;
+            known = code[i].op == TAC_ASSIGN && intLiteral(code[i].a, value);
+            break;
+        }
+        if (!known) return false;
+        // Count the trips, staying in the target's 16-bit range so wrapping
+        // around cannot change the answer
+        ConstValue limit = ConstValue::ofInt(bound), holds;
+        for (plan.trips = 1;; plan.trips++) {
+            value += stride;
+            if (value < INT16_MIN || value > INT16_MAX) return false;
+            foldBinary(relation, ConstValue::ofInt(value), limit, holds);
+            if (!holds.truthy()) break;
+        }
+
+        // Temps of the body must not be read before they are set or outside it,
+        // so that each copy can have its own
+        for (size_t i = plan.begin; i < plan.end; i++) {
+            const Quad &q = code[i];
+            if (q.dst.kind != OP_TEMP) continue;
+            size_t first = firstSeen[q.dst.id];
+            if (first < plan.begin || lastSeen[q.dst.id] >= plan.end) return false;
+            const Quad &setter = code[first];
+            if (setter.dst != q.dst || setter.a == q.dst || setter.b == q.dst) return false;
+        }
+
+        int64_t body = (int64_t)(plan.end - plan.begin) - 2;
+        if (plan.trips * body <= FULL_UNROLL_QUADS) {
+            plan.copies = 0;
+            return true;
+        }
+        plan.copies = (int)min<int64_t>(factor, UNROLLED_BODY_QUADS / max<int64_t>(body, 1));
+        return plan.copies >= 2;
+    }
+
+    // Appends the body without the header label and the branch back, with
+    // fresh labels and temps for whatever it defines.
+    void copyBody(const Plan &plan, vector<Quad> &out) {
+        const vector<Quad> &code = icg.instructions;
+        labels.clear();
+        temps.clear();
+        for (size_t i = plan.begin + 1; i + 1 < plan.end; i++) {
+            const Quad &q = code[i];
+            if (q.op == TAC_LABEL) labels[q.a.id] = icg.newLabel();
+            if (q.dst.kind == OP_TEMP && !temps.count(q.dst.id)) temps[q.dst.id] = icg.newTemp();
+        }
+        for (size_t i = plan.begin + 1; i + 1 < plan.end; i++) {
+            Quad q = code[i];
+            for (Operand *o : {&q.dst, &q.a, &q.b}) {
+                unordered_map<int, Operand> *map = o->kind == OP_TEMP ? &temps : o->kind == OP_LABEL ? &labels : nullptr;
+                if (!map) continue;
+                auto it = map->find(o->id);
+                if (it != map->end()) *o = it->second;
+            }
+            out.push_back(q);
+        }
+    }
+};
+
+// Loop-invariant code motion and induction-variable strength reduction, one
+// function at a time, over the loops of LoopNest that have a preheader.
+// Inner loops go first, so what they hoist can move on out of the loops
+// around them.
+class LoopOptimizer {
+public:
+    struct LoopReport {
+        string function;
+        Operand header;             // Label at the top of the loop, if it has one
+        int block;                  // Else its header block
+        int depth;                  // 1 for an outermost loop
+        int hoisted = 0;            // Quads moved into the preheader
+        int reduced = 0;            // Multiplications turned into additions
+    };
+    vector<LoopReport> loops;
+
+    explicit LoopOptimizer(IntermediateCodeGnerator &icg) : icg(icg), values(icg) {}
+
+    // Appends the quads [begin, end) of one function to out with its loops
+    // optimized.
+    void run(size_t begin, size_t end, vector<Quad> &out) {
+        const vector<Quad> &code = icg.instructions;
+        ControlFlowGraph cfg(code, begin, end);
+        DominatorTree dom(cfg);
+        values.clear();
+        items.clear();
+        functionDefs.clear();
+        definedBy.clear();
+        loopDefs.clear();
+        loopStamp.clear();
+        hoistedFrom.clear();
+        size_t blockCount = cfg.blocks.size();
+        entry.assign(blockCount, vector<int>());
+        blockItems.assign(blockCount, vector<int>());
+        for (size_t b = 0; b < blockCount; b++) {
+            for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+                blockItems[b].push_back(addItem(code[i], (int)b));
+            }
+        }
+
+        const vector<Loop> &found = LoopNest(cfg, dom).loops;
+        string function = code[begin].op == TAC_FUNC ? icg.operandToString(code[begin].a) : "(top level)";
+        inLoop.assign(blockCount, -1);
+        for (size_t k = 0; k < found.size(); k++) {
+            const Loop &loop = found[k];
+            for (int b : loop.blocks) inLoop[b] = (int)k;
+            const Quad &top = code[cfg.blocks[loop.header].begin];
+            LoopReport report;
+            report.function = function;
+            report.header = top.op == TAC_LABEL ? top.a : Operand();
+            report.block = loop.header;
+            report.depth = loop.depth;
+            if (LoopNest::hasPreheader(code, cfg, loop)) {
+                countLoopDefs(loop);
+                report.hoisted = hoistInvariants(cfg, dom, loop, (int)k);
+                report.reduced = reduceStrength(loop, (int)k);
+            }
+            loops.push_back(report);
+        }
+
+        for (size_t b = 0; b < blockCount; b++) {
+            for (const vector<int> *list : {&entry[b], &blockItems[b]}) {
+                for (int item : *list) {
+                    if (!items[item].removed) out.push_back(items[item].q);
+                }
+            }
+        }
+    }
+
+    // Totals, then the loops that gained the most, like the register report.
+    void printReport() const {
+        int hoisted = 0, reduced = 0;
+        vector<const LoopReport *> busy;
+        for (const LoopReport &loop : loops) {
+            hoisted += loop.hoisted;
+            reduced += loop.reduced;
+            if (loop.hoisted + loop.reduced > 0) busy.push_back(&loop);
+        }
+        cout << "Loop optimization: " << loops.size() << " loops, " << hoisted << " instructions hoisted, "
+             << reduced << " multiplications strength-reduced" << endl;
+        stable_sort(busy.begin(), busy.end(), [](const LoopReport *a, const LoopReport *b) {
+            return a->hoisted + a->reduced > b->hoisted + b->reduced;
+        });
+        const size_t shown = 10;
+        for (size_t i = 0; i < busy.size() && i < shown; i++) {
+            string header = busy[i]->header.kind == OP_LABEL ? icg.operandToString(busy[i]->header)
+                                                             : "block " + to_string(busy[i]->block);
+            cout << "  " << busy[i]->function << " " << header << " (depth " << busy[i]->depth << "): hoisted "
+                 << busy[i]->hoisted << ", reduced " << busy[i]->reduced << endl;
+        }
+        if (busy.size() > shown) cout << "  ... " << busy.size() - shown << " more loops changed" << endl;
+    }
+
+private:
+    typedef LoopNest::Loop Loop;
+
+    // A quad of the function. Hoisting copies it into a preheader and removes
+    // the original, so moves never disturb the lists being walked.
+    struct Item {
+        Quad q;
+        int block;                  // For dominance; a preheader's quads count as its header's
+        bool removed = false;
+    };
+
+    IntermediateCodeGnerator &icg;
+    ValueIndex values;
+    vector<Item> items;
+    vector<vector<int>> entry;      // Per header, the preheader quads placed before it
+    vector<vector<int>> blockItems; // Per block, its own quads in order
+    vector<int> functionDefs;       // Per value, definitions in the whole function
+    vector<int> definedBy;          // Per value, its last definition's item
+    vector<int> inLoop;             // Per block, innermost loop processed so far holding it
+    vector<int> loopDefs, loopStamp;    // Per value, definitions in the current loop
+    vector<int> hoistedFrom;        // Per value, the loop its definition was hoisted out of
+    bool loopCalls = false;         // Whether the current loop has a CALL
+
+    int addItem(const Quad &q, int block) {
+        int id = (int)items.size();
+        items.push_back(Item{q, block, false});
+        int d = values.add(q.dst);
+        if (d >= 0) {
+            if (d >= (int)functionDefs.size()) {
+                functionDefs.resize(values.size(), 0);
+                definedBy.resize(values.size(), -1);
+            }
+            functionDefs[d]++;
+            definedBy[d] = id;
+        }
+        values.add(q.a);
+        values.add(q.b);
+        return id;
+    }
+
+    // Calls f for the index of every live quad inside the loop, header first
+    // and blocks in the given order.
+    template <typename F> void forEachItem(const vector<int> &blocks, const Loop &loop, F f) {
+        for (int b : blocks) {
+            if (b != loop.header) {
+                // Index loop: f may add items to other lists
+                for (size_t i = 0; i < entry[b].size(); i++) {
+                    if (!items[entry[b][i]].removed) f(entry[b][i]);
+                }
+            }
+            for (size_t i = 0; i < blockItems[b].size(); i++) {
+                if (!items[blockItems[b][i]].removed) f(blockItems[b][i]);
+            }
+        }
+    }
+
+    void countLoopDefs(const Loop &loop) {
+        loopDefs.resize(values.size(), 0);
+        loopStamp.resize(values.size(), -1);
+        loopCalls = false;
+        int stamp = loop.header;
+        forEachItem(loop.blocks, loop, [&](int item) {
+            const Quad &q = items[item].q;
+            if (q.op == TAC_CALL) loopCalls = true;
+            int d = values.find(q.dst);
+            if (d < 0) return;
+            if (loopStamp[d] != stamp) {
+                loopStamp[d] = stamp;
+                loopDefs[d] = 0;
+            }
+            loopDefs[d]++;
+        });
+    }
+
+    int defsInLoop(int value, const Loop &loop) const {
+        return value < (int)loopStamp.size() && loopStamp[value] == loop.header ? loopDefs[value] : 0;
+    }
+
+    // Moves computations whose operands cannot change inside the loop into
+    // its preheader. Only temps with a single definition qualify, so every
+    // use still sees the same value. A division runs there even if the loop
+    // would have skipped it, so its divisor must be a constant that cannot
+    // trap, or its block must be passed on every way round and out.
+    int hoistInvariants(const ControlFlowGraph &cfg, const DominatorTree &dom, const Loop &loop, int k) {
+        hoistedFrom.resize(values.size(), -1);
+        auto invariant = [&](const Operand &o) {
+            if (o.kind == OP_IMM) return true;
+            int v = values.find(o);
+            if (v < 0) return false;
+            if (defsInLoop(v, loop) == 0) return !(loopCalls && values.isGlobal(v));
+            return v < (int)hoistedFrom.size() && hoistedFrom[v] == loop.header;
+        };
+        vector<int> exits = loop.latches;
+        for (int b : loop.blocks) {
+            const vector<int> &succs = cfg.blocks[b].succs;
+            if (succs.empty() || any_of(succs.begin(), succs.end(), [&](int s) { return inLoop[s] != k; })) exits.push_back(b);
+        }
+        auto runsEveryTime = [&](int block) {
+            return all_of(exits.begin(), exits.end(), [&](int e) { return dom.dominates(block, e); });
+        };
+
+        // Reverse postorder sees each definition before the uses it dominates
+        vector<int> blocks;
+        for (int b : cfg.order()) {
+            if (dom.reachable(b) && inLoop[b] == k) blocks.push_back(b);
+        }
+        int hoisted = 0;
+        forEachItem(blocks, loop, [&](int item) {
+            Quad q = items[item].q;
+            if (!isBinaryOp(q.op) || q.dst.kind != OP_TEMP) return;
+            int d = values.find(q.dst);
+            if (functionDefs[d] != 1 || !invariant(q.a) || !invariant(q.b)) return;
+            if (q.op == TAC_DIV && !safeDivisor(q.b) && !runsEveryTime(items[item].block)) return;
+            items[item].removed = true;
+            int moved = addItem(q, loop.header);
+            functionDefs[d]--;      // The copy replaces the original
+            entry[loop.header].push_back(moved);
+            hoistedFrom.resize(values.size(), -1);
+            hoistedFrom[d] = loop.header;
+            hoisted++;
+        });
+        return hoisted;
+    }
+
+    bool safeDivisor(const Operand &o) const {
+        if (o.kind != OP_IMM) return false;
+        ConstValue c = ConstValue::parse(icg.literals[o.id]);
+        return c.isDouble ? c.d != 0 : c.i != 0 && c.i != -1;      // INT_MIN / -1 traps as well
+    }
+
+    bool intLiteral(const Operand &o) const {
+        return o.kind == OP_IMM && !ConstValue::parse(icg.literals[o.id]).isDouble;
+    }
+
+    // A basic induction variable: an int local whose only definition in the
+    // loop is i = t with t = i + c or i - c for a constant c.
+    struct Induction {
+        Operand var;
+        TacOp step;                 // TAC_ADD or TAC_SUB
+        ConstValue stride;
+        int update;                 // Item of i = t
+    };
+
+    // Replaces t = i * k (k constant) by a copy of a new local that starts
+    // as i * k in the preheader and moves by c * k right after each update
+    // of i. Both sides wrap around alike, so they stay equal.
+    int reduceStrength(const Loop &loop, int k) {
+        vector<int> blocks;
+        for (int b : loop.blocks) blocks.push_back(b);
+        vector<Induction> inductions;
+        forEachItem(blocks, loop, [&](int item) {
+            const Quad &q = items[item].q;
+            if (q.op != TAC_ASSIGN || q.dst.kind != OP_VAR || icg.isGlobal(q.dst) || icg.varType(q.dst) != TYPE_INT) return;
+            if (defsInLoop(values.find(q.dst), loop) != 1 || q.a.kind != OP_TEMP) return;
+            int t = values.find(q.a);
+            if (functionDefs[t] != 1 || definedBy[t] < 0) return;
+            const Item &def = items[definedBy[t]];
+            if (def.removed || inLoop[def.block] != k) return;
+            const Quad &step = def.q;
+            Induction iv{q.dst, step.op, ConstValue(), item};
+            if (step.op == TAC_ADD && step.a == q.dst && intLiteral(step.b)) iv.stride = ConstValue::parse(icg.literals[step.b.id]);
+            else if (step.op == TAC_ADD && step.b == q.dst && intLiteral(step.a)) iv.stride = ConstValue::parse(icg.literals[step.a.id]);
+            else if (step.op == TAC_SUB && step.a == q.dst && intLiteral(step.b)) iv.stride = ConstValue::parse(icg.literals[step.b.id]);
+            else return;
+            inductions.push_back(iv);
+        });
+        if (inductions.empty()) return 0;
+
+        map<pair<int, int64_t>, Operand> reducedBy;     // (induction variable, factor) -> its new local
+        int reduced = 0;
+        forEachItem(blocks, loop, [&](int item) {
+            Quad q = items[item].q;
+            if (q.op != TAC_MUL || q.dst.kind != OP_TEMP) return;
+            for (const Induction &iv : inductions) {
+                Operand factor = q.a == iv.var ? q.b : q.b == iv.var ? q.a : Operand();
+                if (!intLiteral(factor)) continue;
+                ConstValue by = ConstValue::parse(icg.literals[factor.id]);
+                Operand &scaled = reducedBy[make_pair(iv.var.id, by.i)];
+                if (scaled.kind == OP_NONE) {
+                    scaled = icg.var(icg.names[iv.var.id] + "." + to_string(q.dst.id), TYPE_INT, false);
+                    Operand start = icg.newTemp(), next = icg.newTemp();
+                    entry[loop.header].push_back(addItem(Quad{TAC_MUL, start, iv.var, factor}, loop.header));
+                    entry[loop.header].push_back(addItem(Quad{TAC_ASSIGN, scaled, start, Operand()}, loop.header));
+                    ConstValue delta;
+                    foldBinary(TAC_MUL, iv.stride, by, delta);
+                    int block = items[iv.update].block;
+                    vector<int> *list = &blockItems[block];
+                    if (find(list->begin(), list->end(), iv.update) == list->end()) list = &entry[block];
+                    int add = addItem(Quad{iv.step, next, scaled, icg.imm(delta.toLiteral())}, block);
+                    int store = addItem(Quad{TAC_ASSIGN, scaled, next, Operand()}, block);
+                    auto at = find(list->begin(), list->end(), iv.update) + 1;
+                    list->insert(list->insert(at, add) + 1, store);
+                }
+                items[item].q = Quad{TAC_ASSIGN, q.dst, scaled, Operand()};
+                reduced++;
+                return;
+            }
+        });
+        return reduced;
+    }
+};
+
+// Machine-independent optimizations over the TAC, run between lowering and
+// assembly generation. Each pass rewrites icg.instructions in place and
+// records how many instructions it removed.
+// Inlining at -O2. A call to a function that cannot reach itself through
+// calls is replaced by a copy of its body when the body is small, or when
+// this is its only call site. Functions are visited callees first, so a
+// body has its own calls inlined before it is copied anywhere. Each copy
+// gets fresh labels, temps and locals, and its returns become a jump past
+// its end. Shared locals (see markSharedLocals) keep their name, so every
+// copy and the function itself still see one variable. A function whose
+// every call site was inlined is dropped.
+class Inliner {
+public:
+    static const int SMALL_QUADS = 24;          // Bodies always worth copying
+    static const int SINGLE_CALL_QUADS = 256;   // For a function called from one place
+    static const int GROWTH = 2;                // The program may grow to this many times its size
+
+    int inlined = 0, removed = 0;
+
+    explicit Inliner(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    void run() {
+        const vector<Quad> &code = icg.instructions;
+        vector<pair<size_t, size_t>> ranges = ControlFlowGraph::functionRanges(code);
+        functions.assign(ranges.size(), Function());
+        functionOf.clear();
+        for (size_t f = 0; f < ranges.size(); f++) {
+            Function &fn = functions[f];
+            fn.code.assign(code.begin() + ranges[f].first, code.begin() + ranges[f].second);
+            if (fn.code[0].op != TAC_FUNC) continue;    // The top-level code
+            functionOf[fn.code[0].a.id] = (int)f;
+            fn.inlinable = icg.names[fn.code[0].a.id] != "main_func";
+        }
+        for (Function &fn : functions) {
+            for (const Quad &q : fn.code) {
+                int callee = calleeOf(q);
+                if (callee < 0) continue;
+                functions[callee].calls++;
+                fn.callees.push_back(callee);
+            }
+        }
+        budget = code.size() * GROWTH;
+        size = code.size();
+
+        // Strongly connected components come out callees first
+        index = 0;
+        order.assign(functions.size(), -1);
+        low.assign(functions.size(), 0);
+        onStack.assign(functions.size(), false);
+        for (size_t f = 0; f < functions.size(); f++) {
+            if (order[f] < 0) visit((int)f);
+        }
+
+        vector<int> callsLeft(functions.size(), 0);
+        for (const Function &fn : functions) {
+            for (const Quad &q : fn.code) {
+                if (calleeOf(q) >= 0) callsLeft[calleeOf(q)]++;
+            }
+        }
+        vector<Quad> out;
+        out.reserve(size);
+        for (size_t f = 0; f < functions.size(); f++) {
+            if (functions[f].calls > 0 && callsLeft[f] == 0) {
+                removed++;
+                continue;
+            }
+            out.insert(out.end(), functions[f].code.begin(), functions[f].code.end());
+        }
+        icg.instructions.swap(out);
+        functions.clear();
+    }
+
+    void printReport() const {
+        cout << "Inlining: " << inlined << " call sites inlined, " << removed << " functions removed" << endl;
+    }
+
+private:
+    struct Function {
+        vector<Quad> code;          // From its label to the next function's
+        vector<int> callees;        // One entry per call site
+        int calls = 0;              // Call sites in the program as written
+        bool inlinable = false;     // Not main
+        bool recursive = false;
+    };
+
+    IntermediateCodeGnerator &icg;
+    vector<Function> functions;
+    unordered_map<int, int> functionOf;     // By the name id of the label
+    vector<int> order, low, stack;          // Tarjan's algorithm
+    vector<bool> onStack;
+    int index = 0;
+    size_t size = 0, budget = 0;            // Quads in the program, and how many it may grow to
+    unordered_map<int, Operand> labels, temps, locals;  // Fresh names in the current copy
+
+    int calleeOf(const Quad &q) const {
+        if (q.op != TAC_CALL) return -1;
+        auto it = functionOf.find(q.a.id);
+        return it == functionOf.end() ? -1 : it->second;
+    }
+
+    void visit(int f) {
+        order[f] = low[f] = index++;
+        stack.push_back(f);
+        onStack[f] = true;
+        for (int callee : functions[f].callees) {
+            if (callee == f) functions[f].recursive = true;
+            if (order[callee] < 0) {
+                visit(callee);
+                low[f] = min(low[f], low[callee]);
+            } else if (onStack[callee]) {
+                low[f] = min(low[f], order[callee]);
+            }
+        }
+        if (low[f] != order[f]) return;
+        vector<int> component;
+        int member;
+        do {
+            member = stack.back();
+            stack.pop_back();
+            onStack[member] = false;
+            component.push_back(member);
+        } while (member != f);
+        for (int m : component) {
+            if (component.size() > 1) functions[m].recursive = true;
+        }
+        for (int m : component) inlineCalls(functions[m]);
+    }
+
+    // Quads a copy of fn adds in place of its call.
+    static int bodySize(const Function &fn) {
+        int quads = 0;
+        for (size_t i = 1; i < fn.code.size(); i++) {
+            if (fn.code[i].op != TAC_LABEL) quads++;
+        }
+        return fn.code.back().op == TAC_RET ? quads - 1 : quads;
+    }
+
+    bool worthInlining(const Function &callee) const {
+        if (!callee.inlinable || callee.recursive) return false;
+        int quads = bodySize(callee);
+        if (quads > SMALL_QUADS && (callee.calls > 1 || quads > SINGLE_CALL_QUADS)) return false;
+        return size + quads <= budget;
+    }
+
+    void inlineCalls(Function &fn) {
+        vector<Quad> out;
+        out.reserve(fn.code.size());
+        for (const Quad &q : fn.code) {
+            int callee = calleeOf(q);
+            if (callee < 0 || !worthInlining(functions[callee])) {
+                out.push_back(q);
+                continue;
+            }
+            copyBody(functions[callee], out);
+            size += bodySize(functions[callee]);
+            inlined++;
+        }
+        fn.code.swap(out);
+    }
+
+    // Appends callee without its label, each return turned into a jump to a
+    // label after the copy.
+    void copyBody(const Function &callee, vector<Quad> &out) {
+        labels.clear();
+        temps.clear();
+        locals.clear();
+        Operand end = icg.newLabel();
+        string suffix = ".in" + to_string(end.id);
+        for (size_t i = 1; i < callee.code.size(); i++) {
+            Quad q = callee.code[i];
+            if (q.op == TAC_RET || q.op == TAC_WAPSI) q = Quad{TAC_GOTO, Operand(), end, Operand()};
+            for (Operand *o : {&q.dst, &q.a, &q.b}) {
+                if (o->kind == OP_TEMP) *o = fresh(temps, *o, [&] { return icg.newTemp(); });
+                else if (o->kind == OP_LABEL && *o != end) *o = fresh(labels, *o, [&] { return icg.newLabel(); });
+                else if (o->kind == OP_VAR && !icg.isGlobal(*o)) {
+                    *o = fresh(locals, *o, [&] { return icg.var(icg.names[o->id] + suffix, icg.varType(*o), false); });
+                }
+            }
+            out.push_back(q);
+        }
+        if (out.back().op == TAC_GOTO && out.back().a == end) out.pop_back();
+        out.push_back(Quad{TAC_LABEL, Operand(), end, Operand()});
+    }
+
+    template <typename Make>
+    static Operand fresh(unordered_map<int, Operand> &names, const Operand &o, Make make) {
+        auto it = names.find(o.id);
+        if (it != names.end()) return it->second;
+        Operand renamed = make();
+        names.emplace(o.id, renamed);
+        return renamed;
+    }
+};
+
+class TacOptimizer {
+public:
+    int unrollFactor = 4;      // Loop body copies per iteration at -O2; 1 turns unrolling off
+    unsigned threads = 1;      // Functions optimized at once
+
+    TacOptimizer(IntermediateCodeGnerator &icg) : icg(icg), inliner(icg), unroller(icg), loopOptimizer(icg) {}
+
+    // Inlining needs the whole program; every other pass looks at one
+    // function at a time, so those run on all functions in parallel. Shared
+    // locals are marked first, for these passes and register allocation.
+    void optimize(int level) {
+        if (level >= 1) {
+            markSharedLocals(icg);
+            optimizeFunctions([](TacOptimizer &function) {
+                function.record("constant folding/propagation", function.constantFolding());
+                function.record("dead code elimination", function.deadCodeElimination());
+            });
+        }
+        if (level >= 2) {
+            inlineFunctions();
+            optimizeFunctions([](TacOptimizer &function) {
+                // Constants passed in globals now meet the code that uses them
+                function.constantFolding();
+                function.deadCodeElimination();
+                if (function.unrollFactor > 1) function.unrollLoops();
+                function.record("global value numbering", function.globalValueNumbering());
+                function.loopOptimization();
+            });
+        }
+    }
+
+    void printReport() const {
+        for (const auto &entry : report) {
+            cout << "  " << entry.first << ": removed " << entry.second << " instructions" << endl;
+        }
+        if (functionsInlined) inliner.printReport();
+        if (loopsUnrolled) unroller.printReport();
+        if (loopsOptimized) loopOptimizer.printReport();
+    }
+
+    // Folds operators whose operands are all constant and propagates constants
+    // through temps and through variables within straight-line code. Constant
+    // agar branches become a goto or disappear, and temps that end up unused
+    // are dropped.
+    int constantFolding() {
+        vector<Quad> &code = icg.instructions;
+        size_t before = code.size();
+        vector<ConstValue> tempValue(icg.tempCount);
+        vector<bool> tempKnown(icg.tempCount, false);
+        unordered_map<int, ConstValue> varValue;      // Variables known on the current path
+
+        auto known = [&](const Operand &o, ConstValue &value) {
+            if (o.kind == OP_IMM) {
+                value = ConstValue::parse(icg.literals[o.id]);
+                return true;
+            }
+            if (o.kind == OP_TEMP && tempKnown[o.id]) {
+                value = tempValue[o.id];
+                return true;
+            }
+            if (o.kind == OP_VAR) {
+                auto it = varValue.find(o.id);
+                if (it != varValue.end()) {
+                    value = it->second;
+                    return true;
+                }
+            }
+            return false;
+        };
+        auto substitute = [&](Operand &o) {
+            ConstValue value;
+            if (o.kind != OP_IMM && known(o, value)) o = icg.imm(value.toLiteral());
+        };
+
+        size_t out = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            Quad q = code[i];
+            switch (q.op) {
+                case TAC_LABEL:
+                case TAC_FUNC:
+                case TAC_CALL:      // A callee may assign any global
+                    varValue.clear();
+                    break;
+                case TAC_PRINT:
+                case TAC_WAPSI:
+                    substitute(q.a);
+                    break;
+                case TAC_AGAR: {
+                    ConstValue cond;
+                    if (known(q.a, cond)) {
+                        if (!cond.truthy()) continue;       // Never taken
+                        q = Quad{TAC_GOTO, Operand(), q.b, Operand()};
+                    }
+                    break;
+                }
+                case TAC_AGAR_LT:
+                case TAC_AGAR_LE:
+                case TAC_AGAR_GT:
+                case TAC_AGAR_GE:
+                case TAC_AGAR_EQ:
+                case TAC_AGAR_NEQ: {
+                    substitute(q.a);
+                    substitute(q.b);
+                    ConstValue a, b, taken;
+                    if (known(q.a, a) && known(q.b, b) && foldBinary(relationOf(q.op), a, b, taken)) {
+                        if (!taken.truthy()) continue;
+                        q = Quad{TAC_GOTO, Operand(), q.dst, Operand()};
+                    }
+                    break;
+                }
+                case TAC_ASSIGN: {
+                    substitute(q.a);
+                    ConstValue value;
+                    bool isConst = known(q.a, value);
+                    if (q.dst.kind == OP_TEMP) {
+                        tempKnown[q.dst.id] = isConst;
+                        tempValue[q.dst.id] = value;
+                    } else if (isConst) {
+                        varValue[q.dst.id] = value.convertTo(icg.varType(q.dst));
+                    } else {
+                        varValue.erase(q.dst.id);
+                    }
+                    break;
+                }
+                default:
+                    if (isBinaryOp(q.op)) {
+                        substitute(q.a);
+                        substitute(q.b);
+                        ConstValue a, b, result;
+                        if (known(q.a, a) && known(q.b, b) && foldBinary(q.op, a, b, result)) {
+                            q = Quad{TAC_ASSIGN, q.dst, icg.imm(result.toLiteral()), Operand()};
+                            tempKnown[q.dst.id] = true;
+                            tempValue[q.dst.id] = result;
+                        }
+                    }
+                    break;
+            }
+            code[out++] = q;
+        }
+        code.resize(out);
+
+        // Temps that now hold a constant were substituted at every use
+        vector<int> uses = countTempUses();
+        code.erase(remove_if(code.begin(), code.end(), [&](const Quad &q) {
+            return q.op == TAC_ASSIGN && q.dst.kind == OP_TEMP && q.a.kind == OP_IMM && uses[q.dst.id] == 0;
+        }), code.end());
+        return (int)(before - code.size());
+    }
+
+    // Removes code that no path reaches, labels nobody jumps to, jumps to the
+    // very next instruction and temps that are never read. Each of these can
+    // expose more of the others, so it repeats until nothing changes.
+    int deadCodeElimination() {
+        vector<Quad> &code = icg.instructions;
+        size_t before = code.size();
+        bool changed = true;
+        while (changed) {
+            changed = removeUnreachable();
+            changed |= removeRedundantJumps();
+            changed |= removeUnusedLabels();
+            changed |= removeDeadTemps();
+        }
+        return (int)(before - code.size());
+    }
+
+    // Drops computations that repeat one on every path to them (see
+    // ValueNumbering), then whatever that leaves dead.
+    int globalValueNumbering() {
+        size_t before = icg.instructions.size();
+        vector<Quad> code;
+        code.reserve(before);
+        ValueNumbering numbering(icg);
+        for (const pair<size_t, size_t> &range : ControlFlowGraph::functionRanges(icg.instructions)) {
+            numbering.run(range.first, range.second, code);
+        }
+        icg.instructions.swap(code);
+        // Operands that turned out constant can fold now
+        constantFolding();
+        deadCodeElimination();
+        return (int)before - (int)icg.instructions.size();
+    }
+
+    // Replaces calls to small functions by their body (see Inliner).
+    void inlineFunctions() {
+        inliner.run();
+        functionsInlined = true;
+    }
+
+    // Replaces counted loops by copies of their body (see LoopUnroller).
+    void unrollLoops() {
+        vector<Quad> code;
+        code.reserve(icg.instructions.size());
+        for (const pair<size_t, size_t> &range : ControlFlowGraph::functionRanges(icg.instructions)) {
+            unroller.run(range.first, range.second, unrollFactor, code);
+        }
+        icg.instructions.swap(code);
+        loopsUnrolled = true;
+    }
+
+    // Moves invariant computations out of loops and turns multiplications
+    // of induction variables into additions (see LoopOptimizer).
+    void loopOptimization() {
+        vector<Quad> code;
+        code.reserve(icg.instructions.size());
+        for (const pair<size_t, size_t> &range : ControlFlowGraph::functionRanges(icg.instructions)) {
+            loopOptimizer.run(range.first, range.second, code);
+        }
+        icg.instructions.swap(code);
+        loopsOptimized = true;
+        // Start values of the new locals are often constant
+        constantFolding();
+        deadCodeElimination();
+    }
+
+private:
+    IntermediateCodeGnerator &icg;
+    vector<pair<string, int>> report;
+    Inliner inliner;
+    LoopUnroller unroller;
+    LoopOptimizer loopOptimizer;
+    bool functionsInlined = false, loopsUnrolled = false, loopsOptimized = false;
+
+    // Keeps only the quads for which keep(index) holds; true if any were dropped.
+    template <typename Pred>
+    bool retain(Pred keep) {
+        vector<Quad> &code = icg.instructions;
+        size_t out = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (keep(i)) code[out++] = code[i];
+        }
+        bool changed = out != code.size();
+        code.resize(out);
+        return changed;
+    }
+
+    // Marks everything reachable from the start of the program and from each
+    // function entry by following fall-through and jump edges.
+    bool removeUnreachable() {
+        const vector<Quad> &code = icg.instructions;
+        unordered_map<int, size_t> labelAt;
+        vector<size_t> work;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (code[i].op == TAC_LABEL) labelAt[code[i].a.id] = i;
+            if (code[i].op == TAC_FUNC) work.push_back(i);
+        }
+        if (!code.empty()) work.push_back(0);
+
+        vector<bool> reached(code.size(), false);
+        while (!work.empty()) {
+            size_t i = work.back();
+            work.pop_back();
+            // Walk the straight-line run, queueing branch targets on the way
+            for (; i < code.size() && !reached[i]; i++) {
+                reached[i] = true;
+                const Quad &q = code[i];
+                Operand target = jumpTarget(q);
+                if (target.kind == OP_LABEL) work.push_back(labelAt.at(target.id));
+                if (q.op == TAC_GOTO) break;
+                if (q.op == TAC_RET || q.op == TAC_WAPSI) break;
+            }
+        }
+        return retain([&](size_t i) { return reached[i]; });
+    }
+
+    // A goto or agar whose target label sits right after it (possibly behind
+    // other labels) is a no-op.
+    bool removeRedundantJumps() {
+        const vector<Quad> &code = icg.instructions;
+        return retain([&](size_t i) {
+            Operand target = jumpTarget(code[i]);
+            if (target.kind != OP_LABEL) return true;
+            for (size_t j = i + 1; j < code.size() && code[j].op == TAC_LABEL; j++) {
+                if (code[j].a == target) return false;
+            }
+            return true;
+        });
+    }
+
+    bool removeUnusedLabels() {
+        const vector<Quad> &code = icg.instructions;
+        vector<bool> used(icg.lblCount + 1, false);
+        for (const Quad &q : code) {
+            Operand target = jumpTarget(q);
+            if (target.kind == OP_LABEL) used[target.id] = true;
+        }
+        return retain([&](size_t i) { return code[i].op != TAC_LABEL || used[code[i].a.id]; });
+    }
+
+    // Temps have no side effects, so one that is never read need not be computed.
+    bool removeDeadTemps() {
+        const vector<Quad> &code = icg.instructions;
+        vector<int> uses = countTempUses();
+        return retain([&](size_t i) { return code[i].dst.kind != OP_TEMP || uses[code[i].dst.id] > 0; });
+    }
+
+    void record(const string &pass, int removed) {
+        report.push_back(make_pair(pass, removed));
+    }
+
+    // Runs passes on a TacOptimizer of its own for each function (and the
+    // top-level code), lifted out of the program by FunctionSlice, with
+    // threads of them at a time. The program is then put back together in
+    // source order, so the result does not depend on the thread count, and
+    // the reports of the functions are added up.
+    template <typename Passes>
+    void optimizeFunctions(const Passes &passes) {
+        vector<pair<size_t, size_t>> ranges = ControlFlowGraph::functionRanges(icg.instructions);
+        vector<FunctionSlice> slices(ranges.size());
+        vector<unique_ptr<TacOptimizer>> functions(ranges.size());
+        WorkStealingPool pool(threads);
+        pool.run(ranges.size(), [&](size_t f, unsigned) {
+            slices[f].lift(icg, ranges[f].first, ranges[f].second);
+            functions[f].reset(new TacOptimizer(slices[f].icg));
+            functions[f]->unrollFactor = unrollFactor;
+            passes(*functions[f]);
+        });
+
+        size_t size = 0;
+        for (const FunctionSlice &slice : slices) size += slice.icg.instructions.size();
+        icg.instructions.clear();
+        icg.instructions.reserve(size);
+        icg.tempCount = 0;
+        icg.lblCount = 1;
+        for (size_t f = 0; f < slices.size(); f++) {
+            slices[f].mergeInto(icg);
+            const TacOptimizer &function = *functions[f];
+            for (const pair<string, int> &entry : function.report) {
+                auto it = find_if(report.begin(), report.end(),
+                                  [&](const pair<string, int> &e) { return e.first == entry.first; });
+                if (it == report.end()) report.push_back(entry);
+                else it->second += entry.second;
+            }
+            unroller.fullyUnrolled += function.unroller.fullyUnrolled;
+            unroller.partlyUnrolled += function.unroller.partlyUnrolled;
+            loopsUnrolled |= function.loopsUnrolled;
+            loopsOptimized |= function.loopsOptimized;
+            for (LoopOptimizer::LoopReport loop : function.loopOptimizer.loops) {
+                loop.header = slices[f].programLabel(loop.header);
+                loopOptimizer.loops.push_back(loop);
+            }
+        }
+    }
+
+    vector<int> countTempUses() const {
+        vector<int> uses(icg.tempCount, 0);
+        for (const Quad &q : icg.instructions) {
+            if (q.a.kind == OP_TEMP) uses[q.a.id]++;
+            if (q.b.kind == OP_TEMP) uses[q.b.id]++;
+        }
+        return uses;
+    }
+};
+
+// Register-machine bytecode for --run, compiled from the optimized TAC.
+//
+// An instruction is an opcode and four 32-bit operands. A value operand
+// >= 0 is a register of the current frame: every temp of a function gets
+// one, so a call never disturbs its caller's temps. A negative operand is a
+// constant or a variable; those live outside the frames, the way the
+// assembly keeps variables in memory. Jumps hold instruction indexes and
+// CALL the callee's index in functions. The superinstructions at the end do
+// the work of a run of quads that lowered code is full of in one dispatch:
+// an arithmetic operation with the store of its result into a variable, and
+// the increment at the bottom of a loop with its compare and branch.
+#define VM_OPCODES(X) \
+    X(MOVE) X(STORE_INT) X(STORE_BOOL) X(STORE_DOUBLE) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(LT) X(LE) X(GT) X(GE) X(EQ) X(NEQ) X(AND) X(OR) \
+    X(JUMP) X(JUMP_IF) X(BR_LT) X(BR_LE) X(BR_GT) X(BR_GE) X(BR_EQ) X(BR_NEQ) \
+    X(CALL) X(RET) X(RETURN) X(PRINT) X(PRINT_STR) X(HALT) \
+    X(ADD_STORE_INT) X(SUB_STORE_INT) X(MUL_STORE_INT) X(DIV_STORE_INT) \
+    X(ADD_STORE_DOUBLE) X(SUB_STORE_DOUBLE) X(MUL_STORE_DOUBLE) X(DIV_STORE_DOUBLE) \
+    X(INC_BR_LT) X(INC_BR_LE) X(INC_BR_GT) X(INC_BR_GE) X(INC_BR_EQ) X(INC_BR_NEQ)
+
+// Arithmetic, relations and branches are in the order of their TacOp.
+enum VmOp : uint8_t {
+#define VM_ENUM(name) VM_##name,
+    VM_OPCODES(VM_ENUM)
+#undef VM_ENUM
+    VM_OP_COUNT
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO 1
+#define VM_INLINE inline __attribute__((always_inline))    // Keeps the handlers free of calls
+#else
+#define VM_COMPUTED_GOTO 0
+#define VM_INLINE inline
+#endif
+
+struct VmValue {
+    union {
+        int64_t i;
+        double d;
+    };
+    bool isDouble;
+
+    bool truthy() const { return isDouble ? d != 0 : i != 0; }
+    double asDouble() const { return isDouble ? d : (double)i; }
+};
+
+struct VmInstr {
+    const void *handler;        // Code of the opcode, for direct-threaded dispatch
+    VmOp op;
+    int32_t dst, a, b, c;
+};
+
+struct BytecodeProgram {
+    struct Function {
+        string name;
+        int32_t entry;
+        int32_t registers;          // Frame size
+    };
+    vector<VmInstr> code;
+    vector<Function> functions;     // functions[0] is the top-level code, which then calls main
+    vector<VmValue> statics;        // Constants and variables; operand k - statics.size() is statics[k]
+    vector<string> strings;
+    int superinstructions = 0;
+};
+
+// Compiles the TAC into a BytecodeProgram.
+class BytecodeCompiler {
+public:
+    string error;
+
+    BytecodeCompiler(const IntermediateCodeGnerator &icg, bool superinstructions)
+        : icg(icg), fuse(superinstructions) {}
+
+    // False, with error set, if a call names a function that does not exist.
+    bool compile(BytecodeProgram &program) {
+        const vector<Quad> &code = icg.instructions;
+        out = &program;
+        program.strings = icg.strings;
+        allocateStatics();
+        tempUses.assign(icg.tempCount, 0);
+        for (const Quad &q : code) {
+            for (const Operand *o : {&q.a, &q.b}) {
+                if (o->kind == OP_TEMP) tempUses[o->id]++;
+            }
+        }
+        tempReg.assign(icg.tempCount, -1);
+        labelPc.assign(icg.lblCount + 1, -1);
+        functionIndex.assign(icg.names.size(), -1);
+
+        vector<pair<size_t, size_t>> ranges = ControlFlowGraph::functionRanges(code);
+        size_t first = 0;
+        program.functions.push_back(BytecodeProgram::Function{"(top level)", 0, 0});
+        if (!code.empty() && code[0].op != TAC_FUNC) {
+            compileRange(ranges[0].first, ranges[0].second, 0);
+            first = 1;
+        }
+        int mainName = -1;
+        for (size_t n = 0; n < icg.names.size(); n++) {
+            if (icg.names[n] == "main_func") mainName = (int)n;
+        }
+        if (mainName >= 0) {
+            callFixups.push_back(make_pair(program.code.size(), mainName));
+            emit(VM_CALL, 0, 0, 0, 0);
+        }
+        emit(VM_HALT, 0, 0, 0, 0);
+        for (size_t r = first; r < ranges.size(); r++) {
+            const Quad &head = code[ranges[r].first];
+            functionIndex[head.a.id] = (int)program.functions.size();
+            program.functions.push_back(BytecodeProgram::Function{icg.names[head.a.id], (int32_t)program.code.size(), 0});
+            compileRange(ranges[r].first, ranges[r].second, (int)program.functions.size() - 1);
+        }
+
+        for (const pair<size_t, int> &fixup : labelFixups) program.code[fixup.first].c = labelPc[fixup.second];
+        for (const pair<size_t, int> &fixup : callFixups) {
+            int callee = functionIndex[fixup.second];
+            if (callee < 0) {
+                error = "Undefined function: " + icg.names[fixup.second];
+                return false;
+            }
+            program.code[fixup.first].c = callee;
+        }
+        return true;
+    }
+
+private:
+    const IntermediateCodeGnerator &icg;
+    bool fuse;
+    BytecodeProgram *out = nullptr;
+    vector<int> varSlot, literalSlot, negatedSlot;  // Static slot per variable and literal
+    vector<int> tempUses, tempReg;
+    vector<int> labelPc, functionIndex;
+    vector<pair<size_t, int>> labelFixups, callFixups;  // (instruction, label or function name)
+    int registers = 0;                              // Of the function being compiled
+    int scratch = -1;
+
+    static VmValue valueOf(const ConstValue &c) {
+        VmValue v;
+        v.isDouble = c.isDouble;
+        if (c.isDouble) v.d = c.d;
+        else v.i = c.i;
+        return v;
+    }
+
+    // Variables start as zero of their type; literals are parsed once. With
+    // superinstructions on, i = i - c also needs -c to count down by.
+    void allocateStatics() {
+        vector<VmValue> &statics = out->statics;
+        varSlot.assign(icg.names.size(), -1);
+        literalSlot.assign(icg.literals.size(), -1);
+        negatedSlot.assign(icg.literals.size(), -1);
+        for (const Quad &q : icg.instructions) {
+            for (const Operand *o : {&q.dst, &q.a, &q.b}) {
+                if (o->kind == OP_VAR && varSlot[o->id] < 0) {
+                    varSlot[o->id] = (int)statics.size();
+                    statics.push_back(valueOf(ConstValue::ofInt(0).convertTo(icg.varType(*o))));
+                } else if (o->kind == OP_IMM && literalSlot[o->id] < 0) {
+                    literalSlot[o->id] = (int)statics.size();
+                    statics.push_back(valueOf(ConstValue::parse(icg.literals[o->id])));
+                }
+            }
+            if (fuse && q.op == TAC_SUB && intLiteral(q.b) && negatedSlot[q.b.id] < 0) {
+                negatedSlot[q.b.id] = (int)statics.size();
+                VmValue negated = valueOf(ConstValue::parse(icg.literals[q.b.id]));
+                negated.i = (int64_t)(0 - (uint64_t)negated.i);
+                statics.push_back(negated);
+            }
+        }
+    }
+
+    bool intLiteral(const Operand &o) const {
+        return o.kind == OP_IMM && !ConstValue::parse(icg.literals[o.id]).isDouble;
+    }
+
+    bool intTyped(const Operand &o) const {
+        if (o.kind == OP_IMM) return intLiteral(o);
+        return o.kind == OP_VAR && (icg.varType(o) == TYPE_INT || icg.varType(o) == TYPE_BOOL);
+    }
+
+    int32_t staticOperand(int slot) const { return slot - (int32_t)out->statics.size(); }
+
+    int32_t operand(const Operand &o) {
+        switch (o.kind) {
+            case OP_TEMP:
+                if (tempReg[o.id] < 0) tempReg[o.id] = registers++;
+                return tempReg[o.id];
+            case OP_VAR: return staticOperand(varSlot[o.id]);
+            case OP_IMM: return staticOperand(literalSlot[o.id]);
+            default: return 0;
+        }
+    }
+
+    void emit(VmOp op, int32_t dst, int32_t a, int32_t b, int32_t c) {
+        out->code.push_back(VmInstr{nullptr, op, dst, a, b, c});
+    }
+
+    void emitJump(VmOp op, int32_t dst, int32_t a, int32_t b, const Operand &label) {
+        labelFixups.push_back(make_pair(out->code.size(), label.id));
+        emit(op, dst, a, b, 0);
+    }
+
+    static VmOp storeOp(VarType type) {
+        switch (type) {
+            case TYPE_FLOAT:
+            case TYPE_DOUBLE: return VM_STORE_DOUBLE;
+            case TYPE_BOOL: return VM_STORE_BOOL;
+            default: return VM_STORE_INT;
+        }
+    }
+
+    void compileRange(size_t begin, size_t end, int function) {
+        const vector<Quad> &code = icg.instructions;
+        registers = 0;
+        scratch = -1;
+        for (size_t i = begin; i < end; i++) {
+            const Quad &q = code[i];
+            if (q.op != TAC_FUNC) i += compileQuad(i, end);
+        }
+        if (function > 0 && begin < end && ControlFlowGraph::fallsThrough(code[end - 1])) emit(VM_RET, 0, 0, 0, 0);
+        for (size_t i = begin; i < end; i++) {
+            for (const Operand *o : {&code[i].dst, &code[i].a, &code[i].b}) {
+                if (o->kind == OP_TEMP) tempReg[o->id] = -1;
+            }
+        }
+        out->functions[function].registers = registers;
+    }
+
+    // Emits quad i, or a superinstruction starting there; returns how many
+    // quads after i it covered as well.
+    int compileQuad(size_t i, size_t end) {
+        const Quad &q = icg.instructions[i];
+        switch (q.op) {
+            case TAC_LABEL:
+                labelPc[q.a.id] = (int)out->code.size();
+                return 0;
+            case TAC_ASSIGN:
+                if (q.dst.kind == OP_TEMP) emit(VM_MOVE, operand(q.dst), operand(q.a), 0, 0);
+                else emit(storeOp(icg.varType(q.dst)), operand(q.dst), operand(q.a), 0, 0);
+                return 0;
+            case TAC_GOTO:
+                emitJump(VM_JUMP, 0, 0, 0, q.a);
+                return 0;
+            case TAC_AGAR:
+                emitJump(VM_JUMP_IF, 0, operand(q.a), 0, q.b);
+                return 0;
+            case TAC_CALL:
+                callFixups.push_back(make_pair(out->code.size(), q.a.id));
+                emit(VM_CALL, 0, 0, 0, 0);
+                return 0;
+            case TAC_RET:
+                emit(VM_RET, 0, 0, 0, 0);
+                return 0;
+            case TAC_WAPSI:
+                if (q.a.kind == OP_NONE) emit(VM_RET, 0, 0, 0, 0);
+                else emit(VM_RETURN, 0, operand(q.a), 0, 0);
+                return 0;
+            case TAC_PRINT:
+                if (q.a.kind == OP_STR) emit(VM_PRINT_STR, 0, 0, 0, q.a.id);
+                else emit(VM_PRINT, 0, operand(q.a), 0, 0);
+                return 0;
+            default:
+                break;
+        }
+        if (isCompareBranch(q.op)) {
+            emitJump(VmOp(VM_BR_LT + (q.op - TAC_AGAR_LT)), 0, operand(q.a), operand(q.b), q.dst);
+            return 0;
+        }
+        if (fuse && q.dst.kind == OP_TEMP && i + 1 < end) {
+            int covered = compileFused(i, end);
+            if (covered > 0) {
+                out->superinstructions++;
+                return covered;
+            }
+        }
+        VmOp op = VmOp(VM_ADD + (q.op - TAC_ADD));
+        if (q.dst.kind == OP_TEMP) {
+            emit(op, operand(q.dst), operand(q.a), operand(q.b), 0);
+        } else {
+            // Only temps are computed into in lowered code, but keep the conversion right regardless
+            if (scratch < 0) scratch = registers++;
+            emit(op, scratch, operand(q.a), operand(q.b), 0);
+            emit(storeOp(icg.varType(q.dst)), operand(q.dst), scratch, 0, 0);
+        }
+        return 0;
+    }
+
+    // t = a op b; x = t becomes one op-and-store, and when that is the
+    // increment t = x + c of an int followed by a branch on x or t (and t
+    // is used nowhere else), one increment-compare-and-branch.
+    int compileFused(size_t i, size_t end) {
+        const Quad &q = icg.instructions[i], &store = icg.instructions[i + 1];
+        if (q.op > TAC_DIV || store.op != TAC_ASSIGN || store.a != q.dst || store.dst.kind != OP_VAR) return 0;
+        Operand t = q.dst, x = store.dst;
+        VarType type = icg.varType(x);
+
+        if (type == TYPE_INT && i + 2 < end && isCompareBranch(icg.instructions[i + 2].op)) {
+            const Quad &branch = icg.instructions[i + 2];
+            int32_t step = 0;
+            bool counts = true;
+            if (q.op == TAC_ADD && q.a == x && intTyped(q.b)) step = operand(q.b);
+            else if (q.op == TAC_ADD && q.b == x && intTyped(q.a)) step = operand(q.a);
+            else if (q.op == TAC_SUB && q.a == x && intLiteral(q.b)) step = staticOperand(negatedSlot[q.b.id]);
+            else counts = false;
+            TacOp relation = relationOf(branch.op);
+            Operand bound = branch.b;
+            if (branch.b == t || branch.b == x) {
+                bound = branch.a;
+                relation = relation == TAC_LT ? TAC_GT : relation == TAC_GT ? TAC_LT
+                         : relation == TAC_LE ? TAC_GE : relation == TAC_GE ? TAC_LE : relation;
+            }
+            bool tested = bound == branch.b ? (branch.a == t || branch.a == x) : true;
+            int uses = 1 + (branch.a == t) + (branch.b == t);
+            if (counts && tested && bound != t && tempUses[t.id] == uses) {
+                emitJump(VmOp(VM_INC_BR_LT + (relation - TAC_LT)), operand(x), step, operand(bound), branch.dst);
+                return 2;
+            }
+        }
+        if (type == TYPE_BOOL) return 0;
+        VmOp op = VmOp((type == TYPE_INT ? VM_ADD_STORE_INT : VM_ADD_STORE_DOUBLE) + (q.op - TAC_ADD));
+        emit(op, operand(t), operand(q.a), operand(q.b), operand(x));
+        return 1;
+    }
+};
+
+// Runs a BytecodeProgram. The dispatch loop is written once; switch
+// dispatch jumps through one shared switch, token threading through a
+// table indexed by the opcode at the end of every handler, and direct
+// threading straight to the handler address stored in the instruction.
+// The threaded forms need computed goto (GCC, Clang).
+class VirtualMachine {
+public:
+    enum Dispatch { DISPATCH_SWITCH, DISPATCH_TOKEN, DISPATCH_DIRECT };
+    static const size_t MAX_CALL_DEPTH = 10000;
+
+    bool quiet = false;             // Drop the program's output (for benchmarks)
+    uint64_t executed = 0;          // Instructions dispatched by the last run
+    string error;                   // Runtime error that stopped the last run
+
+    explicit VirtualMachine(const BytecodeProgram &program) : program(program) {}
+
+    static const char *dispatchName(Dispatch dispatch) {
+        static const char *const names[] = {"switch", "token", "direct"};
+        return names[dispatch];
+    }
+
+    static bool parseDispatch(const string &name, Dispatch &dispatch) {
+        for (int d = DISPATCH_SWITCH; d <= DISPATCH_DIRECT; d++) {
+            if (name == dispatchName(Dispatch(d)) && (d == DISPATCH_SWITCH || VM_COMPUTED_GOTO)) {
+                dispatch = Dispatch(d);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static Dispatch defaultDispatch() { return VM_COMPUTED_GOTO ? DISPATCH_DIRECT : DISPATCH_SWITCH; }
+
+    // Runs the program from the top-level code; returns main's wapsi value,
+    // or -1 after a runtime error.
+    int run(Dispatch dispatch) {
+        code = program.code;
+        memory = program.statics;
+        registers.assign(1024, VmValue());
+        calls.clear();
+        output.clear();
+        error.clear();
+        executed = 0;
+        int status;
+        switch (dispatch) {
+            case DISPATCH_TOKEN: status = execute<DISPATCH_TOKEN>(); break;
+            case DISPATCH_DIRECT: status = execute<DISPATCH_DIRECT>(); break;
+            default: status = execute<DISPATCH_SWITCH>(); break;
+        }
+        flush();
+        return status;
+    }
+
+private:
+    struct Frame {
+        const VmInstr *returnTo;
+        size_t base, size;          // Registers of the caller
+    };
+
+    const BytecodeProgram &program;
+    vector<VmInstr> code;           // Own copy, since direct threading writes the handlers in
+    vector<VmValue> memory;         // Statics, changed by the run
+    vector<VmValue> registers;
+    vector<Frame> calls;
+    string output;
+
+    void flush() {
+        if (!quiet) cout << output << std::flush;
+        output.clear();
+    }
+
+    void print(const VmValue &v) {
+        char text[32];
+        if (v.isDouble) snprintf(text, sizeof(text), "%g", v.d);
+        else snprintf(text, sizeof(text), "%lld", (long long)v.i);
+        print(text);
+    }
+
+    void print(const string &text) {
+        output += text;
+        output += '\n';
+        if (output.size() > (1 << 16)) flush();
+    }
+
+    // Arithmetic as ConstValue folds it: double if either side is, else
+    // int64 wrapping around. False on an integer division that would trap.
+    template <TacOp OP>
+    static VM_INLINE bool arithmetic(const VmValue &x, const VmValue &y, VmValue &r) {
+        if (x.isDouble | y.isDouble) {
+            double p = x.asDouble(), q = y.asDouble();
+            r.d = OP == TAC_ADD ? p + q : OP == TAC_SUB ? p - q : OP == TAC_MUL ? p * q : p / q;
+            r.isDouble = true;
+            return true;
+        }
+        int64_t p = x.i, q = y.i;
+        if (OP == TAC_DIV) {
+            if (q == 0 || (p == INT64_MIN && q == -1)) return false;
+            r.i = p / q;
+        } else {
+            uint64_t u = (uint64_t)p, v = (uint64_t)q;
+            r.i = (int64_t)(OP == TAC_ADD ? u + v : OP == TAC_SUB ? u - v : u * v);
+        }
+        r.isDouble = false;
+        return true;
+    }
+
+    template <TacOp OP>
+    static VM_INLINE bool compare(const VmValue &x, const VmValue &y) {
+        if (x.isDouble | y.isDouble) {
+            double p = x.asDouble(), q = y.asDouble();
+            return OP == TAC_LT ? p < q : OP == TAC_LE ? p <= q : OP == TAC_GT ? p > q
+                 : OP == TAC_GE ? p >= q : OP == TAC_EQ ? p == q : p != q;
+        }
+        int64_t p = x.i, q = y.i;
+        return OP == TAC_LT ? p < q : OP == TAC_LE ? p <= q : OP == TAC_GT ? p > q
+             : OP == TAC_GE ? p >= q : OP == TAC_EQ ? p == q : p != q;
+    }
+
+    static VM_INLINE void storeInt(VmValue &r, const VmValue &x) {
+        r.i = x.isDouble ? (int64_t)x.d : x.i;
+        r.isDouble = false;
+    }
+
+    static VM_INLINE void storeDouble(VmValue &r, const VmValue &x) {
+        r.d = x.asDouble();
+        r.isDouble = true;
+    }
+
+    template <Dispatch D>
+    int execute() {
+#if VM_COMPUTED_GOTO
+        static const void *const handlers[VM_OP_COUNT] = {
+#define VM_ADDRESS(name) &&op_##name,
+            VM_OPCODES(VM_ADDRESS)
+#undef VM_ADDRESS
+        };
+        if (D == DISPATCH_DIRECT) {
+            for (VmInstr &instr : code) instr.handler = handlers[instr.op];
+        }
+#define VM_NEXT()                                                   \
+    do {                                                            \
+        dispatched++;                                               \
+        if (D == DISPATCH_DIRECT) goto *ip->handler;                \
+        if (D == DISPATCH_TOKEN) goto *handlers[ip->op];            \
+        goto dispatch;                                              \
+    } while (0)
+#else
+#define VM_NEXT()                                                   \
+    do {                                                            \
+        dispatched++;                                               \
+        goto dispatch;                                              \
+    } while (0)
+#endif
+// Registers of the frame for operands >= 0, statics below zero
+#define VM_VALUE(o) ((o) < 0 ? top : regs)[o]
+#define VM_JUMP_TO(target) (ip = base + (target))
+
+        uint64_t dispatched = 0;    // Kept out of executed so it can stay in a register
+        const VmInstr *base = code.data(), *ip = base;
+        VmValue *top = memory.data() + memory.size();
+        size_t frame = 0, frameSize = program.functions[0].registers;
+        if (registers.size() < frameSize) registers.resize(frameSize);
+        VmValue *regs = registers.data();
+        VmValue result;
+        result.i = 0;
+        result.isDouble = false;
+        VM_NEXT();
+
+    dispatch:
+        switch (ip->op) {
+#define VM_CASE(name) case VM_##name: goto op_##name;
+            VM_OPCODES(VM_CASE)
+#undef VM_CASE
+            default: goto op_HALT;
+        }
+
+    op_MOVE:
+        VM_VALUE(ip->dst) = VM_VALUE(ip->a);
+        ip++;
+        VM_NEXT();
+    op_STORE_INT:
+        storeInt(VM_VALUE(ip->dst), VM_VALUE(ip->a));
+        ip++;
+        VM_NEXT();
+    op_STORE_BOOL: {
+        VmValue &r = VM_VALUE(ip->dst);
+        r.i = VM_VALUE(ip->a).truthy();
+        r.isDouble = false;
+        ip++;
+        VM_NEXT();
+    }
+    op_STORE_DOUBLE:
+        storeDouble(VM_VALUE(ip->dst), VM_VALUE(ip->a));
+        ip++;
+        VM_NEXT();
+
+#define VM_ARITHMETIC(name, OP)                                                         \
+    op_##name:                                                                          \
+        if (!arithmetic<OP>(VM_VALUE(ip->a), VM_VALUE(ip->b), VM_VALUE(ip->dst))) goto divideError; \
+        ip++;                                                                           \
+        VM_NEXT();                                                                      \
+    op_##name##_STORE_INT:                                                              \
+        if (!arithmetic<OP>(VM_VALUE(ip->a), VM_VALUE(ip->b), VM_VALUE(ip->dst))) goto divideError; \
+        storeInt(VM_VALUE(ip->c), VM_VALUE(ip->dst));                                   \
+        ip++;                                                                           \
+        VM_NEXT();                                                                      \
+    op_##name##_STORE_DOUBLE:                                                           \
+        if (!arithmetic<OP>(VM_VALUE(ip->a), VM_VALUE(ip->b), VM_VALUE(ip->dst))) goto divideError; \
+        storeDouble(VM_VALUE(ip->c), VM_VALUE(ip->dst));                                \
+        ip++;                                                                           \
+        VM_NEXT();
+        VM_ARITHMETIC(ADD, TAC_ADD)
+        VM_ARITHMETIC(SUB, TAC_SUB)
+        VM_ARITHMETIC(MUL, TAC_MUL)
+        VM_ARITHMETIC(DIV, TAC_DIV)
+#undef VM_ARITHMETIC
+
+#define VM_RELATION(name, OP)                                                           \
+    op_##name: {                                                                        \
+        VmValue &r = VM_VALUE(ip->dst);                                                 \
+        int64_t holds = compare<OP>(VM_VALUE(ip->a), VM_VALUE(ip->b));                  \
+        r.i = holds;                                                                    \
+        r.isDouble = false;                                                             \
+        ip++;                                                                           \
+        VM_NEXT();                                                                      \
+    }                                                                                   \
+    op_BR_##name:                                                                       \
+        if (compare<OP>(VM_VALUE(ip->a), VM_VALUE(ip->b))) VM_JUMP_TO(ip->c);           \
+        else ip++;                                                                      \
+        VM_NEXT();                                                                      \
+    op_INC_BR_##name: {                                                                 \
+        VmValue &x = VM_VALUE(ip->dst);                                                 \
+        x.i = (int64_t)((uint64_t)x.i + (uint64_t)VM_VALUE(ip->a).i);                   \
+        if (compare<OP>(x, VM_VALUE(ip->b))) VM_JUMP_TO(ip->c);                         \
+        else ip++;                                                                      \
+        VM_NEXT();                                                                      \
+    }
+        VM_RELATION(LT, TAC_LT)
+        VM_RELATION(LE, TAC_LE)
+        VM_RELATION(GT, TAC_GT)
+        VM_RELATION(GE, TAC_GE)
+        VM_RELATION(EQ, TAC_EQ)
+        VM_RELATION(NEQ, TAC_NEQ)
+#undef VM_RELATION
+
+    op_AND:
+    op_OR: {
+        bool x = VM_VALUE(ip->a).truthy(), y = VM_VALUE(ip->b).truthy();
+        VmValue &r = VM_VALUE(ip->dst);
+        r.i = ip->op == VM_AND ? x && y : x || y;
+        r.isDouble = false;
+        ip++;
+        VM_NEXT();
+    }
+    op_JUMP:
+        VM_JUMP_TO(ip->c);
+        VM_NEXT();
+    op_JUMP_IF:
+        if (VM_VALUE(ip->a).truthy()) VM_JUMP_TO(ip->c);
+        else ip++;
+        VM_NEXT();
+    op_CALL: {
+        if (calls.size() >= MAX_CALL_DEPTH) {
+            error = "call stack overflow";
+            executed = dispatched;
+            return -1;
+        }
+        calls.push_back(Frame{ip + 1, frame, frameSize});
+        const BytecodeProgram::Function &callee = program.functions[ip->c];
+        frame += frameSize;
+        frameSize = callee.registers;
+        if (registers.size() < frame + frameSize) registers.resize(2 * (frame + frameSize));
+        regs = registers.data() + frame;
+        VM_JUMP_TO(callee.entry);
+        VM_NEXT();
+    }
+    op_RETURN:
+        result = VM_VALUE(ip->a);
+        goto leave;
+    op_RET:
+        result.i = 0;
+        result.isDouble = false;
+    leave:
+        if (calls.empty()) goto op_HALT;
+        ip = calls.back().returnTo;
+        frame = calls.back().base;
+        frameSize = calls.back().size;
+        calls.pop_back();
+        regs = registers.data() + frame;
+        VM_NEXT();
+    op_PRINT:
+        print(VM_VALUE(ip->a));
+        ip++;
+        VM_NEXT();
+    op_PRINT_STR:
+        print(program.strings[ip->c]);
+        ip++;
+        VM_NEXT();
+    op_HALT:
+        executed = dispatched;
+        return (int)(result.isDouble ? (int64_t)result.d : result.i);
+
+    divideError:
+        error = "integer division by zero or overflow";
+        executed = dispatched;
+        return -1;
+#undef VM_NEXT
+#undef VM_VALUE
+#undef VM_JUMP_TO
+    }
+};
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#if JIT_SUPPORTED
+// In-memory x86-64 JIT for the listing AssemblyCodeGenerator produces (after
+// register allocation and the peephole pass), so --jit runs exactly the
+// instructions that would be written to output.asm. Each 16-bit register is
+// widened to its 64-bit counterpart and each [name] to an 8-byte slot in a
+// data area that follows the code and is addressed RIP-relative; names are
+// [tN] for temps and [v_name] for variables, so the two never share a slot. Jumps and
+// calls to Ln and *_func labels are fixed up once the listing is assembled.
+//
+// The runtime is two stubs for CALL PRINT, one for integers and one for
+// string literals; they take the value pushed before the call, pop it on
+// return and keep every register. The code starts at the top-level
+// statements, which call main_func where they would fall into the first
+// function.
+class JitCompiler {
+public:
+    string error;
+    size_t codeSize = 0;
+    size_t slots = 0;               // Variables and temps in the data area
+
+    explicit JitCompiler(const IntermediateCodeGnerator &icg) : icg(icg) {}
+    JitCompiler(const JitCompiler &) = delete;
+    JitCompiler &operator=(const JitCompiler &) = delete;
+
+    ~JitCompiler() {
+        if (memory) munmap(memory, mapped);
+    }
+
+    // False, with error set, on a value or instruction the JIT cannot encode.
+    bool compile(const vector<string> &listing) {
+        string floating = icg.floatingPointOperand();
+        if (!floating.empty()) {
+            error = "float and double values are not supported yet: " + floating;
+            return false;
+        }
+        bool hasMain = find(listing.begin(), listing.end(), "main_func:") != listing.end();
+
+        // Entry: keep the registers the C++ caller expects preserved
+        byte(0x53);                             // push rbx
+        byte(0x55);                             // push rbp
+        byte(0xE8);                             // call top-level code
+        int32(0);
+        byte(0x5D);                             // pop rbp
+        byte(0x5B);                             // pop rbx
+        byte(0xC3);                             // ret
+        printIntegerStub = code.size();
+        emitPrintStub(reinterpret_cast<uintptr_t>(&JitCompiler::printInteger));
+        printStringStub = code.size();
+        emitPrintStub(reinterpret_cast<uintptr_t>(&JitCompiler::printString));
+        patch(3, (int64_t)code.size() - 7);     // The call above lands here
 
-    void parseReturnStatement() {
-        expect(T_WAPSI); // 'wapsi' is the return keyword in your syntax
-        if (tokens[pos].type != T_SEMICOLON) {
-            string returnValue = parseExpression(); // Parse return expression
-            icg.addInstruction("wapsi " + returnValue);
+        bool topLevel = true;
+        for (const string &line : listing) {
+            if (line.empty()) continue;
+            if (line.back() == ':' && line.find(' ') == string::npos) {
+                string label = line.substr(0, line.size() - 1);
+                if (topLevel && label.size() > 5 && label.compare(label.size() - 5, 5, "_func") == 0) {
+                    endTopLevel(hasMain);
+                    topLevel = false;
+                }
+                labels[label] = code.size();
+                continue;
+            }
+            if (!assemble(line)) {
+                if (error.empty()) error = "cannot encode '" + line + "'";
+                return false;
+            }
+        }
+        if (topLevel) endTopLevel(hasMain);
+
+        for (const LabelFixup &fixup : labelFixups) {
+            auto it = labels.find(fixup.label);
+            if (it == labels.end()) {
+                error = "undefined label " + fixup.label;
+                return false;
+            }
+            patch(fixup.at, (int64_t)it->second - (int64_t)(fixup.at + 4));
+        }
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t codePages = (code.size() + page - 1) / page * page;
+        slots = slotOf.size();
+        for (const DataFixup &fixup : dataFixups) {
+            patch(fixup.at, (int64_t)(codePages + 8 * fixup.slot) - (int64_t)(fixup.at + 4 + fixup.trailing));
+        }
+        codeSize = code.size();
+        mapped = codePages + max<size_t>(8 * slots, 1);
+        void *block = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            error = "cannot map memory for the code";
+            return false;
+        }
+        memory = static_cast<uint8_t *>(block);
+        memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, codePages, PROT_READ | PROT_EXEC) != 0) {
+            error = "cannot make the code executable";
+            return false;
+        }
+        return true;
+    }
+
+    // Runs the compiled program; returns the value left in AX, which is
+    // main's wapsi value.
+    int64_t run() {
+        int64_t result = reinterpret_cast<int64_t (*)()>(memory)();
+        flush();
+        return result;
+    }
+
+private:
+    enum ArgKind : uint8_t { ARG_NONE, ARG_REG, ARG_BYTE, ARG_MEM, ARG_IMM, ARG_NAME };
+
+    struct Arg {
+        ArgKind kind = ARG_NONE;
+        int reg = 0;                // x86-64 register number, for ARG_REG and ARG_BYTE
+        int slot = 0;               // ARG_MEM
+        int64_t imm = 0;
+        string name;                // ARG_NAME: label, function or quoted string
+    };
+
+    struct LabelFixup {
+        size_t at;                  // rel32 to patch
+        string label;
+    };
+
+    struct DataFixup {
+        size_t at;                  // disp32 to patch
+        int slot;
+        int trailing;               // Immediate bytes after the displacement
+    };
+
+    static const int RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, R11 = 11;
+
+    const IntermediateCodeGnerator &icg;
+    vector<uint8_t> code;
+    unordered_map<string, size_t> labels;
+    unordered_map<string, int> slotOf;
+    vector<LabelFixup> labelFixups;
+    vector<DataFixup> dataFixups;
+    deque<string> strings;          // Printed literals; a deque keeps their addresses
+    size_t printIntegerStub = 0, printStringStub = 0;
+    bool pushedString = false;      // The last instruction pushed a string for PRINT
+    uint8_t *memory = nullptr;
+    size_t mapped = 0;
+    string output;
+
+    void write(const char *text) {
+        output += text;
+        output += '\n';
+        if (output.size() > (1 << 16)) flush();
+    }
+
+    void flush() {
+        cout << output << std::flush;
+        output.clear();
+    }
+
+    static void printInteger(int64_t value, JitCompiler *jit) {
+        char text[24];
+        snprintf(text, sizeof(text), "%lld", (long long)value);
+        jit->write(text);
+    }
+
+    static void printString(const char *text, JitCompiler *jit) { jit->write(text); }
+
+    void byte(uint8_t b) { code.push_back(b); }
+
+    void int32(int64_t v) {
+        for (int i = 0; i < 4; i++) byte(uint8_t(v >> (8 * i)));
+    }
+
+    void int64(uint64_t v) {
+        for (int i = 0; i < 8; i++) byte(uint8_t(v >> (8 * i)));
+    }
+
+    void patch(size_t at, int64_t v) {
+        for (int i = 0; i < 4; i++) code[at + i] = uint8_t(v >> (8 * i));
+    }
+
+    static bool fits8(int64_t v) { return v >= INT8_MIN && v <= INT8_MAX; }
+    static bool fits32(int64_t v) { return v >= INT32_MIN && v <= INT32_MAX; }
+
+    static Arg reg(int r) {
+        Arg a;
+        a.kind = ARG_REG;
+        a.reg = r;
+        return a;
+    }
+
+    // Saves the registers C++ may clobber, passes the pushed value and this
+    // to function on a 16-byte aligned stack, and pops the value on return.
+    void emitPrintStub(uintptr_t function) {
+        static const uint8_t save[] = {0x50, 0x51, 0x52, 0x56, 0x57, 0x41, 0x50, 0x41, 0x51, 0x41, 0x52, 0x41, 0x53};
+        static const uint8_t restore[] = {0x41, 0x5B, 0x41, 0x5A, 0x41, 0x59, 0x41, 0x58, 0x5F, 0x5E, 0x5A, 0x59, 0x58};
+        code.insert(code.end(), begin(save), end(save));
+        for (uint8_t b : {0x48, 0x8B, 0x7C, 0x24, 0x50}) byte(b);      // mov rdi, [rsp+80]
+        byte(0x48);                                                     // mov rsi, this
+        byte(0xBE);
+        int64(reinterpret_cast<uintptr_t>(this));
+        for (uint8_t b : {0x55, 0x48, 0x89, 0xE5, 0x48, 0x83, 0xE4, 0xF0}) byte(b);    // push rbp; mov rbp, rsp; and rsp, -16
+        byte(0x48);                                                     // mov rax, function
+        byte(0xB8);
+        int64(function);
+        for (uint8_t b : {0xFF, 0xD0, 0x48, 0x89, 0xEC, 0x5D}) byte(b);  // call rax; mov rsp, rbp; pop rbp
+        code.insert(code.end(), begin(restore), end(restore));
+        for (uint8_t b : {0xC2, 0x08, 0x00}) byte(b);                   // ret 8
+    }
+
+    // The result is 0 unless main returns something else, as on the VM.
+    void endTopLevel(bool hasMain) {
+        for (uint8_t b : {0x31, 0xC0}) byte(b);                         // xor eax, eax
+        if (hasMain) {
+            byte(0xE8);
+            labelFixups.push_back(LabelFixup{code.size(), "main_func"});
+            int32(0);
+        }
+        byte(0xC3);
+    }
+
+    // REX prefix, opcode and ModRM for an instruction whose r/m operand is
+    // a register or a data slot.
+    void encode(bool wide, initializer_list<uint8_t> opcode, int regField, const Arg &rm, int trailing = 0) {
+        int rmReg = rm.kind == ARG_MEM ? 0 : rm.reg;
+        uint8_t rex = 0x40 | (wide ? 8 : 0) | (regField >= 8 ? 4 : 0) | (rmReg >= 8 ? 1 : 0);
+        if (rex != 0x40) byte(rex);
+        for (uint8_t b : opcode) byte(b);
+        if (rm.kind == ARG_MEM) {
+            byte(uint8_t(0x05 | (regField & 7) << 3));
+            dataFixups.push_back(DataFixup{code.size(), rm.slot, trailing});
+            int32(0);
         } else {
-            icg.addInstruction("wapsi");
+            byte(uint8_t(0xC0 | (regField & 7) << 3 | (rmReg & 7)));
         }
-        expect(T_SEMICOLON); // Expect ';'
     }
 
-    string parseExpression() {
-        string term = parseTerm();
-        while (tokens[pos].type == T_PLUS || tokens[pos].type == T_MINUS) {
-            TokenType op = tokens[pos++].type;
-            string nextTerm = parseTerm(); 
-            string temp = icg.newTemp();  
-            icg.addInstruction(temp + " = " + term + (op == T_PLUS ? " + " : " - ") + nextTerm);
-            term = temp;
-        }
-        if (tokens[pos].type == T_GT || tokens[pos].type == T_LT || tokens[pos].type == T_AND || tokens[pos].type == T_OR ||
-             tokens[pos].type == T_EQ || tokens[pos].type == T_NEQ) {
-            TokenType operatorType = tokens[pos].type;
-            pos++; 
-            string nextExpr = parseExpression();
-            string operatorString;
-            switch (operatorType) {
-                case T_GT:
-                    operatorString = ">";
-                    break;
-                case T_LT:
-                    operatorString = "<";
-                    break;
-                case T_AND:
-                    operatorString = "&&";
-                    break;
-                case T_OR:
-                    operatorString = "||";
-                    break;
-                case T_EQ:
-                    operatorString = "==";
-                    break;
-                case T_NEQ:
-                    operatorString = "!=";
-                    break;
-                default:
-                    throw std::runtime_error("Unsupported operator in expression");
+    void moveImmediate(int r, int64_t value) {
+        if (fits32(value)) {
+            encode(true, {0xC7}, 0, reg(r), 4);
+            int32(value);
+        } else {
+            byte(r >= 8 ? 0x49 : 0x48);
+            byte(uint8_t(0xB8 | (r & 7)));
+            int64((uint64_t)value);
+        }
+    }
+
+    bool parseArg(string text, Arg &arg) {
+        while (!text.empty() && text.back() == ' ') text.pop_back();
+        if (text.compare(0, 5, "WORD ") == 0) text = text.substr(5);
+        static const char *const wordRegisters[] = {"AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI"};
+        static const char *const byteRegisters[] = {"AL", "CL", "DL", "BL"};
+        for (int r = 0; r < 8; r++) {
+            if (text == wordRegisters[r]) {
+                arg = reg(r);
+                return true;
+            }
+            if (r < 4 && text == byteRegisters[r]) {
+                arg.kind = ARG_BYTE;
+                arg.reg = r;
+                return true;
+            }
+        }
+        if (text.size() > 2 && text[0] == '[' && text.back() == ']') {
+            auto inserted = slotOf.emplace(text.substr(1, text.size() - 2), (int)slotOf.size());
+            arg.kind = ARG_MEM;
+            arg.slot = inserted.first->second;
+            return true;
+        }
+        if (!text.empty() && (isdigit((unsigned char)text[0]) || text[0] == '-')) {
+            char *end;
+            arg.imm = strtoll(text.c_str(), &end, 10);
+            if (*end) {
+                error = "cannot encode the constant " + text;
+                return false;
             }
+            arg.kind = ARG_IMM;
+            return true;
+        }
+        arg.kind = ARG_NAME;
+        arg.name = text;
+        return !text.empty();
+    }
 
-            string temp = icg.newTemp();
-            icg.addInstruction(temp + " = " + term + " " + operatorString + " " + nextExpr);
-            term = temp;
+    static int conditionCode(const string &cc) {
+        static const pair<const char *, int> codes[] = {{"E", 0x4}, {"NE", 0x5}, {"L", 0xC}, {"GE", 0xD}, {"LE", 0xE}, {"G", 0xF}};
+        for (const auto &code : codes) {
+            if (cc == code.first) return code.second;
         }
+        return -1;
+    }
 
-        return term;
+    void jump(initializer_list<uint8_t> opcode, const string &label) {
+        for (uint8_t b : opcode) byte(b);
+        labelFixups.push_back(LabelFixup{code.size(), label});
+        int32(0);
     }
 
-    string parseTerm() {
-        string factor = parseFactor();
-        while (tokens[pos].type == T_MUL || tokens[pos].type == T_DIV) {
-            TokenType op = tokens[pos++].type;
-            string nextFactor = parseFactor();
-            string temp = icg.newTemp(); 
-            icg.addInstruction(temp + " = " + factor + (op == T_MUL ? " * " : " / ") + nextFactor); 
-            factor = temp;
+    // x op= y for ADD, OR, AND, SUB, XOR and CMP; digit is the opcode
+    // extension of the immediate forms, opcode the r/m, reg form.
+    bool arithmetic(int digit, uint8_t opcode, const Arg &x, const Arg &y) {
+        if (x.kind == ARG_BYTE) {
+            if (y.kind == ARG_BYTE) encode(false, {uint8_t(opcode - 1)}, y.reg, x);
+            else if (y.kind == ARG_IMM && fits8(y.imm)) {
+                encode(false, {0x80}, digit, x, 1);
+                byte(uint8_t(y.imm));
+            } else return false;
+            return true;
         }
-        return factor;
+        if (x.kind != ARG_REG && x.kind != ARG_MEM) return false;
+        if (y.kind == ARG_REG) {
+            encode(true, {opcode}, y.reg, x);
+        } else if (y.kind == ARG_MEM && x.kind == ARG_REG) {
+            encode(true, {uint8_t(opcode + 2)}, x.reg, y);
+        } else if (y.kind == ARG_IMM && fits8(y.imm)) {
+            encode(true, {0x83}, digit, x, 1);
+            byte(uint8_t(y.imm));
+        } else if (y.kind == ARG_IMM && fits32(y.imm)) {
+            encode(true, {0x81}, digit, x, 4);
+            int32(y.imm);
+        } else if (y.kind == ARG_IMM) {
+            moveImmediate(R11, y.imm);
+            encode(true, {opcode}, R11, x);
+        } else {
+            return false;
+        }
+        return true;
     }
 
-    string parseFactor() {
-        if (tokens[pos].type == T_NUM) {
-            return tokens[pos++].value;
-        } else if (tokens[pos].type == T_ID) {
-            return tokens[pos++].value;
-        } else if (tokens[pos].type == T_LPAREN) {
-            expect(T_LPAREN);
-            string expr = parseExpression();
-            expect(T_RPAREN);
-            return expr;
+    bool move(const Arg &x, const Arg &y) {
+        if (x.kind == ARG_REG && (y.kind == ARG_REG || y.kind == ARG_MEM)) {
+            if (y.kind == ARG_REG) encode(true, {0x89}, y.reg, x);
+            else encode(true, {0x8B}, x.reg, y);
+        } else if (x.kind == ARG_MEM && y.kind == ARG_REG) {
+            encode(true, {0x89}, y.reg, x);
+        } else if (x.kind == ARG_REG && y.kind == ARG_IMM) {
+            moveImmediate(x.reg, y.imm);
+        } else if (x.kind == ARG_MEM && y.kind == ARG_IMM) {
+            if (fits32(y.imm)) {
+                encode(true, {0xC7}, 0, x, 4);
+                int32(y.imm);
+            } else {
+                moveImmediate(R11, y.imm);
+                encode(true, {0x89}, R11, x);
+            }
+        } else if (x.kind == ARG_MEM && y.kind == ARG_BYTE) {
+            // A flag is stored zero-extended so the whole slot reads as 0 or 1
+            encode(false, {0x0F, 0xB6}, y.reg, y);
+            encode(true, {0x89}, y.reg, x);
+        } else if (x.kind == ARG_BYTE && (y.kind == ARG_MEM || y.kind == ARG_REG)) {
+            if (y.kind == ARG_MEM) encode(false, {0x0F, 0xB6}, x.reg, y);
+            else encode(false, {0x89}, y.reg, reg(x.reg));
         } else {
-            cout << "Syntax error: unexpected token '" << tokens[pos].value << "' at line " << tokens[pos].line << endl;
-            exit(1);
+            return false;
         }
+        return true;
     }
 
-    void expect(TokenType type) {
-        if (tokens[pos].type == type) {
-            pos++;
+    bool assemble(const string &line) {
+        size_t space = line.find(' ');
+        string op = line.substr(0, space), operands = space == string::npos ? "" : line.substr(space + 1);
+        bool pushesString = false;
+        Arg x, y;
+        if (op == "PUSH" && !operands.empty() && operands[0] == '"') {
+            x.kind = ARG_NAME;
+            x.name = operands;
+        } else if (!operands.empty()) {
+            size_t comma = operands.find(',');
+            if (!parseArg(operands.substr(0, comma), x)) return false;
+            if (comma != string::npos) {
+                size_t from = operands.find_first_not_of(' ', comma + 1);
+                if (from == string::npos || !parseArg(operands.substr(from), y)) return false;
+            }
+        }
+
+        bool ok = true;
+        if (op == "MOV") ok = move(x, y);
+        else if (op == "ADD") ok = arithmetic(0, 0x01, x, y);
+        else if (op == "OR") ok = arithmetic(1, 0x09, x, y);
+        else if (op == "AND") ok = arithmetic(4, 0x21, x, y);
+        else if (op == "SUB") ok = arithmetic(5, 0x29, x, y);
+        else if (op == "XOR") ok = arithmetic(6, 0x31, x, y);
+        else if (op == "CMP") ok = arithmetic(7, 0x39, x, y);
+        else if (op == "IMUL" && x.kind == ARG_REG) {
+            if (y.kind == ARG_REG || y.kind == ARG_MEM) encode(true, {0x0F, 0xAF}, x.reg, y);
+            else if (y.kind == ARG_IMM && fits8(y.imm)) {
+                encode(true, {0x6B}, x.reg, x, 1);
+                byte(uint8_t(y.imm));
+            } else if (y.kind == ARG_IMM && fits32(y.imm)) {
+                encode(true, {0x69}, x.reg, x, 4);
+                int32(y.imm);
+            } else if (y.kind == ARG_IMM) {
+                moveImmediate(R11, y.imm);
+                encode(true, {0x0F, 0xAF}, x.reg, reg(R11));
+            } else ok = false;
+        }
+        else if (op == "MOVZX" && x.kind == ARG_REG && y.kind == ARG_BYTE) encode(false, {0x0F, 0xB6}, x.reg, y);
+        else if (op == "CWD") {
+            byte(0x48);                         // cqo
+            byte(0x99);
+        }
+        else if (op == "IDIV" && (x.kind == ARG_REG || x.kind == ARG_MEM)) encode(true, {0xF7}, 7, x);
+        else if (op.compare(0, 3, "SET") == 0 && x.kind == ARG_BYTE && conditionCode(op.substr(3)) >= 0) {
+            encode(false, {0x0F, uint8_t(0x90 | conditionCode(op.substr(3)))}, 0, x);
+        }
+        else if (op == "JMP" && x.kind == ARG_NAME) jump({0xE9}, x.name);
+        else if (op[0] == 'J' && x.kind == ARG_NAME && conditionCode(op.substr(1)) >= 0) {
+            jump({0x0F, uint8_t(0x80 | conditionCode(op.substr(1)))}, x.name);
+        }
+        else if (op == "CALL" && x.kind == ARG_NAME) {
+            if (x.name == "PRINT") {
+                byte(0xE8);
+                int32((int64_t)(pushedString ? printStringStub : printIntegerStub) - (int64_t)(code.size() + 4));
+            } else {
+                jump({0xE8}, x.name);
+            }
+        }
+        else if (op == "PUSH") {
+            if (x.kind == ARG_REG) byte(uint8_t(0x50 | x.reg));
+            else if (x.kind == ARG_MEM) encode(false, {0xFF}, 6, x);
+            else if (x.kind == ARG_IMM && fits32(x.imm)) {
+                byte(0x68);
+                int32(x.imm);
+            } else if (x.kind == ARG_IMM || (x.kind == ARG_NAME && x.name.size() >= 2 && x.name[0] == '"')) {
+                uintptr_t value = (uintptr_t)x.imm;
+                if (x.kind == ARG_NAME) {
+                    strings.push_back(x.name.substr(1, x.name.size() - 2));
+                    value = reinterpret_cast<uintptr_t>(strings.back().c_str());
+                    pushesString = true;
+                }
+                moveImmediate(R11, (int64_t)value);
+                byte(0x41);                     // push r11
+                byte(0x53);
+            } else ok = false;
+        }
+        else if (op == "POP" && x.kind == ARG_REG) byte(uint8_t(0x58 | x.reg));
+        else if (op == "LEA" && x.kind == ARG_REG && x.reg == RSP) {
+            // LEA SP, [BP-n] drops the n / 2 registers a function saved
+            size_t minus = operands.find("[BP-");
+            if (minus == string::npos) return false;
+            int64_t words = atoll(operands.c_str() + minus + 4) / 2;
+            if (words <= 0 || words > 16) return false;
+            for (uint8_t b : {0x48, 0x8D, 0x65}) byte(b);   // lea rsp, [rbp+disp8]
+            byte(uint8_t(-8 * words));
+        }
+        else if (op == "RET" && x.kind == ARG_NONE) byte(0xC3);
+        else ok = false;
+        pushedString = pushesString;
+        return ok;
+    }
+};
+#endif
+
+// Peak resident set size of this process in kilobytes, 0 if unknown.
+size_t peakMemoryKB() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize / 1024;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss / 1024;     // bytes on macOS
+#else
+    return (size_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+double elapsedMs(chrono::steady_clock::time_point since) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+}
+
+// Settings shared by every file of a batch, already resolved for the
+// optimization level.
+struct CompileOptions {
+    int optLevel = 0;
+    int unroll = 4;
+    bool x64 = false;
+    string peephole = "none";
+    string isel = "template";
+    const ScanKernels *scan = nullptr;
+};
+
+// Compiles one file of a batch to outputPath without printing anything. The
+// symbol table, TAC and code generators all belong to the job, so jobs can
+// run on different threads. Returns the diagnostic, empty on success.
+string compileJob(const string &sourcePath, const string &outputPath, const CompileOptions &options) {
+    try {
+        SourceFile file;
+        if (!file.open(sourcePath)) return "Error opening file.";
+        Lexer lexer(file.text(), options.scan);
+        TokenStream tokens(lexer);
+        SymbolTable symTable;
+        IntermediateCodeGnerator icg;
+        {
+            Arena arena;
+            Parser parser(tokens, file.text(), symTable, arena);
+            parser.quiet = true;
+            Stmt *program = parser.parseProgram();
+            Lowering lowering(icg, symTable);
+            lowering.lowerProgram(program);
+        }
+
+        TacOptimizer optimizer(icg);
+        optimizer.unrollFactor = options.unroll;
+        optimizer.optimize(options.optLevel);
+        RegisterAllocator allocator(icg);
+        if (options.optLevel > 0) allocator.run();
+        RegisterAllocator *registers = options.optLevel > 0 ? &allocator : nullptr;
+
+        bool saved;
+        if (options.x64) {
+            X64CodeGenerator codeGen;
+            codeGen.omitLeafFrames = options.optLevel > 0;
+            codeGen.treeSelection = options.isel == "tree";
+            codeGen.generateFromTAC(icg, registers);
+            PeepholeOptimizer peepholeOptimizer(codeGen.text);
+            peepholeOptimizer.select(options.peephole);
+            if (options.peephole != "none") peepholeOptimizer.run();
+            saved = codeGen.saveToFile(outputPath);
         } else {
-            cout << "Syntax error: expected " << tokenTypeToString(type) 
-                << " but found " << tokenTypeToString(tokens[pos].type)
-                << " at line " << tokens[pos].line << endl;
-            exit(1);
+            AssemblyCodeGenerator codeGen;
+            codeGen.omitLeafFrames = options.optLevel > 0;
+            codeGen.generateFromTAC(icg, registers);
+            PeepholeOptimizer peepholeOptimizer(codeGen.assemblyInstructions);
+            peepholeOptimizer.select(options.peephole);
+            if (options.peephole != "none") peepholeOptimizer.run();
+            saved = codeGen.saveToFile(outputPath);
         }
+        return saved ? "" : "Error opening file for writing: " + outputPath;
+    } catch (const CompileError &error) {
+        return error.what();
     }
-    string tokenTypeToString(TokenType type) {
-        switch (type) {
-            case T_FLOAT: return "float";
-            case T_DOUBLE: return "double";
-            case T_BOOL: return "bool";
-            case T_CHAR: return "char";
-            case T_STRING: return "string";
-            case T_JABTAK: return "jabtak";
-            case T_FOR: return "for";
-            case T_INT: return "int";
-            case T_ID: return "T_ID";
-            case T_NUM: return "number";
-            case T_AGAR: return "agar";
-            case T_WARNA: return "warna";
-            case T_WAPSI: return "wapsi";
-            case T_ASSIGN: return "=";
-            case T_PLUS: return "+";
-            case T_MINUS: return "-";
-            case T_MUL: return "*";
-            case T_DIV: return "/";
-            case T_LPAREN: return "(";
-            case T_RPAREN: return ")";
-            case T_LBRACE: return "{";
-            case T_RBRACE: return "}";
-            case T_SEMICOLON: return ";";
-            case T_LT: return "<";
-            case T_LE: return "<=";
-            case T_GT: return ">";
-            case T_GE: return ">=";
-            case T_EQ: return "==";
-            case T_NEQ: return "!=";
-            case T_AND: return "&&";
-            case T_OR: return "||";
-            case T_EOF: return "End of File";
-            case T_COUT: return "cout";
-            case T_LSHIFT: return "<<";
-            case T_STRING_LITERAL: return "T_STRING_LITERAL";
-            case T_VOID: return "T_VOID";
-            default: return "UNKNOWN_TOKEN";
+}
+
+// The input with its extension replaced by .asm
+string assemblyPathFor(const string &sourcePath) {
+    size_t slash = sourcePath.find_last_of("/\\");
+    size_t dot = sourcePath.rfind('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash) || dot == slash + 1) {
+        return sourcePath + ".asm";
+    }
+    return sourcePath.substr(0, dot) + ".asm";
+}
+
+// Compiles every input on the pool, each to its own .asm, and prints the
+// diagnostics afterwards in input order, so the output does not depend on
+// scheduling. Returns 1 if any file failed.
+int compileBatch(const vector<string> &inputs, const CompileOptions &options, unsigned threads, bool stats) {
+    vector<string> outputs;
+    map<string, size_t> owner;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        outputs.push_back(assemblyPathFor(inputs[i]));
+        if (outputs[i] == inputs[i]) {
+            cout << inputs[i] << ": input would be overwritten by its own output" << endl;
+            return 1;
+        }
+        auto inserted = owner.insert(make_pair(outputs[i], i));
+        if (!inserted.second) {
+            cout << inputs[inserted.first->second] << " and " << inputs[i] << " would both be compiled to "
+                 << outputs[i] << endl;
+            return 1;
         }
     }
 
+    auto start = chrono::steady_clock::now();
+    vector<string> diagnostics(inputs.size());
+    WorkStealingPool pool(threads);
+    pool.run(inputs.size(), [&](size_t i, unsigned) { diagnostics[i] = compileJob(inputs[i], outputs[i], options); });
 
-    string expectAndReturnValue(TokenType type) {
-        string value = tokens[pos].value;
-        expect(type);
-        return value;
+    size_t failed = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (diagnostics[i].empty()) continue;
+        cout << inputs[i] << ": " << diagnostics[i] << endl;
+        failed++;
+    }
+    if (stats) {
+        size_t used = min<size_t>(pool.threadCount(), inputs.size());
+        cout << "Compiled " << inputs.size() - failed << " of " << inputs.size() << " files in " << elapsedMs(start)
+             << " ms on " << used << (used == 1 ? " thread" : " threads") << ", peak RSS " << peakMemoryKB() << " KB"
+             << endl;
+    }
+    return failed ? 1 : 0;
+}
+
+// Appends the whitespace-separated paths listed in a response file
+bool readResponseFile(const string &path, vector<string> &inputs) {
+    ifstream in(path);
+    if (!in.is_open()) return false;
+    string input;
+    while (in >> input) inputs.push_back(input);
+    return true;
+}
+
+// Times every dispatch strategy with and without superinstructions on the
+// compiled program; its output is dropped. Best of three runs each.
+int benchmarkVm(const IntermediateCodeGnerator &icg) {
+    cout << "VM dispatch benchmark (best of 3 runs):" << endl;
+    for (bool superinstructions : {false, true}) {
+        BytecodeProgram program;
+        BytecodeCompiler compiler(icg, superinstructions);
+        if (!compiler.compile(program)) {
+            cout << compiler.error << endl;
+            return 1;
+        }
+        for (int d = VirtualMachine::DISPATCH_SWITCH; d <= VirtualMachine::DISPATCH_DIRECT; d++) {
+            VirtualMachine::Dispatch dispatch = VirtualMachine::Dispatch(d);
+            if (dispatch != VirtualMachine::DISPATCH_SWITCH && !VM_COMPUTED_GOTO) continue;
+            VirtualMachine vm(program);
+            vm.quiet = true;
+            double best = 0;
+            for (int run = 0; run < 3; run++) {
+                auto start = chrono::steady_clock::now();
+                vm.run(dispatch);
+                double ms = elapsedMs(start);
+                if (run == 0 || ms < best) best = ms;
+            }
+            if (!vm.error.empty()) {
+                cout << "Runtime error: " << vm.error << endl;
+                return 1;
+            }
+            char line[160];
+            snprintf(line, sizeof(line), "  %-7s %-19s %12llu instructions %10.2f ms %7.2f ns/instruction",
+                     VirtualMachine::dispatchName(dispatch), superinstructions ? "superinstructions" : "plain",
+                     (unsigned long long)vm.executed, best, vm.executed ? best * 1e6 / vm.executed : 0.0);
+            cout << line << endl;
+        }
+    }
+    return 0;
+}
+
+// Compiles source at level and runs it on the VM, or through the 16-bit
+// listing as --jit does, and returns what it printed.
+string selfTestRun(const string &source, int level, bool jit) {
+    Lexer lexer(source);
+    TokenStream tokens(lexer);
+    SymbolTable symTable;
+    IntermediateCodeGnerator icg;
+    Arena arena;
+    Parser parser(tokens, source, symTable, arena);
+    parser.quiet = true;
+    Lowering lowering(icg, symTable);
+    lowering.lowerProgram(parser.parseProgram());
+    TacOptimizer optimizer(icg);
+    optimizer.optimize(level);
+    ostringstream printed;
+    if (!jit) {
+        BytecodeProgram program;
+        BytecodeCompiler compiler(icg, true);
+        if (compiler.compile(program)) {
+            VirtualMachine vm(program);
+            streambuf *console = cout.rdbuf(printed.rdbuf());
+            vm.run(VirtualMachine::defaultDispatch());
+            cout.rdbuf(console);
+        }
+        return printed.str();
+    }
+#if JIT_SUPPORTED
+    RegisterAllocator allocator(icg);
+    if (level > 0) allocator.run();
+    AssemblyCodeGenerator codeGen;
+    codeGen.omitLeafFrames = level > 0;
+    codeGen.generateFromTAC(icg, level > 0 ? &allocator : nullptr);
+    if (level > 0) {
+        PeepholeOptimizer peepholeOptimizer(codeGen.assemblyInstructions);
+        peepholeOptimizer.run();
+    }
+    JitCompiler compiler(icg);
+    if (compiler.compile(codeGen.assemblyInstructions)) {
+        streambuf *console = cout.rdbuf(printed.rdbuf());
+        compiler.run();
+        cout.rdbuf(console);
+    }
+#endif
+    return printed.str();
+}
+
+// Checks the parts of the compiler that are easy to get subtly wrong. First
+// runs every vector scan kernel set the CPU supports against the scalar
+// reference, from every start offset of generated texts of 0 to 160 bytes,
+// so each block size is met whole, split and as a tail. Each text is mostly
+// one character with the others the kernels stop at (and their neighbours
+// in the ASCII table) sprinkled in at a few densities. It ends right before
+// an inaccessible page, so a kernel that reads past end faults instead of
+// agreeing by luck.
+int selfTest() {
+    static const char alphabet[] = " \t\n\r\x08\x0e" "09/:.azAZ@[`{_*\"\\\x80\xff";
+    const size_t LETTERS = sizeof(alphabet) - 1, MAX_LENGTH = 160, TEXTS = 48;
+    static const unsigned densities[] = {0, 2, 16, 128};      // Stops per 256 bytes
+
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t page = info.dwPageSize;
+    char *pages = (char *)VirtualAlloc(nullptr, 2 * page, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    DWORD previous;
+    if (!pages || !VirtualProtect(pages + page, page, PAGE_NOACCESS, &previous)) {
+#else
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *mapped = mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *pages = mapped == MAP_FAILED ? nullptr : (char *)mapped;
+    if (!pages || mprotect(pages + page, page, PROT_NONE) != 0) {
+#endif
+        cout << "Self-test: cannot set up a guard page" << endl;
+        return 1;
+    }
+    char *end = pages + page;
+
+    vector<const ScanKernels *> kernels;
+    for (const char *name : {"sse2", "avx2"}) {
+        if (const ScanKernels *k = selectScanKernels(name)) kernels.push_back(k);
+    }
+    const ScanKernels &reference = *selectScanKernels("scalar");
+    uint32_t random = 12345;
+    auto next = [&]() { return random = random * 1103515245u + 12345u, random >> 16; };
+    int failures = 0;
+    for (const ScanKernels *k : kernels) {
+        size_t checks = 0;
+        for (size_t length = 0; length <= MAX_LENGTH && failures == 0; length++) {
+            for (size_t t = 0; t < TEXTS && failures == 0; t++) {
+                char *text = end - length;
+                char fill = alphabet[next() % LETTERS];
+                unsigned density = densities[t % (sizeof(densities) / sizeof(densities[0]))];
+                for (size_t i = 0; i < length; i++) text[i] = next() % 256 < density ? alphabet[next() % LETTERS] : fill;
+                for (char *p = text; p <= end; p++) {
+                    auto check = [&](const char *kernel, const char *got, const char *want, uint32_t gotLines, uint32_t wantLines) {
+                        checks++;
+                        if (got == want && gotLines == wantLines) return;
+                        if (failures++ < 10) {
+                            cout << "Self-test: " << k->name << " " << kernel << " at offset " << p - text << " of "
+                                 << length << " bytes stopped at " << got - text << " (" << gotLines << " lines), scalar at "
+                                 << want - text << " (" << wantLines << " lines)" << endl;
+                        }
+                    };
+                    uint32_t gotLines = 0, wantLines = 0;
+                    const char *got = k->skipSpace(p, end, gotLines), *want = reference.skipSpace(p, end, wantLines);
+                    check("skipSpace", got, want, gotLines, wantLines);
+                    check("skipWord", k->skipWord(p, end), reference.skipWord(p, end), 0, 0);
+                    check("skipNumber", k->skipNumber(p, end), reference.skipNumber(p, end), 0, 0);
+                    check("findLineEnd", k->findLineEnd(p, end), reference.findLineEnd(p, end), 0, 0);
+                    gotLines = wantLines = 0;
+                    got = k->findCommentEnd(p, end, gotLines);
+                    want = reference.findCommentEnd(p, end, wantLines);
+                    check("findCommentEnd", got, want, gotLines, wantLines);
+                    check("findQuoteOrEscape", k->findQuoteOrEscape(p, end), reference.findQuoteOrEscape(p, end), 0, 0);
+                }
+            }
+        }
+        if (failures == 0) cout << "Scan kernels " << k->name << ": " << checks << " checks against scalar passed" << endl;
+    }
+    if (kernels.empty()) cout << "Scan kernels: no vector kernels on this CPU, nothing to compare" << endl;
+
+    // Every relation but != is false for NaN, in a branch as well as in a
+    // value, so lowering may not branch on the inverse of < and the like.
+    // The program runs on the VM at each level, with its output captured.
+    const string nanProgram =
+        "double z; double n; int i; z = 0.0; n = z / z;\n"
+        "agar (n < 1) { cout << \"lt\"; } agar (n >= 1) { cout << \"ge\"; }\n"
+        "agar (n <= 1) { cout << \"le\"; } agar (n > 1) { cout << \"gt\"; }\n"
+        "agar (n == n) { cout << \"eq\"; } agar (n != n) { cout << \"ne\"; }\n"
+        "agar (n < 1 || 1 <= n) { cout << \"or\"; }\n"
+        "i = n < 1; cout << i; i = n != n; cout << i;\n"
+        "jabtak (n < 1 && i < 3) { i = i + 1; } cout << i;\n"
+        "for (i = 0; n > i; i = i + 1) { cout << \"for\"; } cout << \"end\";\n";
+    const string nanOutput = "ne\n0\n1\n1\nend\n";
+    for (int level = 0; level <= 2; level++) {
+        string printed = selfTestRun(nanProgram, level, false);
+        if (printed != nanOutput) {
+            string got = printed, want = nanOutput;
+            replace(got.begin(), got.end(), '\n', ' ');
+            replace(want.begin(), want.end(), '\n', ' ');
+            cout << "Self-test: NaN comparisons at -O" << level << " printed '" << got << "', expected '" << want << "'" << endl;
+            failures++;
+        }
+    }
+    if (failures == 0) cout << "NaN comparisons: -O0, -O1 and -O2 on the VM passed" << endl;
+
+    // Globals spelled like temps and labels must keep their own storage in
+    // the 16-bit listing, which --jit runs, while the expression around them
+    // fills temps of the same names.
+    const string namesProgram =
+        "int t0; int t1; int t2; int t3; int t4; int t5; int t6; int t7; int t8; int L1; int L2;\n"
+        "int main() { int a; int b; int c; a = 3; b = 4; c = 5;\n"
+        "t0 = 100; t1 = 101; t2 = 102; t3 = 103; t4 = 104; t5 = 105; t6 = 106; t7 = 107; t8 = 108; L1 = 7; L2 = 0;\n"
+        "a = (a * b + c * a) * (b - c) + (a + b) * (c + a) - t0 + t1 * L1;\n"
+        "jabtak (L2 < 3) { L2 = L2 + 1; }\n"
+        "cout << a; cout << t0; cout << t1; cout << t2; cout << t3; cout << t4; cout << t5; cout << t6;\n"
+        "cout << t7; cout << t8; cout << L1; cout << L2; wapsi 0; }\n";
+    const string namesOutput = "636\n100\n101\n102\n103\n104\n105\n106\n107\n108\n7\n3\n";
+    int namesFailures = failures;
+    for (int level = 0; level <= 2; level++) {
+        for (int backend = 0; backend <= JIT_SUPPORTED; backend++) {
+            bool jit = backend == 1;
+            string printed = selfTestRun(namesProgram, level, jit);
+            if (printed == namesOutput) continue;
+            replace(printed.begin(), printed.end(), '\n', ' ');
+            cout << "Self-test: globals named like temps at -O" << level << (jit ? " with --jit" : " on the VM")
+                 << " printed '" << printed << "'" << endl;
+            failures++;
+        }
+    }
+    if (failures == namesFailures) {
+        cout << "Globals named like temps: -O0, -O1 and -O2 on the VM" << (JIT_SUPPORTED ? " and --jit" : "") << " passed"
+             << endl;
+    }
+
+#ifdef _WIN32
+    VirtualFree(pages, 0, MEM_RELEASE);
+#else
+    munmap(pages, 2 * page);
+#endif
+    return failures == 0 ? 0 : 1;
+}
+
+// Parses and lowers generated programs that stress expression nesting: a
+// statement with a million-term expression over every binary operator, a
+// condition chaining a million comparisons with && and ||, and an
+// expression nested in 100k parentheses. Both the parser and the lowering
+// keep their own stacks, so these take linear time and a bounded amount of
+// native stack.
+int benchmarkParser(const ScanKernels *scan) {
+    const int TERMS = 1000000, DEPTH = 100000;
+    static const char *const operators[] = {"+", "*", "-", "/", "<", "<=", ">", ">=", "==", "!=", "&&", "||"};
+    const size_t OPERATORS = sizeof(operators) / sizeof(operators[0]);
+    string prologue = "int x; int y; x = 1; y = 2;\n";
+    vector<pair<string, string>> cases;
+
+    string terms = prologue + "x = x";
+    for (int i = 1; i < TERMS; i++) {
+        terms += string(" ") + operators[i % OPERATORS] + " " + (i % 3 == 0 ? "y" : to_string(i % 10));
+    }
+    cases.push_back(make_pair("1M terms, all operators", terms + ";\n"));
+
+    string chain = prologue + "agar (x < 0";
+    for (int i = 1; i < TERMS; i++) {
+        chain += string(i % 2 ? " || " : " && ") + (i % 3 == 0 ? "y >= " : "x != ") + to_string(i % 10);
+    }
+    cases.push_back(make_pair("1M-term && / || chain", chain + ") { x = 0; }\n"));
+
+    string nested = prologue + "x = ";
+    for (int i = 0; i < DEPTH; i++) nested += string("(") + (i % 2 ? "y" : "x") + " " + operators[i % OPERATORS] + " ";
+    nested += "1" + string(DEPTH, ')');
+    cases.push_back(make_pair("100k-deep parentheses", nested + ";\n"));
+
+    cout << "Parser benchmark:" << endl;
+    for (const pair<string, string> &c : cases) {
+        auto parseStart = chrono::steady_clock::now();
+        Lexer lexer(c.second, scan);
+        TokenStream tokens(lexer);
+        SymbolTable symTable;
+        IntermediateCodeGnerator icg;
+        Arena arena;
+        Parser parser(tokens, c.second, symTable, arena);
+        parser.quiet = true;
+        Stmt *program = parser.parseProgram();
+        double parseMs = elapsedMs(parseStart);
+        auto lowerStart = chrono::steady_clock::now();
+        Lowering lowering(icg, symTable);
+        lowering.lowerProgram(program);
+        double lowerMs = elapsedMs(lowerStart);
+        char line[200];
+        snprintf(line, sizeof(line), "  %-24s %8zu KB %9zu tokens %9zu nodes %9zu quads  parse %8.2f ms  lower %8.2f ms",
+                 c.first.c_str(), c.second.size() / 1024, tokens.tokensConsumed(), arena.nodeCount(),
+                 icg.instructions.size(), parseMs, lowerMs);
+        cout << line << endl;
+    }
+    cout << "Peak RSS " << peakMemoryKB() << " KB" << endl;
+    return 0;
+}
+
+// Optimizes and translates a generated program of 10,000 functions at -O2
+// with 1, 2, 4, ... threads up to maxThreads, and checks that every thread
+// count gives the same TAC and the same listings. Each function has a
+// counted loop, a while loop, branches, double arithmetic and a print, and
+// every third one calls the one before it, so the inliner has work too.
+int benchmarkFunctions(const ScanKernels *scan, unsigned maxThreads) {
+    const int FUNCTIONS = 10000;
+    string source = "int g; int h; double d; g = 1; h = 2; d = 0.5;\n";
+    for (int f = 0; f < FUNCTIONS; f++) {
+        string k = to_string(f % 7 + 2);
+        source += "int f" + to_string(f) + "() { int i; int s; int t; s = " + to_string(f % 13) + "; t = g + " +
+                  to_string(f % 5) + "; for (i = 0; i < " + to_string(10 + f % 50) + "; i = i + 1) { s = s + i * " + k +
+                  " + (t * g) / " + k + "; agar (s > " + to_string(100 + f) + " && i != 3) { t = t + s - 1; } warna { t = t - 1; } } " +
+                  "jabtak (t > 0) { t = t - " + k + "; g = g + h * " + k + "; } d = d * 1.5 + " + to_string(f % 9) + ".25; " +
+                  (f > 0 && f % 3 == 0 ? "f" + to_string(f - 1) + "(); " : "") + "agar (s < g) { cout << \"f" + to_string(f) +
+                  "\"; } h = s + t * 2 + g; wapsi s; }\n";
+    }
+    source += "int main() { f" + to_string(FUNCTIONS - 1) + "(); cout << g; cout << h; cout << d; wapsi 0; }\n";
+
+    Lexer lexer(source, scan);
+    TokenStream tokens(lexer);
+    SymbolTable symTable;
+    IntermediateCodeGnerator lowered;
+    {
+        Arena arena;
+        Parser parser(tokens, source, symTable, arena);
+        parser.quiet = true;
+        Stmt *program = parser.parseProgram();
+        Lowering lowering(lowered, symTable);
+        lowering.lowerProgram(program);
     }
-};
+
+    vector<unsigned> counts;
+    for (unsigned n = 1; n < maxThreads; n *= 2) counts.push_back(n);
+    counts.push_back(maxThreads);
+    cout << "Function-parallel benchmark, " << FUNCTIONS << " functions, " << lowered.instructions.size()
+         << " quads at -O2:" << endl;
+    vector<Quad> firstTac;
+    vector<string> first16, firstX64;
+    double serialMs = 0;
+    for (unsigned threads : counts) {
+        IntermediateCodeGnerator icg = lowered;
+        auto start = chrono::steady_clock::now();
+        TacOptimizer optimizer(icg);
+        optimizer.threads = threads;
+        optimizer.optimize(2);
+        double optimizeMs = elapsedMs(start);
+        start = chrono::steady_clock::now();
+        RegisterAllocator allocator(icg);
+        allocator.threads = threads;
+        allocator.run();
+        double allocateMs = elapsedMs(start);
+        start = chrono::steady_clock::now();
+        AssemblyCodeGenerator codeGen;
+        codeGen.omitLeafFrames = true;
+        codeGen.threads = threads;
+        codeGen.generateFromTAC(icg, &allocator);
+        double codeGenMs = elapsedMs(start);
+        start = chrono::steady_clock::now();
+        X64CodeGenerator x64CodeGen;
+        x64CodeGen.omitLeafFrames = true;
+        x64CodeGen.threads = threads;
+        x64CodeGen.generateFromTAC(icg, &allocator);
+        double x64Ms = elapsedMs(start);
+        double totalMs = optimizeMs + allocateMs + codeGenMs + x64Ms;
+
+        bool same = true;
+        if (threads == counts[0]) {
+            firstTac = icg.instructions;
+            first16 = codeGen.assemblyInstructions;
+            firstX64 = x64CodeGen.listing();
+            serialMs = totalMs;
+        } else {
+            same = icg.instructions.size() == firstTac.size() &&
+                   equal(firstTac.begin(), firstTac.end(), icg.instructions.begin(), [](const Quad &a, const Quad &b) {
+                       return a.op == b.op && a.dst == b.dst && a.a == b.a && a.b == b.b;
+                   }) &&
+                   codeGen.assemblyInstructions == first16 && x64CodeGen.listing() == firstX64;
+        }
+        char line[200];
+        snprintf(line, sizeof(line), "  %3u %-7s  optimize %8.1f ms  allocate %7.1f ms  16-bit %7.1f ms  x86-64 %7.1f ms"
+                 "  total %8.1f ms  %5.2fx  %s", threads, threads == 1 ? "thread" : "threads", optimizeMs, allocateMs, codeGenMs, x64Ms, totalMs,
+                 serialMs / totalMs, same ? "same output" : "OUTPUT DIFFERS");
+        cout << line << endl;
+        if (!same) return 1;
+    }
+    cout << "Peak RSS " << peakMemoryKB() << " KB" << endl;
+    return 0;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    vector<string> inputs;
+    bool responseFile = false;
+    unsigned threads = WorkStealingPool::hardwareThreads();
+    bool emitTac = false;
+    bool emitCfg = false;
+    bool stats = false;
+    int optLevel = 0;
+    int unroll = 4;
+    bool run = false;       // Execute on the bytecode VM instead of generating assembly
+    bool benchVm = false;
+    bool benchParser = false;
+    bool benchFunctions = false;
+    bool selfCheck = false;
+    bool jit = false;       // Assemble the listing in memory and run it
+    bool x64 = false;       // NASM for x86-64 Linux instead of the 16-bit listing
+    VirtualMachine::Dispatch dispatch = VirtualMachine::defaultDispatch();
+    string peephole;        // Pattern list; defaults to all of them from -O1 on
+    string isel;            // x86-64 instruction selection; tree from -O1 on, else template
+    const ScanKernels *scan = selectScanKernels();
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--emit-tac") emitTac = true;
+        else if (arg == "--emit-cfg") emitCfg = true;
+        else if (arg == "--stats") stats = true;
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2") optLevel = arg[2] - '0';
+        else if (arg.rfind("--peephole=", 0) == 0) peephole = arg.substr(11);
+        else if (arg == "--run") run = true;
+        else if (arg == "--bench-vm") benchVm = true;
+        else if (arg == "--bench-parser") benchParser = true;
+        else if (arg == "--bench-functions") benchFunctions = true;
+        else if (arg == "--self-test") selfCheck = true;
+        else if (arg == "--jit") jit = true;
+        else if (arg.rfind("--target=", 0) == 0) {
+            if (arg != "--target=x86-64" && arg != "--target=16") {
+                cout << "Unknown target: " << arg.substr(9) << ", expected 16 or x86-64" << endl;
+                return 1;
+            }
+            x64 = arg == "--target=x86-64";
+        }
+        else if (arg.rfind("--isel=", 0) == 0) {
+            isel = arg.substr(7);
+            if (isel != "tree" && isel != "template") {
+                cout << "Unknown instruction selection: " << isel << ", expected tree or template" << endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--dispatch=", 0) == 0) {
+            if (!VirtualMachine::parseDispatch(arg.substr(11), dispatch)) {
+                cout << "Unsupported dispatch: " << arg.substr(11) << endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--unroll=", 0) == 0) {
+            unroll = atoi(arg.c_str() + 9);
+            if (unroll < 1) {
+                cout << "Invalid unroll factor: " << arg.substr(9) << endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--scan=", 0) == 0) {
+            scan = selectScanKernels(arg.substr(7));
+            if (!scan) {
+                cout << "Unsupported scanner: " << arg.substr(7) << endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--jobs=", 0) == 0) {
+            int n = atoi(arg.c_str() + 7);
+            if (n < 1) {
+                cout << "Invalid number of jobs: " << arg.substr(7) << endl;
+                return 1;
+            }
+            threads = (unsigned)n;
+        }
+        else if (arg[0] == '@') {
+            if (!readResponseFile(arg.substr(1), inputs)) {
+                cout << "Error opening response file: " << arg.substr(1) << endl;
+                return 1;
+            }
+            responseFile = true;
+        }
+        else inputs.push_back(arg);
+    }
+    if (benchParser) return benchmarkParser(scan);
+    if (benchFunctions) return benchmarkFunctions(scan, threads);
+    if (selfCheck) return selfTest();
+    if (inputs.empty()) {
         cout << "Please provide a source file." << endl;
         return 1;
     }
-
-    ifstream file(argv[1]);
-    if (!file.is_open()) {
-        cout << "Error opening file." << endl;
+    if (peephole.empty()) peephole = optLevel > 0 ? "all" : "none";
+    if (isel.empty()) isel = optLevel > 0 ? "tree" : "template";
+    vector<string> noCode;
+    if (!PeepholeOptimizer(noCode).select(peephole)) {
+        cout << "Unknown peephole pattern in '" << peephole << "', expected all, none or a list of: "
+             << PeepholeOptimizer(noCode).patternNames() << endl;
         return 1;
     }
 
-    string input((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    file.close();
+    // Several inputs: one .asm next to each, compiled in parallel
+    if (inputs.size() > 1 || responseFile) {
+        if (emitTac || emitCfg || run || benchVm || jit) {
+            cout << "--emit-tac, --emit-cfg, --run, --bench-vm and --jit take a single source file" << endl;
+            return 1;
+        }
+        CompileOptions options;
+        options.optLevel = optLevel;
+        options.unroll = unroll;
+        options.x64 = x64;
+        options.peephole = peephole;
+        options.isel = isel;
+        options.scan = scan;
+        return compileBatch(inputs, options, threads, stats);
+    }
+
+    try {
+        const string &sourcePath = inputs[0];
 
-    Lexer lexer(input);
-    vector<Token> tokens = lexer.tokenize();
+        SourceFile file;
+        if (!file.open(sourcePath)) {
+            cout << "Error opening file." << endl;
+            return 1;
+        }
 
-    SymbolTable symTable;
-    IntermediateCodeGnerator icg;
-    Parser parser(tokens, symTable, icg);
-    
-    parser.parseProgram();
-    icg.printInstructions();
+        auto parseStart = chrono::steady_clock::now();
+        Lexer lexer(file.text(), scan);
+        TokenStream tokens(lexer);
 
-    // Generate Assembly Code
-    AssemblyCodeGenerator codeGen;
-    codeGen.generateFromTAC(icg.instructions);
-    cout << endl << endl << "ASSEMBLY CODE" << endl;
-    codeGen.printAssemblyCode();
+        SymbolTable symTable;
+        IntermediateCodeGnerator icg;
+        {
+            Arena arena;    // The AST is freed as soon as it has been lowered
+            Parser parser(tokens, file.text(), symTable, arena);
+            Stmt *program = parser.parseProgram();
+            if (stats) {
+                cout << "Lexed and parsed " << tokens.tokensConsumed() << " tokens in " << elapsedMs(parseStart) << " ms ("
+                     << scan->name << "), AST " << arena.nodeCount() << " nodes in " << arena.bytesUsed() / 1024
+                     << " KB, peak RSS " << peakMemoryKB() << " KB" << endl;
+            }
+
+            Lowering lowering(icg, symTable);
+            lowering.lowerProgram(program);
+        }
 
-    // Save assembly code to a file
-    codeGen.saveToFile("output.asm");
+        TacOptimizer optimizer(icg);
+        optimizer.unrollFactor = unroll;
+        optimizer.threads = threads;
+        optimizer.optimize(optLevel);
+        if (stats && optLevel > 0) {
+            cout << "Optimization report (-O" << optLevel << "):" << endl;
+            optimizer.printReport();
+        }
+        if (emitTac) icg.printInstructions();
+        if (emitCfg) printControlFlow(icg);
 
-    return 0;
+        if (benchVm) return benchmarkVm(icg);
+        if (run) {
+            auto compileStart = chrono::steady_clock::now();
+            BytecodeProgram program;
+            BytecodeCompiler compiler(icg, true);
+            if (!compiler.compile(program)) {
+                cout << compiler.error << endl;
+                return 1;
+            }
+            double compileMs = elapsedMs(compileStart);
+            VirtualMachine vm(program);
+            auto runStart = chrono::steady_clock::now();
+            int status = vm.run(dispatch);
+            if (!vm.error.empty()) {
+                cout << "Runtime error: " << vm.error << endl;
+                status = 1;
+            }
+            if (stats) {
+                cout << "Bytecode: " << program.code.size() << " instructions (" << program.superinstructions
+                     << " superinstructions), " << program.functions.size() << " functions, compiled in " << compileMs
+                     << " ms" << endl;
+                cout << "VM: " << vm.executed << " instructions executed in " << elapsedMs(runStart) << " ms ("
+                     << VirtualMachine::dispatchName(dispatch) << " dispatch)" << endl;
+            }
+            return status;
+        }
+
+        // -O0 keeps every value in memory
+        RegisterAllocator allocator(icg);
+        allocator.threads = threads;
+        if (optLevel > 0) {
+            allocator.run();
+            if (stats) allocator.printReport();
+        }
+
+        // Generate Assembly Code; the JIT runs the 16-bit listing
+        if (jit && x64) {
+            cout << "--jit cannot be combined with --target=x86-64" << endl;
+            return 1;
+        }
+        AssemblyCodeGenerator codeGen;
+        X64CodeGenerator x64CodeGen;
+        codeGen.omitLeafFrames = x64CodeGen.omitLeafFrames = optLevel > 0;
+        codeGen.threads = x64CodeGen.threads = threads;
+        if (!x64) {
+            codeGen.generateFromTAC(icg, optLevel > 0 ? &allocator : nullptr);
+        } else {
+            x64CodeGen.treeSelection = isel == "tree";
+            x64CodeGen.generateFromTAC(icg, optLevel > 0 ? &allocator : nullptr);
+            if (stats) {
+                X64CodeGenerator other;
+                other.treeSelection = !x64CodeGen.treeSelection;
+                other.omitLeafFrames = x64CodeGen.omitLeafFrames;
+                other.threads = threads;
+                other.generateFromTAC(icg, optLevel > 0 ? &allocator : nullptr);
+                size_t tree = x64CodeGen.treeSelection ? x64CodeGen.instructionCount() : other.instructionCount();
+                size_t perQuad = x64CodeGen.treeSelection ? other.instructionCount() : x64CodeGen.instructionCount();
+                cout << "Instruction selection (" << isel << "): " << tree << " instructions with tree patterns, "
+                     << perQuad << " with one template per quad, " << (long long)perQuad - (long long)tree << " saved"
+                     << endl;
+            }
+        }
+
+        PeepholeOptimizer peepholeOptimizer(x64 ? x64CodeGen.text : codeGen.assemblyInstructions);
+        peepholeOptimizer.select(peephole);
+        if (peephole != "none") {
+            peepholeOptimizer.run();
+            if (stats) peepholeOptimizer.printReport();
+        }
+        if (jit) {
+#if JIT_SUPPORTED
+            auto compileStart = chrono::steady_clock::now();
+            JitCompiler compiler(icg);
+            if (!compiler.compile(codeGen.assemblyInstructions)) {
+                cout << "JIT error: " << compiler.error << endl;
+                return 1;
+            }
+            double compileMs = elapsedMs(compileStart);
+            auto runStart = chrono::steady_clock::now();
+            int status = (int)compiler.run();
+            if (stats) {
+                cout << "JIT: " << codeGen.assemblyInstructions.size() << " assembly lines to " << compiler.codeSize
+                     << " bytes of code and " << compiler.slots << " data slots, compiled in " << compileMs << " ms" << endl;
+                cout << "JIT: ran in " << elapsedMs(runStart) << " ms" << endl;
+            }
+            return status;
+#else
+            cout << "--jit needs an x86-64 Linux or macOS host" << endl;
+            return 1;
+#endif
+        }
+        cout << endl << endl << "ASSEMBLY CODE" << endl;
+        if (x64) x64CodeGen.printAssemblyCode();
+        else codeGen.printAssemblyCode();
+
+        // Save assembly code to a file
+        if (!(x64 ? x64CodeGen.saveToFile("output.asm") : codeGen.saveToFile("output.asm"))) {
+            cout << "Error opening file for writing: output.asm" << endl;
+        }
+
+        if (stats) cout << "Peak RSS " << peakMemoryKB() << " KB" << endl;
+        return 0;
+    } catch (const CompileError &error) {
+        cout << error.what() << endl;
+        return 1;
+    }
 }